@@ -0,0 +1,348 @@
+#include "vault.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// fast enough that opening a vault measures the vault and not the KDF, never
+// use these for real data
+constexpr Crypto::KdfParams BENCH_KDF_PARAMS = {static_cast<u64>(8 * 1024), 1,
+                                                1};
+constexpr const char *BENCH_PASSWORD = "benchmark";
+
+constexpr u64 ENTRY_COUNTS[] = {100, 1000, 10000};
+constexpr u64 ENTRY_SIZES[] = {static_cast<u64>(1024),
+                               static_cast<u64>(64 * 1024),
+                               static_cast<u64>(1024 * 1024)};
+// grid points with more data than this are skipped
+constexpr u64 MAX_VAULT_SIZE = static_cast<u64>(256 * 1024 * 1024);
+
+constexpr const char *USAGE =
+    R"(usage: dull_bench [options]
+
+options:
+  -o, --output FILE        write the JSON results to FILE instead of stdout
+  -d, --dir DIR            scratch directory, defaults to the system temp
+  -r, --repetitions N      timed runs of every benchmark, defaults to 10
+  -f, --filter TEXT        only run benchmarks whose name contains TEXT
+  -b, --backend NAME       stream, pread or mmap
+  -j, --jobs N             vault threads, 0 for one per core (default)
+)";
+
+struct Options {
+  std::string output;
+  std::filesystem::path dir =
+      std::filesystem::temp_directory_path() / "dull-bench";
+  u64 repetitions = 10;
+  std::string filter;
+  IOBackend backend = DEFAULT_IO_BACKEND;
+  u32 jobs = 0;
+};
+
+struct Result {
+  std::string name;
+  u64 entries;
+  u64 entry_size;
+  // bytes each run moves, 0 when throughput makes no sense
+  u64 bytes;
+  std::vector<f64> samples_ns;
+};
+
+bool parse_args(int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::invalid_argument(arg + " needs a value");
+      }
+      return argv[++i];
+    };
+
+    if (arg == "-o" || arg == "--output") {
+      options.output = value();
+    } else if (arg == "-d" || arg == "--dir") {
+      options.dir = std::filesystem::path(value()) / "dull-bench";
+    } else if (arg == "-r" || arg == "--repetitions") {
+      options.repetitions = std::max<u64>(std::stoull(value()), 1);
+    } else if (arg == "-f" || arg == "--filter") {
+      options.filter = value();
+    } else if (arg == "-b" || arg == "--backend") {
+      std::string name = value();
+      if (name == "stream") {
+        options.backend = IOBackend::Stream;
+      } else if (name == "pread") {
+        options.backend = IOBackend::Pread;
+      } else if (name == "mmap") {
+        options.backend = IOBackend::Mmap;
+      } else {
+        throw std::invalid_argument("unknown backend " + name);
+      }
+    } else if (arg == "-j" || arg == "--jobs") {
+      options.jobs = static_cast<u32>(std::stoul(value()));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+const char *backend_name(IOBackend backend) {
+  switch (backend) {
+  case IOBackend::Stream:
+    return "stream";
+  case IOBackend::Pread:
+    return "pread";
+  case IOBackend::Mmap:
+    return "mmap";
+  }
+  return "unknown";
+}
+
+// random, so it doesn't compress or deduplicate, but the same for every run
+std::string make_content(std::mt19937_64 &rng, u64 size) {
+  std::string content(size, '\0');
+  for (u64 i = 0; i < size; i += sizeof(u64)) {
+    u64 value = rng();
+    std::copy_n(reinterpret_cast<const char *>(&value),
+                std::min<u64>(sizeof(u64), size - i), content.data() + i);
+  }
+  return content;
+}
+
+std::string entry_name(u64 index) { return "entry-" + std::to_string(index); }
+
+f64 elapsed_ns(Clock::time_point start) {
+  return std::chrono::duration<f64, std::nano>(Clock::now() - start).count();
+}
+
+f64 time_ns(const std::function<void()> &fn) {
+  auto start = Clock::now();
+  fn();
+  return elapsed_ns(start);
+}
+
+f64 median(std::vector<f64> samples) {
+  std::sort(samples.begin(), samples.end());
+  u64 middle = samples.size() / 2;
+  return samples.size() % 2 == 1 ? samples[middle]
+                                 : (samples[middle - 1] + samples[middle]) / 2;
+}
+
+// one vault from the grid and every benchmark run against it
+class Bench {
+public:
+  Bench(const Options &options, u64 entries, u64 entry_size)
+      : m_options(options), m_entries(entries), m_entry_size(entry_size),
+        m_dir(options.dir / (std::to_string(entries) + "x" +
+                             std::to_string(entry_size))),
+        m_path((m_dir / "bench.dull").string()), m_rng(entries ^ entry_size) {}
+
+  ~Bench() {
+    m_vault.reset();
+    std::error_code ec;
+    std::filesystem::remove_all(m_dir, ec);
+  }
+
+  Bench(const Bench &) = delete;
+  Bench &operator=(const Bench &) = delete;
+
+  void run(std::vector<Result> &results) {
+    std::filesystem::remove_all(m_dir);
+    std::filesystem::create_directories(m_dir);
+    populate();
+
+    // before the vault is kept open, so nothing is cached by this process
+    add(results, "open", 0, [&]() {
+      return time_ns([&]() {
+        Vault vault(m_path, BENCH_PASSWORD, m_options.backend);
+      });
+    });
+
+    m_vault = std::make_unique<Vault>(m_path, BENCH_PASSWORD,
+                                      m_options.backend);
+    m_vault->set_threads(m_options.jobs);
+
+    add(results, "read_file_headers", 0, [&]() {
+      return time_ns([&]() { m_vault->read_file_headers(); });
+    });
+    add(results, "read_file_hit", m_entry_size, [&]() {
+      auto name = random_entry();
+      return time_ns([&]() { ASSERT(m_vault->read_file(name)); });
+    });
+    add(results, "read_file_miss", 0, [&]() {
+      return time_ns([&]() { ASSERT(!m_vault->read_file("missing")); });
+    });
+    add(results, "create_file", m_entry_size, [&]() {
+      auto content = make_content(m_rng, m_entry_size);
+      f64 ns = time_ns([&]() { m_vault->create_file("created", content); });
+      m_vault->delete_file("created");
+      return ns;
+    });
+    for (auto [name, position] : {std::pair{"delete_file_first", 0.0},
+                                  std::pair{"delete_file_middle", 0.5},
+                                  std::pair{"delete_file_last", 1.0}}) {
+      add(results, name, 0, [&, position]() {
+        auto victim = entry_at(position);
+        f64 ns = time_ns([&]() { m_vault->delete_file(victim); });
+        // put it back at the end so the entry count stays the same
+        m_vault->create_file(victim, make_content(m_rng, m_entry_size));
+        return ns;
+      });
+    }
+    add(results, "update_file", m_entry_size, [&]() {
+      auto name = random_entry();
+      auto content = make_content(m_rng, m_entry_size);
+      return time_ns([&]() { m_vault->update_file(name, content); });
+    });
+    // after all the writes above, so compaction is measured too
+    add(results, "compact", 0, [&]() {
+      auto name = random_entry();
+      m_vault->update_file(name, make_content(m_rng, m_entry_size));
+      return time_ns([&]() { m_vault->compact(); });
+    });
+    add(results, "extract_all", m_entries * m_entry_size, [&]() {
+      auto out = m_dir / "extracted";
+      std::filesystem::create_directories(out);
+      f64 ns = time_ns([&]() { ASSERT(m_vault->extract_all(out.string())); });
+      std::filesystem::remove_all(out);
+      return ns;
+    });
+  }
+
+private:
+  const Options &m_options;
+  u64 m_entries;
+  u64 m_entry_size;
+  std::filesystem::path m_dir;
+  std::string m_path;
+  std::mt19937_64 m_rng;
+  std::unique_ptr<Vault> m_vault;
+
+  // writes the source files out once and imports them in one batch
+  void populate() {
+    auto source = m_dir / "source";
+    std::filesystem::create_directories(source);
+
+    std::vector<ImportFile> files;
+    files.reserve(m_entries);
+    for (u64 i = 0; i < m_entries; i++) {
+      auto path = (source / entry_name(i)).string();
+      std::ofstream file(path, std::ios::binary);
+      auto content = make_content(m_rng, m_entry_size);
+      ASSERT(file.write(content.data(), static_cast<i64>(content.size())));
+      files.push_back({entry_name(i), path});
+    }
+
+    auto vault = Vault::create(m_path, BENCH_PASSWORD, BENCH_KDF_PARAMS,
+                               m_options.backend);
+    vault->set_threads(m_options.jobs);
+    vault->create_files(files);
+    std::filesystem::remove_all(source);
+  }
+
+  std::string random_entry() { return entry_name(m_rng() % m_entries); }
+
+  // the entry at `position` (0 to 1) of the file, by offset
+  std::string entry_at(f64 position) {
+    auto headers = m_vault->read_file_headers();
+    std::sort(headers.begin(), headers.end(),
+              [](const auto &a, const auto &b) { return a.offset < b.offset; });
+    auto last = static_cast<f64>(headers.size() - 1);
+    return headers[static_cast<u64>(position * last)].name;
+  }
+
+  void add(std::vector<Result> &results, const std::string &name, u64 bytes,
+           const std::function<f64()> &fn) {
+    if (name.find(m_options.filter) == std::string::npos) {
+      return;
+    }
+
+    Result result{name, m_entries, m_entry_size, bytes, {}};
+    // one untimed run to warm up the page cache and the thread pool
+    fn();
+    for (u64 i = 0; i < m_options.repetitions; i++) {
+      result.samples_ns.push_back(fn());
+    }
+    std::cerr << name << " " << m_entries << "x" << m_entry_size << ": "
+              << median(result.samples_ns) / 1e6 << " ms\n";
+    results.push_back(std::move(result));
+  }
+};
+
+void write_json(std::ostream &out, const Options &options,
+                const std::vector<Result> &results) {
+  out << "{\n";
+  out << "  \"backend\": \"" << backend_name(options.backend) << "\",\n";
+  out << "  \"jobs\": " << options.jobs << ",\n";
+  out << "  \"repetitions\": " << options.repetitions << ",\n";
+  out << "  \"results\": [";
+  for (u64 i = 0; i < results.size(); i++) {
+    const auto &result = results[i];
+    auto [min, max] = std::minmax_element(result.samples_ns.begin(),
+                                          result.samples_ns.end());
+    f64 mean = 0;
+    for (f64 sample : result.samples_ns) {
+      mean += sample / static_cast<f64>(result.samples_ns.size());
+    }
+    f64 median_ns = median(result.samples_ns);
+
+    out << (i == 0 ? "\n" : ",\n");
+    out << "    {\"name\": \"" << result.name << "\", ";
+    out << "\"entries\": " << result.entries << ", ";
+    out << "\"entry_size\": " << result.entry_size << ", ";
+    out << "\"median_ns\": " << static_cast<u64>(median_ns) << ", ";
+    out << "\"mean_ns\": " << static_cast<u64>(mean) << ", ";
+    out << "\"min_ns\": " << static_cast<u64>(*min) << ", ";
+    out << "\"max_ns\": " << static_cast<u64>(*max);
+    if (result.bytes > 0) {
+      out << ", \"bytes_per_second\": "
+          << static_cast<u64>(static_cast<f64>(result.bytes) / median_ns * 1e9);
+    }
+    out << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  try {
+    if (!parse_args(argc, argv, options)) {
+      std::cerr << USAGE;
+      return 2;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "dull_bench: " << e.what() << "\n\n" << USAGE;
+    return 2;
+  }
+
+  std::vector<Result> results;
+  for (u64 entries : ENTRY_COUNTS) {
+    for (u64 entry_size : ENTRY_SIZES) {
+      if (entries * entry_size > MAX_VAULT_SIZE) {
+        continue;
+      }
+      Bench(options, entries, entry_size).run(results);
+    }
+  }
+  std::filesystem::remove_all(options.dir);
+
+  if (options.output.empty()) {
+    write_json(std::cout, options, results);
+  } else {
+    std::ofstream out(options.output);
+    ASSERT(out.good());
+    write_json(out, options, results);
+  }
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include "chunkcache.h"
+
+ChunkCache::Chunk ChunkCache::find(const CacheOwner &owner, u64 index) {
+  std::lock_guard lock(m_mutex);
+  auto it = m_entries.find({owner, index});
+  if (it == m_entries.end()) {
+    m_misses++;
+    return nullptr;
+  }
+  m_hits++;
+  m_uses.splice(m_uses.begin(), m_uses, it->second.use);
+  return it->second.chunk;
+}
+
+void ChunkCache::insert(const CacheOwner &owner, u64 index,
+                        Botan::secure_vector<u8> chunk) {
+  std::lock_guard lock(m_mutex);
+  if (m_budget == 0 || chunk.size() > m_budget) {
+    return;
+  }
+
+  // two readers can miss the same chunk, the second one's copy is dropped
+  Key key = {owner, index};
+  if (m_entries.count(key) != 0) {
+    return;
+  }
+  m_size += chunk.size();
+  m_uses.push_front(key);
+  m_entries.emplace(
+      key,
+      Entry{std::make_shared<const Botan::secure_vector<u8>>(std::move(chunk)),
+            m_uses.begin()});
+  evict();
+}
+
+void ChunkCache::erase(const CacheOwner &owner) {
+  std::lock_guard lock(m_mutex);
+  auto it = m_entries.lower_bound({owner, 0});
+  while (it != m_entries.end() && it->first.first == owner) {
+    remove(it++);
+  }
+}
+
+void ChunkCache::clear() {
+  std::lock_guard lock(m_mutex);
+  m_entries.clear();
+  m_uses.clear();
+  m_size = 0;
+}
+
+void ChunkCache::set_budget(u64 budget) {
+  std::lock_guard lock(m_mutex);
+  m_budget = budget;
+  evict();
+}
+
+CacheStats ChunkCache::stats() const {
+  std::lock_guard lock(m_mutex);
+  return {m_hits, m_misses, m_size, m_budget};
+}
+
+void ChunkCache::remove(std::map<Key, Entry>::iterator it) {
+  m_size -= it->second.chunk->size();
+  m_uses.erase(it->second.use);
+  m_entries.erase(it);
+}
+
+void ChunkCache::evict() {
+  while (m_size > m_budget) {
+    remove(m_entries.find(m_uses.back()));
+  }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+#include <array>
+#include <botan/secmem.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// what cached plaintext was decrypted from: an entry's content nonce, padded
+// with zeros, or a shared chunk's id. neither changes while it's stored.
+using CacheOwner = std::array<u8, 32>;
+
+constexpr u64 DEFAULT_CACHE_SIZE = static_cast<u64>(64 * 1024 * 1024);
+
+struct CacheStats {
+  u64 hits;
+  u64 misses;
+  // plaintext bytes held, out of budget
+  u64 size;
+  u64 budget;
+};
+
+// Decrypted chunks, the least recently used ones dropped once they take up
+// more than the budget. Held in secure_vector, so they're wiped when they
+// go. Safe to share between threads.
+class ChunkCache {
+public:
+  using Chunk = std::shared_ptr<const Botan::secure_vector<u8>>;
+
+  explicit ChunkCache(u64 budget) : m_budget(budget) {}
+
+  ChunkCache(const ChunkCache &) = delete;
+  ChunkCache &operator=(const ChunkCache &) = delete;
+
+  // nullptr if it isn't cached. a chunk that's evicted stays valid for as
+  // long as it's held.
+  Chunk find(const CacheOwner &owner, u64 index);
+  // chunks bigger than the whole budget aren't kept
+  void insert(const CacheOwner &owner, u64 index,
+              Botan::secure_vector<u8> chunk);
+  // every chunk of `owner`
+  void erase(const CacheOwner &owner);
+  void clear();
+
+  // 0 turns the cache off
+  void set_budget(u64 budget);
+  CacheStats stats() const;
+
+private:
+  using Key = std::pair<CacheOwner, u64>;
+
+  struct Entry {
+    Chunk chunk;
+    std::list<Key>::iterator use;
+  };
+
+  mutable std::mutex m_mutex;
+  std::map<Key, Entry> m_entries;
+  // most recently used first
+  std::list<Key> m_uses;
+  u64 m_size = 0;
+  u64 m_budget;
+  u64 m_hits = 0;
+  u64 m_misses = 0;
+
+  void remove(std::map<Key, Entry>::iterator it);
+  void evict();
+};
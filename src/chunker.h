@@ -0,0 +1,55 @@
+#pragma once
+
+#include "common.h"
+#include <algorithm>
+#include <array>
+
+constexpr u64 CDC_MIN_SIZE = static_cast<u64>(4 * 1024);
+constexpr u64 CDC_AVERAGE_SIZE = static_cast<u64>(16 * 1024);
+constexpr u64 CDC_MAX_SIZE = static_cast<u64>(64 * 1024);
+
+// FastCDC content-defined chunking. Cut points only depend on the bytes
+// right before them, so an edit only changes the chunks around it and the
+// rest of a new version deduplicates against the old one. The gear table is
+// derived from the vault key, which keeps chunk sizes from giving away what
+// known files a vault contains.
+class Chunker {
+public:
+  explicit Chunker(const std::array<u64, 256> &gear) : m_gear(gear) {}
+
+  // length of the chunk starting at `data`, a cut at `size` only means the
+  // data ran out unless it's the end of the content
+  u64 cut(const u8 *data, u64 size) const {
+    if (size <= CDC_MIN_SIZE) {
+      return size;
+    }
+    size = std::min(size, CDC_MAX_SIZE);
+    u64 normal = std::min(size, CDC_AVERAGE_SIZE);
+
+    // normalized chunking: harder to cut before the average size, easier
+    // after it, which keeps most chunks close to the average
+    u64 hash = 0;
+    u64 i = CDC_MIN_SIZE;
+    for (; i < normal; i++) {
+      hash = (hash << 1) + m_gear[data[i]];
+      if ((hash & MASK_SMALL) == 0) {
+        return i;
+      }
+    }
+    for (; i < size; i++) {
+      hash = (hash << 1) + m_gear[data[i]];
+      if ((hash & MASK_LARGE) == 0) {
+        return i;
+      }
+    }
+    return size;
+  }
+
+private:
+  // the top bits depend on the most bytes, 2 bits more and less than the
+  // average size needs
+  static constexpr u64 MASK_SMALL = ~static_cast<u64>(0) << (64 - 16);
+  static constexpr u64 MASK_LARGE = ~static_cast<u64>(0) << (64 - 12);
+
+  std::array<u64, 256> m_gear;
+};
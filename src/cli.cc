@@ -0,0 +1,430 @@
+#include "metrics.h"
+#include "vault.h"
+#ifdef DULL_FUSE
+#include "vaultfs.h"
+#endif
+#include <botan/exceptn.h>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+constexpr const char *USAGE =
+    R"(usage: dull-cli [options] <command> <vault> [args]
+
+commands:
+  create <vault>               create a new vault
+  list <vault>                 list entries and their sizes
+  add <vault> <path>...        add files and, recursively, directories,
+                               - reads stdin into the entry named by --name
+  extract <vault> [name]...    extract entries and directories, all of
+                               them if none are given, into --output,
+                               - writes a single entry to stdout
+  delete <vault> <name>...     delete entries and directories
+  mkdir <vault> <path>...      create directories along with their parents
+  move <vault> <from> <to>     rename or move an entry or a directory
+  verify <vault>               decrypt everything in the vault and report
+                               broken entries by offset
+  mount <vault> <dir>          serve the entries as files under dir until
+                               it's unmounted, turns deduplication on
+                               unless --no-dedup, needs a DULL_FUSE build
+
+options:
+  -j, --jobs N                 threads to use, 0 for one per core (default)
+  -o, --output DIR             where to extract to, defaults to .
+  -n, --name NAME              entry name for content read from stdin
+  -p, --password-file FILE     read the password from the first line of FILE
+  --no-compress                store new entries without compressing them
+  --dedup, --no-dedup          turn deduplication of new entries on or off,
+                               the vault remembers it
+  --segment-size MIB           create the vault as a header file and pack
+                               files of at most MIB MiB next to it
+  --metrics FILE               write operation counts and timings to FILE
+                               as JSON once done, needs a DULL_METRICS build
+
+the password comes from --password-file, the DULL_PASSWORD environment
+variable or the terminal, in that order
+)";
+
+struct Options {
+  u32 jobs = 0;
+  std::string output = ".";
+  std::string name;
+  std::string password_file;
+  bool compress = true;
+  std::optional<bool> dedup;
+  u64 segment_size = 0;
+  std::string metrics_file;
+  std::string command;
+  std::string vault;
+  std::vector<std::string> args;
+};
+
+bool parse_args(int argc, char *argv[], Options &options) {
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::invalid_argument(arg + " needs a value");
+      }
+      return argv[++i];
+    };
+
+    if (arg == "-j" || arg == "--jobs") {
+      options.jobs = static_cast<u32>(std::stoul(value()));
+    } else if (arg == "-o" || arg == "--output") {
+      options.output = value();
+    } else if (arg == "-n" || arg == "--name") {
+      options.name = value();
+    } else if (arg == "-p" || arg == "--password-file") {
+      options.password_file = value();
+    } else if (arg == "--no-compress") {
+      options.compress = false;
+    } else if (arg == "--dedup" || arg == "--no-dedup") {
+      options.dedup = arg == "--dedup";
+    } else if (arg == "--segment-size") {
+      options.segment_size = std::stoull(value()) * 1024 * 1024;
+    } else if (arg == "--metrics") {
+      options.metrics_file = value();
+    } else if (arg == "-h" || arg == "--help") {
+      return false;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      throw std::invalid_argument("unknown option " + arg);
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() < 2) {
+    return false;
+  }
+  options.command = positional[0];
+  options.vault = positional[1];
+  options.args.assign(positional.begin() + 2, positional.end());
+  return true;
+}
+
+void set_binary(FILE *stream) {
+#ifdef _WIN32
+  _setmode(_fileno(stream), _O_BINARY);
+#else
+  (void)stream;
+#endif
+}
+
+bool stderr_is_terminal() {
+#ifdef _WIN32
+  return _isatty(_fileno(stderr)) != 0;
+#else
+  return isatty(STDERR_FILENO) != 0;
+#endif
+}
+
+std::string prompt_password(const char *prompt) {
+  std::cerr << prompt << std::flush;
+
+#ifndef _WIN32
+  termios old_flags{};
+  bool terminal = tcgetattr(STDIN_FILENO, &old_flags) == 0;
+  if (terminal) {
+    termios flags = old_flags;
+    flags.c_lflag &= ~static_cast<tcflag_t>(ECHO);
+    tcsetattr(STDIN_FILENO, TCSANOW, &flags);
+  }
+#endif
+
+  std::string password;
+  std::getline(std::cin, password);
+
+#ifndef _WIN32
+  if (terminal) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &old_flags);
+  }
+#endif
+  std::cerr << "\n";
+  return password;
+}
+
+std::string read_password(const Options &options, bool confirm) {
+  if (!options.password_file.empty()) {
+    std::ifstream file(options.password_file);
+    if (!file) {
+      throw std::runtime_error("can't read " + options.password_file);
+    }
+    std::string password;
+    std::getline(file, password);
+    return password;
+  }
+  if (const char *password = std::getenv("DULL_PASSWORD")) {
+    return password;
+  }
+
+  // stdin might be the content of an entry
+  for (const auto &arg : options.args) {
+    if (arg == "-") {
+      throw std::runtime_error(
+          "reading from stdin needs --password-file or DULL_PASSWORD");
+    }
+  }
+
+  std::string password = prompt_password("Password: ");
+  if (confirm && prompt_password("Repeat the password: ") != password) {
+    throw std::runtime_error("passwords don't match");
+  }
+  return password;
+}
+
+int list(Vault &vault) {
+  for (const auto &header : vault.read_file_headers()) {
+    std::cout << header.content_size() << "\t" << vault.entry_path(header)
+              << "\n";
+  }
+  return 0;
+}
+
+int add(Vault &vault, const Options &options) {
+  std::vector<ImportFile> files;
+  for (const auto &arg : options.args) {
+    if (arg != "-") {
+      collect_import_files(arg, "", files);
+      continue;
+    }
+
+    if (options.name.empty()) {
+      throw std::runtime_error("reading from stdin needs --name");
+    }
+    if (!Vault::valid_path(options.name)) {
+      throw std::runtime_error("invalid entry name " + options.name);
+    }
+    set_binary(stdin);
+    vault.create_file(options.name, std::cin);
+  }
+
+  vault.create_files(files);
+  return 0;
+}
+
+int extract(Vault &vault, const Options &options) {
+  if (options.output == "-") {
+    if (options.args.size() != 1) {
+      throw std::runtime_error("only a single entry can go to stdout");
+    }
+    set_binary(stdout);
+    if (!vault.read_file(options.args[0], std::cout)) {
+      throw std::runtime_error("no entry named " + options.args[0]);
+    }
+    return 0;
+  }
+
+  std::filesystem::create_directories(options.output);
+  if (options.args.empty()) {
+    return vault.extract_all(options.output) ? 0 : 1;
+  }
+
+  for (const auto &name : options.args) {
+    auto path = std::filesystem::path(options.output) / name;
+    if (!vault.file_header(name) && vault.list_directory(name)) {
+      if (!vault.extract_directory(name, path.string())) {
+        return 1;
+      }
+      continue;
+    }
+
+    std::filesystem::create_directories(path.parent_path());
+    std::ofstream file(path, std::ios::binary);
+    if (!file || !vault.read_file(name, file)) {
+      throw std::runtime_error("can't extract " + name);
+    }
+  }
+  return 0;
+}
+
+int remove(Vault &vault, const Options &options) {
+  // committed together, with a single fsync
+  Vault::Batch batch(vault);
+  int result = 0;
+  for (const auto &name : options.args) {
+    if (vault.file_header(name)) {
+      vault.delete_file(name);
+    } else if (vault.list_directory(name) && Vault::valid_path(name)) {
+      vault.delete_directory(name);
+    } else {
+      std::cerr << "dull-cli: no entry named " << name << "\n";
+      result = 1;
+    }
+  }
+  return result;
+}
+
+int make_directories(Vault &vault, const Options &options) {
+  Vault::Batch batch(vault);
+  for (const auto &path : options.args) {
+    if (!Vault::valid_path(path)) {
+      throw std::runtime_error("invalid directory name " + path);
+    }
+    if (!vault.create_directory(path)) {
+      throw std::runtime_error("the vault is too old for directories");
+    }
+  }
+  return 0;
+}
+
+int move(Vault &vault, const Options &options) {
+  if (options.args.size() != 2) {
+    throw std::invalid_argument("move needs a source and a destination");
+  }
+  const std::string &to = options.args[1];
+  if (!Vault::valid_path(to)) {
+    throw std::runtime_error("invalid entry name " + to);
+  }
+  if (!vault.rename(options.args[0], to)) {
+    throw std::runtime_error("can't move " + options.args[0] + " to " + to);
+  }
+  return 0;
+}
+
+int verify(Vault &vault) {
+  // progress only goes to a terminal, logs get the broken entries alone
+  bool terminal = stderr_is_terminal();
+  u64 last_percent = 101;
+  auto damaged = vault.verify([&](u64 done, u64 total) {
+    u64 percent = total == 0 ? 100 : done * 100 / total;
+    if (terminal && percent != last_percent) {
+      std::cerr << "\rverifying " << percent << "%" << std::flush;
+      last_percent = percent;
+    }
+  });
+  if (terminal) {
+    std::cerr << "\r              \r";
+  }
+
+  for (const auto &entry : damaged) {
+    std::cerr << "at " << entry.offset << ": "
+              << (entry.path.empty() ? "" : entry.path + ": ") << entry.error
+              << "\n";
+  }
+  if (!damaged.empty()) {
+    std::cerr << damaged.size() << " broken entries\n";
+    return 1;
+  }
+  return 0;
+}
+
+int mount(Vault &vault, const Options &options) {
+  if (options.args.size() != 1) {
+    throw std::invalid_argument("mount needs a directory to mount on");
+  }
+#ifdef DULL_FUSE
+  // otherwise every commit re-encrypts the whole file
+  if (!options.dedup) {
+    vault.set_deduplication(true);
+  }
+  return mount_vault(vault, options.args[0]) == 0 ? 0 : 1;
+#else
+  (void)vault;
+  throw std::runtime_error("built without FUSE support, see DULL_FUSE");
+#endif
+}
+
+int run(const Options &options) {
+  if (options.command == "create") {
+    if (std::filesystem::exists(options.vault)) {
+      throw std::runtime_error(options.vault + " already exists");
+    }
+    auto vault =
+        Vault::create(options.vault, read_password(options, true),
+                      std::nullopt, DEFAULT_IO_BACKEND, options.segment_size);
+    if (options.dedup) {
+      vault->set_deduplication(options.dedup.value());
+    }
+    return 0;
+  }
+
+  if (!std::filesystem::is_regular_file(options.vault)) {
+    throw std::runtime_error("no vault at " + options.vault);
+  }
+
+  std::unique_ptr<Vault> vault;
+  try {
+    vault = std::make_unique<Vault>(options.vault,
+                                    read_password(options, false));
+  } catch (const Botan::Invalid_Authentication_Tag &) {
+    throw std::runtime_error("invalid password");
+  }
+  vault->set_threads(options.jobs);
+  vault->set_compression(options.compress);
+  if (options.dedup) {
+    vault->set_deduplication(options.dedup.value());
+  }
+
+  if (options.command == "list") {
+    return list(*vault);
+  }
+  if (options.command == "add") {
+    return add(*vault, options);
+  }
+  if (options.command == "extract") {
+    return extract(*vault, options);
+  }
+  if (options.command == "delete") {
+    return remove(*vault, options);
+  }
+  if (options.command == "mkdir") {
+    return make_directories(*vault, options);
+  }
+  if (options.command == "move") {
+    return move(*vault, options);
+  }
+  if (options.command == "verify") {
+    return verify(*vault);
+  }
+  if (options.command == "mount") {
+    return mount(*vault, options);
+  }
+  throw std::invalid_argument("unknown command " + options.command);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  try {
+    if (!parse_args(argc, argv, options)) {
+      std::cerr << USAGE;
+      return 2;
+    }
+    if (!options.metrics_file.empty() && !Metrics::ENABLED) {
+      throw std::runtime_error("built without DULL_METRICS");
+    }
+
+    int result = run(options);
+    if (!options.metrics_file.empty()) {
+      std::ofstream file(options.metrics_file);
+      if (!(file << Metrics::to_json())) {
+        throw std::runtime_error("can't write " + options.metrics_file);
+      }
+    }
+    return result;
+  } catch (const std::invalid_argument &e) {
+    std::cerr << "dull-cli: " << e.what() << "\n\n" << USAGE;
+    return 2;
+  } catch (const std::exception &e) {
+    std::cerr << "dull-cli: " << e.what() << "\n";
+    return 1;
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+#include <botan/compression.h>
+#include <botan/secmem.h>
+#include <memory>
+
+namespace Compression {
+
+// the first byte of every chunk of a compressed entry says how it's stored
+constexpr u8 STORED = 0;
+constexpr u8 DEFLATE = 1;
+
+constexpr size_t DEFLATE_LEVEL = 6;
+// deflating has to save at least 1/MIN_SAVING of a chunk, otherwise
+// reading it back isn't worth it
+constexpr u64 MIN_SAVING = 8;
+
+// prefixes `chunk` with its method byte, deflating it if that saves enough.
+// returns whether it was deflated.
+inline bool pack(Botan::secure_vector<u8> &chunk) {
+  thread_local auto deflate =
+      Botan::Compression_Algorithm::create_or_throw("deflate");
+
+  Botan::secure_vector<u8> packed;
+  packed.reserve(chunk.size() + 1);
+  packed.push_back(DEFLATE);
+  packed.insert(packed.end(), chunk.begin(), chunk.end());
+  deflate->start(DEFLATE_LEVEL);
+  deflate->finish(packed, 1);
+
+  if (packed.size() - 1 <= chunk.size() - chunk.size() / MIN_SAVING &&
+      packed.size() - 1 < chunk.size()) {
+    chunk = std::move(packed);
+    return true;
+  }
+  chunk.insert(chunk.begin(), STORED);
+  return false;
+}
+
+// the reverse of pack, in place
+inline void unpack(Botan::secure_vector<u8> &chunk) {
+  thread_local auto inflate =
+      Botan::Decompression_Algorithm::create_or_throw("deflate");
+
+  ASSERT(!chunk.empty());
+  if (chunk[0] == DEFLATE) {
+    inflate->start();
+    inflate->finish(chunk, 1);
+  } else {
+    ASSERT(chunk[0] == STORED);
+  }
+  chunk.erase(chunk.begin());
+}
+
+} // namespace Compression
@@ -1,7 +1,15 @@
 #pragma once
 #include "common.h"
+#include "metrics.h"
 #include <botan/aead.h>
+#include <botan/mac.h>
 #include <botan/pwdhash.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace Crypto {
 
@@ -46,12 +54,161 @@ decrypt_xchacha20_poly1305(const Botan::secure_vector<u8> &ciphertext,
   return plaintext;
 }
 
+// ChaCha20Poly1305 keyed once and reused for any number of messages,
+// without copying the input. Not thread safe, use one per thread.
+class Cipher {
+public:
+  explicit Cipher(const Botan::secure_vector<u8> &key)
+      : m_encryption(Botan::AEAD_Mode::create_or_throw(
+            "ChaCha20Poly1305", Botan::Cipher_Dir::Encryption)),
+        m_decryption(Botan::AEAD_Mode::create_or_throw(
+            "ChaCha20Poly1305", Botan::Cipher_Dir::Decryption)) {
+    ASSERT(key.size() == 32);
+    m_encryption->set_key(key);
+    m_decryption->set_key(key);
+  }
+
+  // in place, the tag is appended to `buffer`
+  void encrypt(Botan::secure_vector<u8> &buffer,
+               const std::array<u8, 24> &nonce) {
+    Metrics::Timer timer(Metric::Encrypt, buffer.size());
+    m_encryption->start(nonce);
+    m_encryption->finish(buffer);
+  }
+
+  // appends the ciphertext of [data, data + size) to `out`
+  void encrypt(const u8 *data, u64 size, const std::array<u8, 24> &nonce,
+               Botan::secure_vector<u8> &out) {
+    Metrics::Timer timer(Metric::Encrypt, size);
+    u64 offset = out.size();
+    out.insert(out.end(), data, data + size);
+    m_encryption->start(nonce);
+    m_encryption->finish(out, offset);
+  }
+
+  // in place, the tag is stripped from `buffer`
+  void decrypt(Botan::secure_vector<u8> &buffer,
+               const std::array<u8, 24> &nonce) {
+    ASSERT(buffer.size() >= 16);
+    Metrics::Timer timer(Metric::Decrypt, buffer.size());
+    m_decryption->start(nonce);
+    m_decryption->finish(buffer);
+  }
+
+  // replaces the contents of `out`, reusing its allocation
+  void decrypt(const u8 *data, u64 size, const std::array<u8, 24> &nonce,
+               Botan::secure_vector<u8> &out) {
+    ASSERT(size >= 16);
+    Metrics::Timer timer(Metric::Decrypt, size);
+    out.assign(data, data + size);
+    m_decryption->start(nonce);
+    m_decryption->finish(out);
+  }
+
+private:
+  std::unique_ptr<Botan::AEAD_Mode> m_encryption;
+  std::unique_ptr<Botan::AEAD_Mode> m_decryption;
+};
+
+// Keyed ciphers for any number of threads. Each one is only ever used by
+// one thread at a time and handed out again once it's given back.
+class CipherPool {
+public:
+  class Lease {
+  public:
+    Lease(CipherPool &pool, std::unique_ptr<Cipher> cipher)
+        : m_pool(pool), m_cipher(std::move(cipher)) {}
+    ~Lease() { m_pool.release(std::move(m_cipher)); }
+
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+
+    Cipher *operator->() const { return m_cipher.get(); }
+
+  private:
+    CipherPool &m_pool;
+    std::unique_ptr<Cipher> m_cipher;
+  };
+
+  explicit CipherPool(const Botan::secure_vector<u8> &key) : m_key(key) {}
+
+  Lease acquire() {
+    {
+      std::lock_guard lock(m_mutex);
+      if (!m_free.empty()) {
+        auto cipher = std::move(m_free.back());
+        m_free.pop_back();
+        return {*this, std::move(cipher)};
+      }
+    }
+    return {*this, std::make_unique<Cipher>(m_key)};
+  }
+
+private:
+  Botan::secure_vector<u8> m_key;
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<Cipher>> m_free;
+
+  void release(std::unique_ptr<Cipher> cipher) {
+    std::lock_guard lock(m_mutex);
+    m_free.push_back(std::move(cipher));
+  }
+};
+
+// STREAM construction: the first 19 bytes of the entry nonce, the chunk
+// counter and a flag set only on the last chunk, so chunks can't be
+// reordered or the entry truncated without failing authentication
+inline std::array<u8, 24> chunk_nonce(const std::array<u8, 24> &nonce,
+                                      u32 index, bool last) {
+  std::array<u8, 24> result = nonce;
+  result[19] = static_cast<u8>(index >> 24);
+  result[20] = static_cast<u8>(index >> 16);
+  result[21] = static_cast<u8>(index >> 8);
+  result[22] = static_cast<u8>(index);
+  result[23] = last ? 1 : 0;
+  return result;
+}
+
+inline std::array<u8, 32> hmac_sha256(const Botan::secure_vector<u8> &key,
+                                      const u8 *data, u64 size) {
+  auto mac = Botan::MessageAuthenticationCode::create_or_throw("HMAC(SHA-256)");
+  mac->set_key(key);
+  mac->update(data, size);
+
+  std::array<u8, 32> result{};
+  mac->final(result.data());
+  return result;
+}
+
+// a key for `purpose` that reveals nothing about `key`
+inline Botan::secure_vector<u8>
+derive_subkey(const Botan::secure_vector<u8> &key, const std::string &purpose) {
+  auto subkey = hmac_sha256(
+      key, reinterpret_cast<const u8 *>(purpose.data()), purpose.size());
+  return {subkey.begin(), subkey.end()};
+}
+
+struct KdfParams {
+  u64 memory_kib;
+  u32 iterations;
+  u32 parallelism;
+};
+
+// thousands of years to crack a random 8 char password on a 100 GPUs, used
+// by vaults from before the parameters were stored in the header
+constexpr KdfParams DEFAULT_KDF_PARAMS = {static_cast<u64>(1024 * 1024), 8, 4};
+// calibration never goes below this much memory
+constexpr u64 MIN_KDF_MEMORY_KIB = static_cast<u64>(64 * 1024);
+
 inline Botan::secure_vector<u8>
 derive_key_argon2id(const std::string &password,
-                    const std::array<u8, 16> &salt) {
-  // thousands of years to crack a random 8 char password on a 100 GPUs
-  auto pwdhash = Botan::PasswordHashFamily::create_or_throw("Argon2id")
-                     ->from_params(static_cast<u64>(1024 * 1024), 8, 4);
+                    const std::array<u8, 16> &salt,
+                    const KdfParams &params = DEFAULT_KDF_PARAMS) {
+  Metrics::Timer timer(Metric::Kdf);
+  auto pwdhash =
+      Botan::PasswordHashFamily::create_or_throw("Argon2id")
+          ->from_params(params.memory_kib, params.iterations,
+                        params.parallelism);
 
   Botan::secure_vector<u8> key(32);
   pwdhash->derive_key(key.data(), key.size(), password.data(), password.size(),
@@ -59,4 +216,31 @@ derive_key_argon2id(const std::string &password,
   return key;
 }
 
+// Parameters that take about `target` to derive a key with on this machine:
+// a lane per core, as much memory as allowed and as many passes as fit in
+// the remaining time.
+inline KdfParams
+calibrate_argon2id(std::chrono::milliseconds target,
+                   u64 max_memory_kib = DEFAULT_KDF_PARAMS.memory_kib) {
+  KdfParams params{};
+  params.parallelism = std::max<u32>(std::thread::hardware_concurrency(), 1);
+
+  // the cost grows linearly with both memory and passes, so a single pass
+  // over a little memory is enough to extrapolate from
+  KdfParams probe = {MIN_KDF_MEMORY_KIB, 1, params.parallelism};
+  auto start = std::chrono::steady_clock::now();
+  derive_key_argon2id("calibration", {}, probe);
+  f64 elapsed = std::chrono::duration<f64, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  f64 budget = static_cast<f64>(target.count()) /
+               std::max(elapsed, 1.0) * static_cast<f64>(probe.memory_kib);
+  params.memory_kib = std::clamp(static_cast<u64>(budget), MIN_KDF_MEMORY_KIB,
+                                 std::max(max_memory_kib, MIN_KDF_MEMORY_KIB));
+  params.iterations = static_cast<u32>(
+      std::max<f64>(1, budget / static_cast<f64>(params.memory_kib)));
+  return params;
+}
+
 }; // namespace Crypto
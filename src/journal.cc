@@ -0,0 +1,342 @@
+#include "journal.h"
+#include "metrics.h"
+#include <botan/hash.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+
+namespace {
+
+constexpr std::array<char, 8> JOURNAL_MAGIC = {'D', 'U', 'L', 'L',
+                                               'J', 'N', 'L', '1'};
+constexpr u64 HASH_SIZE = 32;
+// the magic, where the last commit ended and a hash of the two
+constexpr u64 BEGIN_SIZE = JOURNAL_MAGIC.size() + sizeof(u64) + HASH_SIZE;
+
+template <typename T> void put(std::vector<u8> &buffer, const T &value) {
+  const auto *bytes = reinterpret_cast<const u8 *>(&value);
+  buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+// covers everything before it, a torn write never checks out
+void put_hash(std::vector<u8> &buffer) {
+  auto hash = Botan::HashFunction::create_or_throw("SHA-256");
+  hash->update(buffer.data(), buffer.size());
+  buffer.resize(buffer.size() + HASH_SIZE);
+  hash->final(buffer.data() + buffer.size() - HASH_SIZE);
+}
+
+// the same bytes every time until the commit, rewriting them is harmless
+std::vector<u8> encode_begin(u64 committed_size) {
+  std::vector<u8> bytes(JOURNAL_MAGIC.size());
+  std::memcpy(bytes.data(), JOURNAL_MAGIC.data(), JOURNAL_MAGIC.size());
+  put(bytes, committed_size);
+  put_hash(bytes);
+  return bytes;
+}
+
+bool check_hash(const std::vector<u8> &buffer, u64 size) {
+  if (buffer.size() < size + HASH_SIZE) {
+    return false;
+  }
+  auto hash = Botan::HashFunction::create_or_throw("SHA-256");
+  hash->update(buffer.data(), size);
+  std::array<u8, HASH_SIZE> expected{};
+  hash->final(expected.data());
+  return std::memcmp(expected.data(), buffer.data() + size, HASH_SIZE) == 0;
+}
+
+} // namespace
+
+JournaledFile::JournaledFile(const std::string &path, IOBackend backend,
+                             const Segments &segments) {
+  m_file = VaultFile::open(path, backend, segments);
+
+  std::string journal_path = path + JOURNAL_SUFFIX;
+  if (!std::filesystem::exists(journal_path)) {
+    std::ofstream create(journal_path, std::ios::binary);
+    ASSERT(create.good());
+  }
+  m_journal = VaultFile::open(journal_path, backend);
+
+  recover();
+  m_size = m_committed_size = m_file->size();
+}
+
+JournaledFile::~JournaledFile() { sync(); }
+
+u64 JournaledFile::size() const {
+  std::shared_lock lock(m_mutex);
+  return m_size;
+}
+
+bool JournaledFile::read(u64 offset, u8 *out, u64 size) {
+  std::shared_lock lock(m_mutex);
+  if (offset + size > m_size || !m_file->read(offset, out, size)) {
+    return false;
+  }
+
+  // the file has what the last commit left, the staged bytes go on top
+  u64 end = offset + size;
+  auto it = m_staged.upper_bound(offset);
+  if (it != m_staged.begin()) {
+    --it;
+  }
+  for (; it != m_staged.end() && it->first < end; ++it) {
+    u64 from = std::max(offset, it->first);
+    u64 to = std::min(end, it->first + it->second.size());
+    if (from < to) {
+      std::memcpy(out + (from - offset), it->second.data() + (from - it->first),
+                  to - from);
+    }
+  }
+  return true;
+}
+
+void JournaledFile::write(u64 offset, const u8 *data, u64 size) {
+  u64 end = offset + size;
+  {
+    std::unique_lock lock(m_mutex);
+    m_dirty = true;
+    if (offset < m_committed_size) {
+      u64 count = std::min(size, m_committed_size - offset);
+      stage(offset, data, count);
+      offset += count;
+      data += count;
+      size -= count;
+    }
+    if (size > 0) {
+      begin();
+    }
+  }
+
+  // appends don't need the lock, readers don't look at them until the
+  // index says so
+  if (size > 0) {
+    m_file->write(offset, data, size);
+  }
+
+  std::unique_lock lock(m_mutex);
+  m_size = std::max(m_size, end);
+}
+
+void JournaledFile::resize(u64 size) {
+  std::unique_lock lock(m_mutex);
+  m_dirty = true;
+  if (size >= m_committed_size) {
+    begin();
+    m_file->resize(size);
+  } else {
+    // the committed end is only cut off by the commit
+    if (m_file->size() > m_committed_size) {
+      m_file->resize(m_committed_size);
+    }
+    m_staged.erase(m_staged.lower_bound(size), m_staged.end());
+    if (!m_staged.empty()) {
+      auto &[offset, bytes] = *m_staged.rbegin();
+      bytes.resize(std::min<u64>(bytes.size(), size - offset));
+    }
+  }
+  m_size = size;
+}
+
+void JournaledFile::sync() {
+  if (!m_dirty) {
+    return;
+  }
+  Metrics::Timer timer(Metric::Commit);
+
+  // whatever the commit refers to has to be there before it
+  m_file->sync();
+
+  std::vector<u8> bytes = encode_begin(m_committed_size);
+  put(bytes, m_size);
+  put(bytes, static_cast<u64>(m_staged.size()));
+  for (const auto &[offset, staged] : m_staged) {
+    put(bytes, offset);
+    put(bytes, static_cast<u64>(staged.size()));
+    bytes.insert(bytes.end(), staged.begin(), staged.end());
+  }
+  put_hash(bytes);
+  timer.add_bytes(bytes.size());
+  m_journal->write(0, bytes.data(), bytes.size());
+  m_journal->sync();
+
+  {
+    std::unique_lock lock(m_mutex);
+    for (const auto &[offset, staged] : m_staged) {
+      m_file->write(offset, staged.data(), staged.size());
+    }
+    m_staged.clear();
+    if (m_file->size() != m_size) {
+      m_file->resize(m_size);
+    }
+    m_committed_size = m_size;
+  }
+  m_file->sync();
+
+  // replaying it again would change nothing, so this needs no sync
+  m_journal->resize(0);
+  m_begun = false;
+  m_dirty = false;
+}
+
+const u8 *JournaledFile::view(u64 offset, u64 size) {
+  std::shared_lock lock(m_mutex);
+  if (offset + size > m_size || staged_overlaps(offset, size)) {
+    return nullptr;
+  }
+  return m_file->view(offset, size);
+}
+
+void JournaledFile::discard(u64 offset, u64 size) {
+  std::unique_lock lock(m_mutex);
+  // the commit would write staged bytes back into it
+  ASSERT(!staged_overlaps(offset, size));
+  m_file->discard(offset, size);
+}
+
+u64 JournaledFile::discarded() const {
+  std::shared_lock lock(m_mutex);
+  return m_file->discarded();
+}
+
+void JournaledFile::write_unused(u64 offset, const u8 *data, u64 size) {
+  {
+    std::unique_lock lock(m_mutex);
+    ASSERT(!staged_overlaps(offset, size));
+    m_dirty = true;
+    if (offset + size > m_committed_size) {
+      begin();
+    }
+  }
+  m_file->write(offset, data, size);
+
+  std::unique_lock lock(m_mutex);
+  m_size = std::max(m_size, offset + size);
+}
+
+void JournaledFile::recover() {
+  u64 size = m_journal->size();
+  if (size == 0) {
+    return;
+  }
+  std::vector<u8> bytes(size);
+  ASSERT(m_journal->read(0, bytes.data(), size));
+
+  // torn before anything was appended, there's nothing to undo
+  if (!check_hash(bytes, BEGIN_SIZE - HASH_SIZE) ||
+      !std::equal(JOURNAL_MAGIC.begin(), JOURNAL_MAGIC.end(), bytes.begin())) {
+    m_journal->resize(0);
+    m_journal->sync();
+    return;
+  }
+
+  u64 position = BEGIN_SIZE;
+  auto take = [&](u64 count) -> const u8 * {
+    if (count > bytes.size() - position) {
+      return nullptr;
+    }
+    position += count;
+    return bytes.data() + position - count;
+  };
+  auto take_u64 = [&](u64 &value) {
+    const u8 *data = take(sizeof(u64));
+    if (data != nullptr) {
+      std::memcpy(&value, data, sizeof(u64));
+    }
+    return data != nullptr;
+  };
+
+  struct Record {
+    u64 offset;
+    const u8 *data;
+    u64 size;
+  };
+  std::vector<Record> records;
+  u64 new_size = 0;
+  u64 count = 0;
+  bool complete = take_u64(new_size) && take_u64(count);
+  for (u64 i = 0; complete && i < count; i++) {
+    Record record{};
+    complete = take_u64(record.offset) && take_u64(record.size) &&
+               (record.data = take(record.size)) != nullptr;
+    records.push_back(record);
+  }
+
+  if (complete && check_hash(bytes, position)) {
+    // committed, finish applying it. it might have been applied already,
+    // which is fine.
+    for (const auto &record : records) {
+      m_file->write(record.offset, record.data, record.size);
+    }
+    m_file->resize(new_size);
+  } else {
+    // not committed, drop what was appended for it
+    u64 committed_size = 0;
+    std::memcpy(&committed_size, bytes.data() + JOURNAL_MAGIC.size(),
+                sizeof(u64));
+    if (m_file->size() > committed_size) {
+      m_file->resize(committed_size);
+    }
+  }
+  m_file->sync();
+  m_journal->resize(0);
+  m_journal->sync();
+}
+
+void JournaledFile::begin() {
+  if (m_begun) {
+    return;
+  }
+
+  // synced so an append never reaches the disk without it, otherwise the
+  // appended index could be taken for a committed one
+  std::vector<u8> bytes = encode_begin(m_committed_size);
+  m_journal->write(0, bytes.data(), bytes.size());
+  m_journal->sync();
+  m_begun = true;
+}
+
+void JournaledFile::stage(u64 offset, const u8 *data, u64 size) {
+  if (size == 0) {
+    return;
+  }
+
+  // merge with the ranges it overlaps or touches
+  u64 start = offset;
+  u64 end = offset + size;
+  auto first = m_staged.upper_bound(offset);
+  if (first != m_staged.begin() &&
+      std::prev(first)->first + std::prev(first)->second.size() >= offset) {
+    --first;
+  }
+  auto last = first;
+  while (last != m_staged.end() && last->first <= end) {
+    start = std::min(start, last->first);
+    end = std::max(end, last->first + last->second.size());
+    ++last;
+  }
+
+  std::vector<u8> bytes(end - start);
+  for (auto it = first; it != last; ++it) {
+    std::memcpy(bytes.data() + (it->first - start), it->second.data(),
+                it->second.size());
+  }
+  std::memcpy(bytes.data() + (offset - start), data, size);
+  m_staged.erase(first, last);
+  m_staged.emplace(start, std::move(bytes));
+}
+
+bool JournaledFile::staged_overlaps(u64 offset, u64 size) const {
+  auto it = m_staged.lower_bound(offset + size);
+  if (it == m_staged.begin()) {
+    return false;
+  }
+  --it;
+  return it->first + it->second.size() > offset;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "vaultfile.h"
+#include <map>
+#include <shared_mutex>
+#include <vector>
+
+// next to the vault, empty unless a commit is in progress
+constexpr const char *JOURNAL_SUFFIX = ".journal";
+
+// A vault file whose changes become durable all at once. Appends past what
+// the last commit left in the file go straight to it, once the journal
+// knows where that was. Overwrites of what it left are held in memory until
+// sync() commits them:
+//
+// 1. the appended bytes are synced
+// 2. the held back overwrites and the new size are written to the journal
+//    and synced, which is the commit point
+// 3. they're applied to the file, which is synced, and the journal emptied
+//
+// Opening replays a committed journal, or cuts off whatever was appended
+// since the last commit if it didn't get that far.
+class JournaledFile : public VaultFile {
+public:
+  JournaledFile(const std::string &path, IOBackend backend,
+                const Segments &segments = {});
+  ~JournaledFile() override;
+
+  JournaledFile(const JournaledFile &) = delete;
+  JournaledFile &operator=(const JournaledFile &) = delete;
+
+  u64 size() const override;
+  bool read(u64 offset, u8 *out, u64 size) override;
+  void write(u64 offset, const u8 *data, u64 size) override;
+  void resize(u64 size) override;
+  // commits, mustn't run at the same time as writes
+  void sync() override;
+  const u8 *view(u64 offset, u64 size) override;
+  // only bytes the last commit already stopped using
+  void discard(u64 offset, u64 size) override;
+  u64 discarded() const override;
+
+  // like write(), for bytes that nothing committed uses anymore, which can
+  // go straight to the file
+  void write_unused(u64 offset, const u8 *data, u64 size);
+
+private:
+  std::unique_ptr<VaultFile> m_file;
+  std::unique_ptr<VaultFile> m_journal;
+
+  mutable std::shared_mutex m_mutex;
+  // the overwrites waiting for a commit, by offset, never overlapping
+  std::map<u64, std::vector<u8>> m_staged;
+  u64 m_size = 0;
+  u64 m_committed_size = 0;
+  // the journal knows where the last commit ended
+  bool m_begun = false;
+  bool m_dirty = false;
+
+  void recover();
+  void begin();
+  void stage(u64 offset, const u8 *data, u64 size);
+  bool staged_overlaps(u64 offset, u64 size) const;
+};
@@ -1,14 +1,135 @@
-// TODO: actual fs
 #include "mainwindow.h"
-#include "crypto.h"
+#include "metrics.h"
 #include <QDesktopServices>
+#include <QDialogButtonBox>
 #include <QDropEvent>
 #include <QFileDialog>
+#include <QFontDatabase>
+#include <QFutureWatcher>
+#include <QHeaderView>
 #include <QInputDialog>
 #include <QMessageBox>
 #include <QMimeData>
+#include <QPlainTextEdit>
+#include <QProgressDialog>
 #include <QTemporaryDir>
-#include <botan/auto_rng.h>
+#include <QTimer>
+#include <QVBoxLayout>
+
+namespace {
+
+struct PreviewPage {
+  u64 page;
+  u64 pages;
+  std::string content;
+};
+
+struct Renamed {
+  bool renamed;
+  // the file under its new name, directories don't need anything
+  std::optional<FileHeader> header;
+};
+
+// `name` in `parent`, "" being the root
+std::string join_path(const std::string &parent, const std::string &name) {
+  return parent.empty() ? name : parent + "/" + name;
+}
+
+// calls done(future) on the GUI thread once the job has finished
+template <typename T, typename Fn>
+void when_finished(QObject *context, const QFuture<T> &future, Fn done) {
+  auto *watcher = new QFutureWatcher<T>(context);
+  QObject::connect(watcher, &QFutureWatcherBase::finished, context,
+                   [watcher, done = std::move(done)]() mutable {
+                     done(watcher->future());
+                     watcher->deleteLater();
+                   });
+  watcher->setFuture(future);
+}
+
+// non-modal, so the vault can still be browsed while the job runs
+template <typename T>
+void show_progress(QWidget *parent, const QString &label,
+                   const QFuture<T> &future, bool cancellable) {
+  auto *dialog = new QProgressDialog(label, "Cancel", 0, 0, parent);
+  dialog->setAttribute(Qt::WA_DeleteOnClose);
+  dialog->setMinimumDuration(500);
+  if (!cancellable) {
+    dialog->setCancelButton(nullptr);
+  }
+
+  auto *watcher = new QFutureWatcher<T>(dialog);
+  QObject::connect(watcher, &QFutureWatcherBase::progressRangeChanged, dialog,
+                   &QProgressDialog::setRange);
+  QObject::connect(watcher, &QFutureWatcherBase::progressValueChanged, dialog,
+                   &QProgressDialog::setValue);
+  QObject::connect(watcher, &QFutureWatcherBase::finished, dialog,
+                   &QProgressDialog::close);
+  QObject::connect(dialog, &QProgressDialog::canceled, watcher,
+                   &QFutureWatcherBase::cancel);
+  watcher->setFuture(future);
+}
+
+// false, after telling the user, if the job threw. a job that threw counts
+// as canceled too, so this goes before any isCanceled() check.
+template <typename T>
+bool succeeded(QWidget *parent, QFuture<T> future, const QString &message) {
+  try {
+    future.waitForFinished();
+  } catch (const std::exception &e) {
+    qWarning() << e.what();
+    QMessageBox::critical(parent, "Error", message);
+    return false;
+  }
+  return true;
+}
+
+// a table of every metric, then the vault's cache if one is open
+QString metrics_report(const Vault *vault) {
+  QString report = QString("%1%2%3%4%5\n")
+                       .arg(QString(), -18)
+                       .arg(QString("calls"), 10)
+                       .arg(QString("MiB"), 10)
+                       .arg(QString("total ms"), 12)
+                       .arg(QString("p99 < us"), 12);
+  for (u64 i = 0; i < METRIC_COUNT; i++) {
+    auto metric = static_cast<Metric>(i);
+    Metrics::Snapshot stats = Metrics::snapshot(metric);
+
+    // the bucket the 99th percentile falls into
+    u64 p99 = 0;
+    for (u64 seen = 0; p99 < LATENCY_BUCKETS; p99++) {
+      seen += stats.latency[p99];
+      if (seen * 100 >= stats.count * 99) {
+        break;
+      }
+    }
+    report += QString("%1%2%3%4%5\n")
+                  .arg(QString(Metrics::name(metric)), -18)
+                  .arg(stats.count, 10)
+                  .arg(static_cast<f64>(stats.bytes) / (1024 * 1024), 10, 'f',
+                       1)
+                  .arg(static_cast<f64>(stats.nanoseconds) / 1e6, 12, 'f', 1)
+                  .arg(stats.count == 0
+                           ? 0
+                           : static_cast<f64>(static_cast<u64>(1) << p99) /
+                                 1e3,
+                       12, 'f', 1);
+  }
+
+  if (vault != nullptr) {
+    CacheStats cache = vault->cache_stats();
+    report += QString("\nchunk cache: %1 hits, %2 misses, %3 of %4 MiB\n")
+                  .arg(cache.hits)
+                  .arg(cache.misses)
+                  .arg(static_cast<f64>(cache.size) / (1024 * 1024), 0, 'f', 1)
+                  .arg(static_cast<f64>(cache.budget) / (1024 * 1024), 0, 'f',
+                       1);
+  }
+  return report;
+}
+
+} // namespace
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent), ui(std::make_unique<Ui::MainWindow>()) {
@@ -16,7 +137,16 @@ MainWindow::MainWindow(QWidget *parent)
 
   setAcceptDrops(true);
 
-  ui->filePreview->setVisible(false);
+  m_model = new VaultModel(
+      style()->standardIcon(QStyle::SP_DirIcon),
+      style()->standardIcon(QStyle::SP_FileIcon),
+      [this](const std::string &path) { list_directory(path); }, this);
+  ui->fsTreeView->setModel(m_model);
+  // measuring the contents would mean looking at every row
+  ui->fsTreeView->header()->setSectionResizeMode(VaultModel::NameColumn,
+                                                 QHeaderView::Stretch);
+
+  ui->previewWidget->setVisible(false);
 
   connect(ui->actionNew, &QAction::triggered, this, [this]() {
     QString path = QFileDialog::getSaveFileName(this, "Choose vault location",
@@ -30,42 +160,20 @@ MainWindow::MainWindow(QWidget *parent)
       path += ".dull";
     }
 
-    QString password = QInputDialog::getText(
-        this, "Choose a password", "Choose a password", QLineEdit::Password);
-    if (password.length() < 8) {
-      QMessageBox::critical(this, "Error",
-                            "Password must be at least 8 characters long.");
+    QString password = choose_password("Choose a password");
+    if (password.isEmpty()) {
       return;
     }
 
     ui->statusbar->showMessage("Creating the vault...");
-    QCoreApplication::processEvents();
-
-    static Botan::AutoSeeded_RNG rng;
-    auto salt = rng.random_array<16>();
-
-    auto key = Crypto::derive_key_argon2id(password.toStdString(), salt);
-    auto check_nonce = rng.random_array<24>();
-
-    const std::string content = "LETSGO";
-    Botan::secure_vector<u8> content_sv(content.begin(), content.end());
-    auto check_ciphertext =
-        Crypto::encrypt_xchacha20_poly1305(content_sv, key, check_nonce);
-
-    std::ofstream create(path.toStdString(), std::ios::binary);
-    create.write("DULL", 4);
-    create.write(to_char_ptr(&VERSION), sizeof(VERSION));
-    create.write(to_char_ptr(salt.data()), 16);
-
-    create.write(to_char_ptr(check_nonce.data()), 24);
-    create.write(to_char_ptr(check_ciphertext.data()), 22);
-    create.close();
-
-    m_vault =
-        std::make_unique<Vault>(path.toStdString(), password.toStdString());
-    reload_fs_tree();
-
-    ui->statusbar->clearMessage();
+    when_finished(
+        this, m_worker.create(path.toStdString(), password.toStdString()),
+        [this](const QFuture<void> &future) {
+          ui->statusbar->clearMessage();
+          if (succeeded(this, future, "Failed to create the vault.")) {
+            reload_fs_tree();
+          }
+        });
   });
 
   connect(ui->actionOpen, &QAction::triggered, this, [this]() {
@@ -83,50 +191,230 @@ MainWindow::MainWindow(QWidget *parent)
     }
 
     ui->statusbar->showMessage("Opening the vault...");
-    QCoreApplication::processEvents();
+    when_finished(
+        this, m_worker.open(path.toStdString(), password.toStdString()),
+        [this](QFuture<void> future) {
+          ui->statusbar->clearMessage();
+          try {
+            future.waitForFinished();
+          } catch (const Botan::Invalid_Authentication_Tag &e) {
+            QMessageBox::critical(this, "Error", "Invalid password.");
+            return;
+          } catch (const std::exception &e) {
+            qWarning() << e.what();
+            QMessageBox::critical(
+                this, "Error",
+                QString("Failed to open the vault: %1").arg(QString(e.what())));
+            return;
+          }
+          reload_fs_tree();
+        });
+  });
 
-    try {
-      m_vault =
-          std::make_unique<Vault>(path.toStdString(), password.toStdString());
-      reload_fs_tree();
-      ui->statusbar->clearMessage();
-    } catch (const Botan::Invalid_Authentication_Tag &e) {
-      QMessageBox::critical(this, "Error", "Invalid password.");
-      ui->statusbar->clearMessage();
+  connect(ui->actionCompact, &QAction::triggered, this, [this]() {
+    if (!m_worker.vault()) {
       return;
     }
+
+    auto future = m_worker.run<u64>([](Vault &vault, QPromise<u64> &promise) {
+      promise.setProgressRange(0, 1000);
+      // bounded steps, reads get their turn in between
+      while (!promise.isCanceled()) {
+        auto step = vault.compact_step();
+        if (step.total > 0) {
+          promise.setProgressValue(
+              static_cast<i32>(step.processed * 1000 / step.total));
+        }
+        if (step.done) {
+          return step.reclaimed;
+        }
+      }
+      return static_cast<u64>(0);
+    });
+
+    show_progress(this, "Compacting the vault...", future, true);
+    when_finished(this, future, [this](const QFuture<u64> &future) {
+      if (!succeeded(this, future, "Compaction failed.")) {
+        return;
+      }
+      if (future.isCanceled()) {
+        ui->statusbar->showMessage("Compaction cancelled");
+        return;
+      }
+      ui->statusbar->showMessage("Reclaimed " +
+                                 QString::number(future.result()) + " bytes");
+    });
   });
 
-  connect(
-      ui->fsTreeWidget, &QTreeWidget::itemClicked,
-      [this](QTreeWidgetItem *, i32) { ui->filePreview->setVisible(false); });
+  connect(ui->actionVerify, &QAction::triggered, this, [this]() {
+    if (!m_worker.vault()) {
+      return;
+    }
 
-  connect(ui->fsTreeWidget, &QTreeWidget::customContextMenuRequested, this,
+    auto future = m_worker.run<std::vector<DamagedEntry>>(
+        [](Vault &vault, QPromise<std::vector<DamagedEntry>> &promise) {
+          promise.setProgressRange(0, 1000);
+          std::atomic<bool> cancel = false;
+          return vault.verify(
+              [&](u64 done, u64 total) {
+                if (total > 0) {
+                  promise.setProgressValue(
+                      static_cast<i32>(done * 1000 / total));
+                }
+                cancel = promise.isCanceled();
+              },
+              &cancel);
+        });
+
+    show_progress(this, "Verifying the vault...", future, true);
+    when_finished(
+        this, future, [this](const QFuture<std::vector<DamagedEntry>> &future) {
+          if (!succeeded(this, future, "Verification failed.")) {
+            return;
+          }
+          if (future.isCanceled()) {
+            ui->statusbar->showMessage("Verification cancelled");
+            return;
+          }
+          const auto &damaged = future.result();
+          if (damaged.empty()) {
+            ui->statusbar->showMessage("No broken entries found");
+            return;
+          }
+
+          QString details;
+          for (const auto &entry : damaged) {
+            details += QString("at %1: %2%3\n")
+                           .arg(entry.offset)
+                           .arg(entry.path.empty()
+                                    ? QString()
+                                    : QString::fromStdString(entry.path) +
+                                          ": ")
+                           .arg(QString::fromStdString(entry.error));
+          }
+          QMessageBox box(QMessageBox::Warning, "Verify",
+                          QString::number(damaged.size()) +
+                              " broken entries found.",
+                          QMessageBox::Ok, this);
+          box.setDetailedText(details);
+          box.exec();
+        });
+  });
+
+  connect(ui->actionChangePassword, &QAction::triggered, this, [this]() {
+    if (!m_worker.vault()) {
+      return;
+    }
+
+    QString password = choose_password("Change password");
+    if (password.isEmpty()) {
+      return;
+    }
+
+    // only the key slot gets rewritten, old vaults are re-keyed though
+    auto future = m_worker.run<void>(
+        [password = password.toStdString()](Vault &vault, QPromise<void> &) {
+          vault.change_password(password);
+        });
+    show_progress(this, "Changing the password...", future, false);
+    when_finished(this, future, [this](const QFuture<void> &future) {
+      if (succeeded(this, future, "Changing the password failed.")) {
+        ui->statusbar->showMessage("Password changed");
+      }
+    });
+  });
+
+  connect(ui->actionRecoveryKey, &QAction::triggered, this, [this]() {
+    if (!m_worker.vault()) {
+      return;
+    }
+
+    auto future = m_worker.run<std::optional<std::string>>(
+        [](Vault &vault, QPromise<std::optional<std::string>> &) {
+          return vault.add_recovery_key();
+        });
+    when_finished(
+        this, future, [this](QFuture<std::optional<std::string>> future) {
+          if (!succeeded(this, future, "Creating a recovery key failed.")) {
+            return;
+          }
+          auto recovery_key = future.result();
+          if (!recovery_key) {
+            QMessageBox::critical(this, "Error",
+                                  "This vault has no room for another key, "
+                                  "re-key it first.");
+            return;
+          }
+
+          QMessageBox box(QMessageBox::Information, "Recovery key",
+                          "Keep this key somewhere safe, it unlocks the vault "
+                          "just like the password:\n\n" +
+                              QString::fromStdString(recovery_key.value()),
+                          QMessageBox::Ok, this);
+          box.setTextInteractionFlags(Qt::TextSelectableByMouse);
+          box.exec();
+        });
+  });
+
+  connect(ui->actionRekey, &QAction::triggered, this, [this]() {
+    if (!m_worker.vault()) {
+      return;
+    }
+
+    QString password = choose_password("Re-key the vault");
+    if (password.isEmpty()) {
+      return;
+    }
+
+    // new KDF parameters get calibrated and everything is re-encrypted
+    auto future = m_worker.run<void>(
+        [password = password.toStdString()](Vault &vault, QPromise<void> &) {
+          vault.rekey(password);
+        });
+    show_progress(this, "Re-encrypting the vault...", future, false);
+    when_finished(this, future, [this](const QFuture<void> &future) {
+      if (succeeded(this, future, "Re-keying failed.")) {
+        ui->statusbar->showMessage("Vault re-keyed");
+      }
+      reload_fs_tree();
+    });
+  });
+
+  connect(ui->fsTreeView, &QTreeView::clicked, [this](const QModelIndex &) {
+    ui->previewWidget->setVisible(false);
+  });
+
+  connect(ui->previewPreviousButton, &QPushButton::clicked, this,
+          [this]() { show_preview_page(m_preview_page - 1); });
+  connect(ui->previewNextButton, &QPushButton::clicked, this,
+          [this]() { show_preview_page(m_preview_page + 1); });
+
+  connect(ui->fsTreeView, &QTreeView::customContextMenuRequested, this,
           &MainWindow::file_context_menu);
 
+#ifdef DULL_METRICS
+  // only instrumented builds have anything to show
+  connect(ui->menuVault->addAction("Performance counters"),
+          &QAction::triggered, this, &MainWindow::show_metrics);
+#endif
+
   connect(ui->actionAddFiles, &QAction::triggered, this, [this]() {
-    if (!m_vault) {
+    if (!m_worker.vault()) {
       return;
     }
 
     QStringList paths =
         QFileDialog::getOpenFileNames(this, "Choose files to add");
+    std::string directory = current_directory();
+    std::vector<ImportFile> files;
     for (const auto &path : paths) {
-      std::ifstream file(path.toStdString(), std::ios::binary);
-
-      std::string content((std::istreambuf_iterator<char>(file)),
-                          std::istreambuf_iterator<char>());
-
-      m_vault->create_file(path_to_filename(path.toStdString()), content);
+      collect_import_files(path.toStdString(), directory, files);
     }
-
-    reload_fs_tree();
-    ui->statusbar->showMessage("Added " + QString::number(paths.size()) +
-                               " files");
+    import_files(std::move(files));
   });
 
   connect(ui->actionExtract_All, &QAction::triggered, this, [this]() {
-    if (!m_vault) {
+    if (!m_worker.vault()) {
       return;
     }
 
@@ -136,77 +424,286 @@ MainWindow::MainWindow(QWidget *parent)
       return;
     }
 
-    auto headers = m_vault->read_file_headers();
-    for (const auto &header : headers) {
-      auto content = m_vault->read_file(header.name);
-      if (content) {
-        std::ofstream file(path.toStdString() + "/" + header.name,
-                           std::ios::binary);
-        file.write(content->data(), static_cast<i64>(content->size()));
+    auto future = m_worker.run<bool>(
+        [directory = path.toStdString()](Vault &vault,
+                                         QPromise<bool> &promise) {
+          promise.setProgressRange(0, static_cast<i32>(vault.file_count()));
+          std::atomic<bool> cancel = false;
+          return vault.extract_all(
+              directory,
+              [&](u64 done, u64) {
+                promise.setProgressValue(static_cast<i32>(done));
+                cancel = promise.isCanceled();
+              },
+              &cancel);
+        });
+
+    show_progress(this, "Extracting files...", future, true);
+    when_finished(this, future, [this, path](const QFuture<bool> &future) {
+      if (!succeeded(this, future,
+                     "Extraction failed, the vault may be corrupted.")) {
+        return;
       }
-    }
-    ui->statusbar->showMessage("Extracted all files to " + path);
+      if (future.isCanceled()) {
+        ui->statusbar->showMessage("Extraction cancelled");
+        return;
+      }
+      ui->statusbar->showMessage("Extracted all files to " + path);
+    });
   });
 }
 
+QString MainWindow::choose_password(const QString &title) {
+  QString password = QInputDialog::getText(this, title, "Choose a password",
+                                           QLineEdit::Password);
+  if (password.length() < 8) {
+    QMessageBox::critical(this, "Error",
+                          "Password must be at least 8 characters long.");
+    return {};
+  }
+  if (QInputDialog::getText(this, title, "Repeat the password",
+                            QLineEdit::Password) != password) {
+    QMessageBox::critical(this, "Error", "Passwords don't match.");
+    return {};
+  }
+  return password;
+}
+
 void MainWindow::reload_fs_tree() {
-  setWindowTitle(QString::fromStdString(m_vault->path()) + " - dull");
+  setWindowTitle(QString::fromStdString(m_worker.vault()->path()) + " - dull");
   ui->menuFiles->setEnabled(true);
-  ui->fsTreeWidget->clear();
-
-  auto headers = m_vault->read_file_headers();
-  for (const auto &header : headers) {
-    auto *item = new QTreeWidgetItem(ui->fsTreeWidget);
-    item->setIcon(0, style()->standardIcon(QStyle::SP_FileIcon));
-    item->setText(0, QString::fromStdString(header.name));
-    item->setText(1, QString::number(header.content_ciphertext_size));
+
+  // the view asks for the root's listing again
+  ++m_tree_generation;
+  m_model->reset();
+}
+
+void MainWindow::update_fs_tree(u64 generation,
+                                const std::function<void()> &update) {
+  // a change from before another vault was opened is of the wrong vault,
+  // listings still on the way are taken care of by the model
+  if (generation != m_tree_generation) {
+    reload_fs_tree();
+    return;
   }
-  for (int i = 0; i < ui->fsTreeWidget->columnCount(); ++i) {
-    ui->fsTreeWidget->resizeColumnToContents(i);
+  update();
+}
+
+void MainWindow::list_directory(const std::string &path) {
+  u64 generation = m_tree_generation;
+  auto future = m_worker.run<std::optional<DirectoryListing>>(
+      [path](Vault &vault, QPromise<std::optional<DirectoryListing>> &) {
+        return vault.list_directory(path);
+      });
+  when_finished(
+      this, future,
+      [this, path,
+       generation](QFuture<std::optional<DirectoryListing>> future) {
+        if (generation != m_tree_generation ||
+            !succeeded(this, future, "Failed to list files.")) {
+          return;
+        }
+        auto listing = future.takeResult();
+        if (listing) {
+          m_model->set_listing(path, std::move(listing.value()));
+        } else {
+          // deleted in the meantime
+          m_model->remove(path);
+        }
+      });
+}
+
+std::string MainWindow::current_directory() const {
+  QModelIndex index = ui->fsTreeView->currentIndex();
+  if (!index.isValid()) {
+    return "";
+  }
+  if (m_model->is_directory(index)) {
+    return m_model->path(index);
   }
+  QModelIndex parent = index.parent();
+  return parent.isValid() ? m_model->path(parent) : "";
+}
+
+void MainWindow::import_files(std::vector<ImportFile> files) {
+  u64 count = files.size();
+  u64 generation = m_tree_generation;
+  using Added = std::vector<std::pair<std::string, FileHeader>>;
+  auto future = m_worker.run<Added>(
+      [files = std::move(files)](Vault &vault, QPromise<Added> &promise) {
+        vault.create_files(files, [&](u64 done, u64 total) {
+          promise.setProgressRange(0, static_cast<i32>(total));
+          promise.setProgressValue(static_cast<i32>(done));
+        });
+
+        // only the new entries go to the tree
+        Added headers;
+        for (const auto &file : files) {
+          if (auto header = vault.file_header(file.name)) {
+            headers.emplace_back(file.name, std::move(header.value()));
+          }
+        }
+        return headers;
+      });
+
+  // the batch is committed all at once, so there's nothing to cancel
+  show_progress(this, "Adding files...", future, false);
+  when_finished(this, future,
+                [this, count, generation](QFuture<Added> future) {
+                  if (!succeeded(this, future, "Failed to add the files.")) {
+                    reload_fs_tree();
+                    return;
+                  }
+                  ui->statusbar->showMessage("Added " + QString::number(count) +
+                                             " files");
+                  update_fs_tree(generation, [&]() {
+                    m_model->insert(future.takeResult());
+                  });
+                });
 }
 
 void MainWindow::preview_file(const std::string &filename) {
-  ui->filePreview->setVisible(true);
+  m_preview_name = filename;
+  show_preview_page(0);
+}
 
-  auto content = m_vault->read_file(filename);
-  if (content) {
-    ui->filePreview->setText(QString::fromStdString(content.value()));
-  } else {
-    qWarning() << "File to preview not found";
-  }
+void MainWindow::show_preview_page(u64 page) {
+  std::string name = m_preview_name;
+  auto future = m_worker.run<std::optional<PreviewPage>>(
+      [name, page](Vault &vault, QPromise<std::optional<PreviewPage>> &)
+          -> std::optional<PreviewPage> {
+        auto header = vault.file_header(name);
+        if (!header) {
+          return std::nullopt;
+        }
+
+        // only the chunks covering the visible page get read and decrypted
+        PreviewPage result{};
+        result.pages = std::max<u64>(1, (header->content_size() +
+                                         PREVIEW_PAGE_SIZE - 1) /
+                                            PREVIEW_PAGE_SIZE);
+        result.page = std::min(page, result.pages - 1);
+
+        auto content = vault.read_range(
+            name, result.page * PREVIEW_PAGE_SIZE, PREVIEW_PAGE_SIZE);
+        if (!content) {
+          return std::nullopt;
+        }
+        result.content = std::move(content.value());
+        return result;
+      });
+
+  when_finished(this, future,
+                [this, name](QFuture<std::optional<PreviewPage>> future) {
+                  if (name != m_preview_name ||
+                      !succeeded(this, future, "Failed to read the file.")) {
+                    return;
+                  }
+                  auto result = future.result();
+                  if (!result) {
+                    qWarning() << "File to preview not found";
+                    return;
+                  }
+
+                  m_preview_page = result->page;
+                  ui->previewWidget->setVisible(true);
+                  ui->filePreview->setText(
+                      QString::fromStdString(result->content));
+                  ui->previewPageLabel->setText(
+                      "Page " + QString::number(result->page + 1) + " of " +
+                      QString::number(result->pages));
+                  ui->previewPreviousButton->setEnabled(result->page > 0);
+                  ui->previewNextButton->setEnabled(result->page + 1 <
+                                                    result->pages);
+                });
 }
 
 void MainWindow::extract_file(const std::string &filename) {
-  auto content = m_vault->read_file(filename);
-  if (content) {
-    QString path = QFileDialog::getSaveFileName(
-        this, "Choose location to extract",
-        QDir::currentPath() + "/" + QString::fromStdString(filename));
-    if (path.isEmpty()) {
+  QString path = QFileDialog::getSaveFileName(
+      this, "Choose location to extract",
+      QDir::currentPath() + "/" +
+          QString::fromStdString(path_to_filename(filename)));
+  if (path.isEmpty()) {
+    return;
+  }
+
+  auto future = m_worker.run<bool>(
+      [filename, out_path = path.toStdString()](Vault &vault,
+                                                QPromise<bool> &) {
+        std::ofstream file(out_path, std::ios::binary);
+        return vault.read_file(filename, file);
+      });
+  when_finished(this, future, [this, path](QFuture<bool> future) {
+    if (!succeeded(this, future, "Failed to extract the file.")) {
       return;
     }
+    if (future.result()) {
+      ui->statusbar->showMessage("Extracted to " + path);
+    } else {
+      qWarning() << "File to extract not found";
+    }
+  });
+}
 
-    std::ofstream file(path.toStdString(), std::ios::binary);
-    file.write(content->data(), static_cast<i64>(content->size()));
-
-    ui->statusbar->showMessage("Extracted to " + path);
-  } else {
-    qWarning() << "File to extract not found";
+void MainWindow::extract_directory(const std::string &path) {
+  QString parent =
+      QFileDialog::getExistingDirectory(this, "Choose location to extract");
+  if (parent.isEmpty()) {
+    return;
   }
+  QString out_path =
+      parent + "/" + QString::fromStdString(path_to_filename(path));
+
+  auto future = m_worker.run<bool>(
+      [path, directory = out_path.toStdString()](Vault &vault,
+                                                 QPromise<bool> &promise) {
+        std::atomic<bool> cancel = false;
+        return vault.extract_directory(
+            path, directory,
+            [&](u64 done, u64 total) {
+              promise.setProgressRange(0, static_cast<i32>(total));
+              promise.setProgressValue(static_cast<i32>(done));
+              cancel = promise.isCanceled();
+            },
+            &cancel);
+      });
+
+  show_progress(this, "Extracting files...", future, true);
+  when_finished(this, future, [this, out_path](const QFuture<bool> &future) {
+    if (!succeeded(this, future,
+                   "Extraction failed, the vault may be corrupted.")) {
+      return;
+    }
+    if (future.isCanceled()) {
+      ui->statusbar->showMessage("Extraction cancelled");
+      return;
+    }
+    ui->statusbar->showMessage("Extracted to " + out_path);
+  });
 }
 
 void MainWindow::edit_file(const std::string &filename) {
-  auto content = m_vault->read_file(filename);
-  if (content) {
-    QTemporaryDir dir;
-    ASSERT(dir.isValid());
-
-    std::string path = dir.path().toStdString() + "/" + filename;
-
-    std::ofstream file(path);
-    file.write(content->data(), static_cast<i64>(content->size()));
-    file.close();
+  // shared with the jobs, deleted along with its contents after the last
+  auto dir = std::make_shared<QTemporaryDir>();
+  ASSERT(dir->isValid());
+
+  std::string path =
+      dir->path().toStdString() + "/" + path_to_filename(filename);
+
+  auto future =
+      m_worker.run<bool>([filename, path](Vault &vault, QPromise<bool> &) {
+        std::ofstream file(path, std::ios::binary);
+        return vault.read_file(filename, file);
+      });
+  when_finished(this, future, [this, dir, filename,
+                               path](QFuture<bool> future) {
+    if (!succeeded(this, future, "Failed to read the file.")) {
+      return;
+    }
+    if (!future.result()) {
+      qWarning() << "File to edit not found";
+      return;
+    }
 
     QDesktopServices::openUrl(
         QUrl::fromLocalFile(QString::fromStdString(path)));
@@ -214,53 +711,271 @@ void MainWindow::edit_file(const std::string &filename) {
                              "Please edit the file in the opened editor and "
                              "save it. Click OK when done.");
 
-    std::ifstream file2(path, std::ios::binary);
-    std::string new_content((std::istreambuf_iterator<char>(file2)),
-                            std::istreambuf_iterator<char>());
+    u64 generation = m_tree_generation;
+    auto update = m_worker.run<std::optional<FileHeader>>(
+        [filename, path](Vault &vault,
+                         QPromise<std::optional<FileHeader>> &) {
+          std::ifstream file(path, std::ios::binary);
+          vault.update_file(filename, file);
+          return vault.file_header(filename);
+        });
+    when_finished(
+        this, update,
+        [this, dir, filename,
+         generation](QFuture<std::optional<FileHeader>> update) {
+          if (!succeeded(this, update, "Failed to update the file.")) {
+            reload_fs_tree();
+            return;
+          }
+          ui->statusbar->showMessage("File updated");
+          auto header = update.result();
+          update_fs_tree(generation, [&]() {
+            if (header) {
+              m_model->insert({{filename, header.value()}});
+            }
+          });
+        });
+  });
+}
 
-    m_vault->update_file(filename, new_content);
-    reload_fs_tree();
+void MainWindow::create_directory(const std::string &parent) {
+  QString name = QInputDialog::getText(this, "New folder", "Folder name");
+  if (name.isEmpty()) {
+    return;
+  }
+  std::string path = join_path(parent, name.toStdString());
+  if (!Vault::valid_path(path)) {
+    QMessageBox::critical(this, "Error", "Invalid folder name.");
+    return;
+  }
+
+  u64 generation = m_tree_generation;
+  auto future = m_worker.run<bool>([path](Vault &vault, QPromise<bool> &) {
+    return vault.create_directory(path);
+  });
+  when_finished(this, future,
+                [this, path, generation](QFuture<bool> future) {
+                  if (!succeeded(this, future,
+                                 "Failed to create the folder.")) {
+                    reload_fs_tree();
+                    return;
+                  }
+                  if (!future.result()) {
+                    QMessageBox::critical(this, "Error",
+                                          "This vault is too old for "
+                                          "folders, re-key it first.");
+                    return;
+                  }
+                  update_fs_tree(generation,
+                                 [&]() { m_model->insert_directory(path); });
+                });
+}
 
-    ui->statusbar->showMessage("File updated");
-    // QTemporaryDir gets deleted when it goes out of scope
-  } else {
-    qWarning() << "File to edit not found";
+void MainWindow::rename_entry(const std::string &path, bool directory) {
+  QString to = QInputDialog::getText(this, "Rename", "New path",
+                                     QLineEdit::Normal,
+                                     QString::fromStdString(path));
+  if (to.isEmpty() || to.toStdString() == path) {
+    return;
+  }
+  if (!Vault::valid_path(to.toStdString())) {
+    QMessageBox::critical(this, "Error", "Invalid name.");
+    return;
+  }
+
+  u64 generation = m_tree_generation;
+  auto future = m_worker.run<Renamed>(
+      [path, to = to.toStdString(), directory](Vault &vault,
+                                               QPromise<Renamed> &) {
+        Renamed result{vault.rename(path, to), std::nullopt};
+        if (result.renamed && !directory) {
+          result.header = vault.file_header(to);
+        }
+        return result;
+      });
+  when_finished(
+      this, future,
+      [this, path, to = to.toStdString(), directory,
+       generation](QFuture<Renamed> future) {
+        if (!succeeded(this, future, "Failed to rename.")) {
+          reload_fs_tree();
+          return;
+        }
+        auto result = future.result();
+        if (!result.renamed) {
+          QMessageBox::critical(this, "Error",
+                                "Something with that name already exists, "
+                                "or a folder would end up inside itself.");
+          return;
+        }
+        update_fs_tree(generation, [&]() {
+          m_model->remove(path);
+          if (directory) {
+            m_model->insert_directory(to);
+          } else if (result.header) {
+            m_model->insert({{to, result.header.value()}});
+          }
+        });
+      });
+}
+
+void MainWindow::delete_directory(const std::string &path) {
+  if (QMessageBox::question(this, "Delete folder",
+                            "Delete " + QString::fromStdString(path) +
+                                " and everything in it?") !=
+      QMessageBox::Yes) {
+    return;
   }
+
+  u64 generation = m_tree_generation;
+  auto future = m_worker.run<void>([path](Vault &vault, QPromise<void> &) {
+    vault.delete_directory(path);
+  });
+  when_finished(this, future,
+                [this, path, generation](const QFuture<void> &future) {
+                  if (!succeeded(this, future,
+                                 "Failed to delete the folder.")) {
+                    reload_fs_tree();
+                    return;
+                  }
+                  update_fs_tree(generation,
+                                 [&]() { m_model->remove(path); });
+                });
 }
 
 void MainWindow::file_context_menu(const QPoint &pos) {
-  QTreeWidgetItem *item = ui->fsTreeWidget->itemAt(pos);
-  if (item == nullptr) {
+  if (!m_worker.vault()) {
     return;
   }
 
   QMenu menu(this);
+  QModelIndex index = ui->fsTreeView->indexAt(pos);
+  if (!index.isValid() || m_model->is_directory(index)) {
+    // the row can go away while the menu is open
+    std::string path = index.isValid() ? m_model->path(index) : "";
+
+    QAction *new_action = menu.addAction(
+        style()->standardIcon(QStyle::SP_FileDialogNewFolder), "New folder");
+    connect(new_action, &QAction::triggered, this,
+            [this, path]() { create_directory(path); });
+
+    if (index.isValid()) {
+      QAction *extract_action = menu.addAction(
+          style()->standardIcon(QStyle::SP_DriveHDIcon), "Extract");
+      connect(extract_action, &QAction::triggered, this,
+              [this, path]() { extract_directory(path); });
+
+      QAction *rename_action = menu.addAction("Rename");
+      connect(rename_action, &QAction::triggered, this,
+              [this, path]() { rename_entry(path, true); });
+
+      QAction *delete_action = menu.addAction(
+          style()->standardIcon(QStyle::SP_DialogCancelButton), "Delete");
+      connect(delete_action, &QAction::triggered, this,
+              [this, path]() { delete_directory(path); });
+    }
+
+    menu.exec(ui->fsTreeView->mapToGlobal(pos));
+    return;
+  }
+
+  std::string filename = m_model->path(index);
 
   QAction *preview_action = menu.addAction(
       style()->standardIcon(QStyle::SP_FileDialogContentsView), "Preview");
   connect(preview_action, &QAction::triggered, this,
-          [this, item]() { preview_file(item->text(0).toStdString()); });
+          [this, filename]() { preview_file(filename); });
 
   QAction *edit_action = menu.addAction(
       style()->standardIcon(QStyle::SP_FileDialogDetailedView), "Edit");
   connect(edit_action, &QAction::triggered, this,
-          [this, item]() { edit_file(item->text(0).toStdString()); });
+          [this, filename]() { edit_file(filename); });
 
   QAction *extract_action =
       menu.addAction(style()->standardIcon(QStyle::SP_DriveHDIcon), "Extract");
   connect(extract_action, &QAction::triggered, this,
-          [this, item]() { extract_file(item->text(0).toStdString()); });
+          [this, filename]() { extract_file(filename); });
+
+  QAction *rename_action = menu.addAction("Rename");
+  connect(rename_action, &QAction::triggered, this,
+          [this, filename]() { rename_entry(filename, false); });
 
   QAction *delete_action = menu.addAction(
       style()->standardIcon(QStyle::SP_DialogCancelButton), "Delete");
-  connect(delete_action, &QAction::triggered, this, [this, item]() {
-    m_vault->delete_file(item->text(0).toStdString());
-    reload_fs_tree();
+  connect(delete_action, &QAction::triggered, this, [this, filename]() {
+    u64 generation = m_tree_generation;
+    auto future =
+        m_worker.run<void>([filename](Vault &vault, QPromise<void> &) {
+          vault.delete_file(filename);
+        });
+    when_finished(this, future,
+                  [this, filename, generation](const QFuture<void> &future) {
+                    if (!succeeded(this, future,
+                                   "Failed to delete the file.")) {
+                      reload_fs_tree();
+                      return;
+                    }
+                    update_fs_tree(generation,
+                                   [&]() { m_model->remove(filename); });
+                  });
   });
 
-  menu.exec(ui->fsTreeWidget->mapToGlobal(pos));
+  menu.exec(ui->fsTreeView->mapToGlobal(pos));
 }
 
+#ifdef DULL_METRICS
+void MainWindow::show_metrics() {
+  auto *dialog = new QDialog(this);
+  dialog->setAttribute(Qt::WA_DeleteOnClose);
+  dialog->setWindowTitle("Performance counters");
+
+  auto *text = new QPlainTextEdit(dialog);
+  text->setReadOnly(true);
+  text->setLineWrapMode(QPlainTextEdit::NoWrap);
+  text->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+
+  auto *buttons = new QDialogButtonBox(QDialogButtonBox::Close, dialog);
+  QPushButton *reset =
+      buttons->addButton("Reset", QDialogButtonBox::ResetRole);
+  QPushButton *save =
+      buttons->addButton("Save as JSON", QDialogButtonBox::ActionRole);
+
+  auto *layout = new QVBoxLayout(dialog);
+  layout->addWidget(text);
+  layout->addWidget(buttons);
+
+  // kept up to date while it's open
+  auto update = [this, text]() {
+    text->setPlainText(metrics_report(m_worker.vault().get()));
+  };
+  auto *timer = new QTimer(dialog);
+  connect(timer, &QTimer::timeout, dialog, update);
+  timer->start(1000);
+  update();
+
+  connect(reset, &QPushButton::clicked, dialog, [update]() {
+    Metrics::reset();
+    update();
+  });
+  connect(save, &QPushButton::clicked, dialog, [dialog]() {
+    QString path = QFileDialog::getSaveFileName(
+        dialog, "Save counters", "dull-metrics.json", "JSON (*.json)");
+    if (path.isEmpty()) {
+      return;
+    }
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly) ||
+        file.write(QByteArray::fromStdString(Metrics::to_json())) < 0) {
+      QMessageBox::critical(dialog, "Error", "Failed to save the counters.");
+    }
+  });
+  connect(buttons, &QDialogButtonBox::rejected, dialog, &QDialog::close);
+
+  dialog->resize(640, 400);
+  dialog->show();
+}
+#endif
+
 void MainWindow::dragEnterEvent(QDragEnterEvent *event) {
   if (event->mimeData()->hasUrls()) {
     const auto urls = event->mimeData()->urls();
@@ -279,26 +994,20 @@ void MainWindow::dropEvent(QDropEvent *event) {
     event->ignore();
     return;
   }
-  if (!m_vault) {
+  if (!m_worker.vault()) {
     return;
   }
 
+  // dropped folders come along with everything in them
+  std::string directory = current_directory();
+  std::vector<ImportFile> files;
   for (const QUrl &u : event->mimeData()->urls()) {
     if (!u.isLocalFile()) {
       continue;
     }
-    std::ifstream file(u.toLocalFile().toStdString(), std::ios::binary);
-    ASSERT(file.good());
-
-    std::string content((std::istreambuf_iterator<char>(file)),
-                        std::istreambuf_iterator<char>());
-
-    m_vault->create_file(path_to_filename(u.toLocalFile().toStdString()),
-                         content);
+    collect_import_files(u.toLocalFile().toStdString(), directory, files);
   }
-  ui->statusbar->showMessage(
-      "Added " + QString::number(event->mimeData()->urls().size()) + " files");
-  reload_fs_tree();
+  import_files(std::move(files));
 
   event->acceptProposedAction();
 }
@@ -2,6 +2,10 @@
 
 #include "ui_mainwindow.h"
 #include "vault.h"
+#include "vaultmodel.h"
+#include "vaultworker.h"
+
+constexpr u64 PREVIEW_PAGE_SIZE = static_cast<u64>(16 * 1024);
 
 class MainWindow : public QMainWindow {
   Q_OBJECT
@@ -16,11 +20,32 @@ protected:
 private:
   std::unique_ptr<Ui::MainWindow> ui;
 
-  std::unique_ptr<Vault> m_vault;
+  VaultWorker m_worker;
+  VaultModel *m_model;
+  // listings and changes from before the tree was reloaded are dropped
+  u64 m_tree_generation = 0;
+
+  std::string m_preview_name;
+  u64 m_preview_page = 0;
 
+  // empty if the user gave up or the password isn't good enough
+  QString choose_password(const QString &title);
   void reload_fs_tree();
+  void update_fs_tree(u64 generation, const std::function<void()> &update);
+  void list_directory(const std::string &path);
+  // the directory new files go to, the selected one or the selected file's
+  std::string current_directory() const;
+  void import_files(std::vector<ImportFile> files);
   void preview_file(const std::string &filename);
+  void show_preview_page(u64 page);
   void extract_file(const std::string &filename);
+  void extract_directory(const std::string &path);
   void edit_file(const std::string &filename);
+  void create_directory(const std::string &parent);
+  void rename_entry(const std::string &path, bool directory);
+  void delete_directory(const std::string &path);
   void file_context_menu(const QPoint &pos);
+#ifdef DULL_METRICS
+  void show_metrics();
+#endif
 };
@@ -0,0 +1,112 @@
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+
+namespace {
+
+struct Counters {
+  std::atomic<u64> count = 0;
+  std::atomic<u64> bytes = 0;
+  std::atomic<u64> nanoseconds = 0;
+  std::array<std::atomic<u64>, LATENCY_BUCKETS> latency{};
+};
+
+// nothing is ordered by them, relaxed is enough
+std::array<Counters, METRIC_COUNT> g_counters;
+
+} // namespace
+
+const char *Metrics::name(Metric metric) {
+  switch (metric) {
+  case Metric::Kdf:
+    return "kdf";
+  case Metric::Encrypt:
+    return "encrypt";
+  case Metric::Decrypt:
+    return "decrypt";
+  case Metric::FileRead:
+    return "file_read";
+  case Metric::FileWrite:
+    return "file_write";
+  case Metric::FileSync:
+    return "file_sync";
+  case Metric::Commit:
+    return "commit";
+  case Metric::EntryHeader:
+    return "entry_header";
+  case Metric::IndexLoad:
+    return "index_load";
+  case Metric::DirectoryListing:
+    return "directory_listing";
+  case Metric::EntryRead:
+    return "entry_read";
+  case Metric::EntryWrite:
+    return "entry_write";
+  }
+  return "unknown";
+}
+
+Metrics::Snapshot Metrics::snapshot(Metric metric) {
+  const Counters &counters = g_counters[static_cast<u64>(metric)];
+  Snapshot snapshot{};
+  snapshot.count = counters.count.load(std::memory_order_relaxed);
+  snapshot.bytes = counters.bytes.load(std::memory_order_relaxed);
+  snapshot.nanoseconds = counters.nanoseconds.load(std::memory_order_relaxed);
+  for (u64 i = 0; i < LATENCY_BUCKETS; i++) {
+    snapshot.latency[i] = counters.latency[i].load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+void Metrics::reset() {
+  for (auto &counters : g_counters) {
+    counters.count = 0;
+    counters.bytes = 0;
+    counters.nanoseconds = 0;
+    for (auto &bucket : counters.latency) {
+      bucket = 0;
+    }
+  }
+}
+
+std::string Metrics::to_json() {
+  std::string json = "{";
+  for (u64 i = 0; i < METRIC_COUNT; i++) {
+    auto metric = static_cast<Metric>(i);
+    Snapshot stats = snapshot(metric);
+    json += i == 0 ? "\n" : ",\n";
+    json += "  \"" + std::string(name(metric)) + "\": {\"count\": " +
+            std::to_string(stats.count) +
+            ", \"bytes\": " + std::to_string(stats.bytes) +
+            ", \"nanoseconds\": " + std::to_string(stats.nanoseconds) +
+            ", \"latency_ns\": {";
+    bool first = true;
+    for (u64 bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+      if (stats.latency[bucket] == 0) {
+        continue;
+      }
+      std::string bound = bucket + 1 == LATENCY_BUCKETS
+                              ? "inf"
+                              : std::to_string(static_cast<u64>(1) << bucket);
+      json += (first ? "\"<" : ", \"<") + bound +
+              "\": " + std::to_string(stats.latency[bucket]);
+      first = false;
+    }
+    json += "}}";
+  }
+  json += "\n}\n";
+  return json;
+}
+
+void Metrics::record(Metric metric, u64 bytes,
+                     std::chrono::nanoseconds elapsed) {
+  Counters &counters = g_counters[static_cast<u64>(metric)];
+  auto nanoseconds = static_cast<u64>(std::max<i64>(elapsed.count(), 0));
+  u64 bucket = std::min<u64>(std::bit_width(nanoseconds), LATENCY_BUCKETS - 1);
+
+  counters.count.fetch_add(1, std::memory_order_relaxed);
+  counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+  counters.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+  counters.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+}
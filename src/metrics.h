@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+#include <array>
+#include <chrono>
+#include <string>
+
+// what's counted and timed, process wide
+enum class Metric {
+  // password to key
+  Kdf,
+  // any AEAD call, chunks, names and indexes alike
+  Encrypt,
+  Decrypt,
+  // I/O on the vault file itself, views of a mapping aren't counted
+  FileRead,
+  FileWrite,
+  FileSync,
+  // a journal commit, syncs included
+  Commit,
+  // reading and decrypting an entry's header and name
+  EntryHeader,
+  // loading or rebuilding the index when a vault is opened
+  IndexLoad,
+  // what the GUI tree is built from
+  DirectoryListing,
+  // whole entries or ranges of them, by their plaintext size
+  EntryRead,
+  EntryWrite,
+};
+
+constexpr u64 METRIC_COUNT = static_cast<u64>(Metric::EntryWrite) + 1;
+// bucket i counts the calls that took less than 2^i ns, and at least
+// 2^(i - 1). the last one takes everything slower.
+constexpr u64 LATENCY_BUCKETS = 40;
+
+namespace Metrics {
+
+// set with the DULL_METRICS build option, timers compile to nothing
+// without it
+#ifdef DULL_METRICS
+constexpr bool ENABLED = true;
+#else
+constexpr bool ENABLED = false;
+#endif
+
+struct Snapshot {
+  u64 count;
+  u64 bytes;
+  u64 nanoseconds;
+  std::array<u64, LATENCY_BUCKETS> latency;
+};
+
+// the name it has in the JSON
+const char *name(Metric metric);
+Snapshot snapshot(Metric metric);
+void reset();
+// {"kdf": {"count": .., "bytes": .., "nanoseconds": .., "latency_ns":
+// {"<1024": .., ..}}, ..}, latency buckets without calls left out
+std::string to_json();
+
+void record(Metric metric, u64 bytes, std::chrono::nanoseconds elapsed);
+
+// records its own lifetime
+#ifdef DULL_METRICS
+class Timer {
+public:
+  explicit Timer(Metric metric, u64 bytes = 0)
+      : m_metric(metric), m_bytes(bytes),
+        m_start(std::chrono::steady_clock::now()) {}
+  ~Timer() {
+    record(m_metric, m_bytes, std::chrono::steady_clock::now() - m_start);
+  }
+
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+
+  void add_bytes(u64 bytes) { m_bytes += bytes; }
+
+private:
+  Metric m_metric;
+  u64 m_bytes;
+  std::chrono::steady_clock::time_point m_start;
+};
+#else
+class Timer {
+public:
+  explicit Timer(Metric /*metric*/, u64 /*bytes*/ = 0) {}
+  void add_bytes(u64 /*bytes*/) {}
+};
+#endif
+
+} // namespace Metrics
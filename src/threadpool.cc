@@ -0,0 +1,142 @@
+#include "threadpool.h"
+#include <algorithm>
+#include <exception>
+
+namespace {
+
+// which worker of which pool the current thread is, if any
+thread_local const ThreadPool *t_pool = nullptr;
+thread_local u32 t_worker = 0;
+
+} // namespace
+
+ThreadPool::ThreadPool(u32 threads) {
+  threads = std::max<u32>(threads, 1);
+  for (u32 i = 0; i + 1 < threads; i++) {
+    m_queues.push_back(std::make_unique<Queue>());
+  }
+  for (u32 i = 0; i + 1 < threads; i++) {
+    m_workers.emplace_back(&ThreadPool::worker, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stop = true;
+  }
+  m_cv.notify_all();
+  for (auto &worker : m_workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::parallel_for(u64 count,
+                              const std::function<void(u64)> &fn) {
+  if (m_workers.empty() || count == 1) {
+    for (u64 i = 0; i < count; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  struct Group {
+    std::atomic<u64> remaining;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::exception_ptr error;
+  };
+  auto group = std::make_shared<Group>();
+  group->remaining = count;
+
+  for (u64 i = 0; i < count; i++) {
+    push([group, &fn, i]() {
+      try {
+        fn(i);
+      } catch (...) {
+        std::lock_guard lock(group->mutex);
+        if (!group->error) {
+          group->error = std::current_exception();
+        }
+      }
+
+      if (--group->remaining == 0) {
+        std::lock_guard lock(group->mutex);
+        group->cv.notify_all();
+      }
+    });
+  }
+  m_cv.notify_all();
+
+  // help out instead of blocking, this also keeps nested calls from a
+  // worker thread from deadlocking
+  while (group->remaining > 0) {
+    Task task;
+    if (pop(task)) {
+      task();
+      continue;
+    }
+
+    std::unique_lock lock(group->mutex);
+    group->cv.wait(lock, [&]() { return group->remaining == 0; });
+  }
+
+  if (group->error) {
+    std::rethrow_exception(group->error);
+  }
+}
+
+void ThreadPool::worker(u32 index) {
+  t_pool = this;
+  t_worker = index;
+
+  while (true) {
+    Task task;
+    if (pop(task)) {
+      task();
+      continue;
+    }
+
+    std::unique_lock lock(m_mutex);
+    m_cv.wait(lock, [&]() { return m_stop || m_queued > 0; });
+    if (m_stop) {
+      return;
+    }
+  }
+}
+
+void ThreadPool::push(Task task) {
+  u64 index = t_pool == this ? t_worker : m_next_queue++ % m_queues.size();
+
+  {
+    std::lock_guard lock(m_mutex);
+    m_queued++;
+  }
+  std::lock_guard lock(m_queues[index]->mutex);
+  m_queues[index]->tasks.push_back(std::move(task));
+}
+
+bool ThreadPool::pop(Task &task) {
+  u64 count = m_queues.size();
+  u64 self = t_pool == this ? t_worker : m_next_queue.load() % count;
+
+  for (u64 i = 0; i < count; i++) {
+    auto &queue = *m_queues[(self + i) % count];
+    std::lock_guard lock(queue.mutex);
+    if (queue.tasks.empty()) {
+      continue;
+    }
+
+    // our own queue is used as a stack, others get robbed from the front
+    if (i == 0 && t_pool == this) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    m_queued--;
+    return true;
+  }
+  return false;
+}
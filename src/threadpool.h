@@ -0,0 +1,97 @@
+#pragma once
+
+#include "common.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool. Every worker owns a queue it pops from the back of,
+// idle workers (and threads waiting in parallel_for) steal from the front
+// of the others.
+class ThreadPool {
+public:
+  // the thread calling parallel_for counts as one of the threads
+  explicit ThreadPool(u32 threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  u32 threads() const { return static_cast<u32>(m_workers.size()) + 1; }
+
+  // runs fn(0) .. fn(count - 1) and waits for all of them, rethrows the
+  // first exception thrown by any of them
+  void parallel_for(u64 count, const std::function<void(u64)> &fn);
+
+private:
+  using Task = std::function<void()>;
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::vector<std::thread> m_workers;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::atomic<u64> m_queued = 0;
+  std::atomic<u64> m_next_queue = 0;
+  bool m_stop = false;
+
+  void worker(u32 index);
+  void push(Task task);
+  bool pop(Task &task);
+};
+
+// Blocking FIFO of at most `capacity` items for connecting pipeline stages.
+// After close() pushes fail and pops drain what is left.
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(u64 capacity) : m_capacity(capacity) {}
+
+  bool push(T item) {
+    std::unique_lock lock(m_mutex);
+    m_not_full.wait(lock,
+                    [&]() { return m_closed || m_items.size() < m_capacity; });
+    if (m_closed) {
+      return false;
+    }
+    m_items.push_back(std::move(item));
+    m_not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T &item) {
+    std::unique_lock lock(m_mutex);
+    m_not_empty.wait(lock, [&]() { return m_closed || !m_items.empty(); });
+    if (m_items.empty()) {
+      return false;
+    }
+    item = std::move(m_items.front());
+    m_items.pop_front();
+    m_not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard lock(m_mutex);
+    m_closed = true;
+    m_not_full.notify_all();
+    m_not_empty.notify_all();
+  }
+
+private:
+  u64 m_capacity;
+  std::deque<T> m_items;
+  bool m_closed = false;
+  std::mutex m_mutex;
+  std::condition_variable m_not_full;
+  std::condition_variable m_not_empty;
+};
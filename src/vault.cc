@@ -1,205 +1,3363 @@
 #include "vault.h"
 #include "common.h"
+#include "compression.h"
 #include "crypto.h"
+#include "metrics.h"
 #include <botan/auto_rng.h>
+#include <botan/exceptn.h>
+#include <cstring>
 #include <filesystem>
+#include <stdexcept>
 
-Vault::Vault(std::string path, const std::string &password)
-    : m_path(std::move(path)) {
-  m_file.open(m_path, std::ios::in | std::ios::out | std::ios::binary);
-  ASSERT(m_file.good());
+namespace {
 
-  std::array<char, 4> magic{};
-  ASSERT(m_file.read(magic.data(), 4));
-  ASSERT(std::string_view(magic.data(), magic.size()) == "DULL");
+template <typename T>
+void put(Botan::secure_vector<u8> &buffer, const T &value) {
+  const u8 *bytes = reinterpret_cast<const u8 *>(&value);
+  buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
 
-  i16 version = 0;
-  ASSERT(m_file.read(to_char_ptr(&version), sizeof(version)));
-  ASSERT(version == VERSION);
+void put_bytes(Botan::secure_vector<u8> &buffer, const u8 *data, u64 size) {
+  buffer.insert(buffer.end(), data, data + size);
+}
+
+class BufferReader {
+public:
+  explicit BufferReader(const Botan::secure_vector<u8> &buffer)
+      : m_buffer(buffer) {}
 
-  std::array<u8, 16> salt{};
-  ASSERT(m_file.read(to_char_ptr(salt.data()), 16));
+  template <typename T> T get() {
+    T value{};
+    get_bytes(reinterpret_cast<u8 *>(&value), sizeof(T));
+    return value;
+  }
+
+  void get_bytes(u8 *out, u64 size) {
+    ASSERT(m_pos + size <= m_buffer.size());
+    std::memcpy(out, m_buffer.data() + m_pos, size);
+    m_pos += size;
+  }
 
-  m_key = Crypto::derive_key_argon2id(password, salt);
+  void skip_to(u64 pos) {
+    ASSERT(pos >= m_pos && pos <= m_buffer.size());
+    m_pos = pos;
+  }
 
-  std::array<u8, 24> check_nonce{};
-  ASSERT(m_file.read(to_char_ptr(check_nonce.data()), 24));
+  bool at_end() const { return m_pos == m_buffer.size(); }
 
-  Botan::secure_vector<u8> check_ciphertext;
-  check_ciphertext.resize(22);
-  ASSERT(m_file.read(to_char_ptr(check_ciphertext.data()), 22));
+private:
+  const Botan::secure_vector<u8> &m_buffer;
+  u64 m_pos = 0;
+};
 
-  Crypto::decrypt_xchacha20_poly1305(check_ciphertext, m_key, check_nonce);
+// bytes left in a seekable stream, nullopt for pipes and the like
+std::optional<u64> remaining_size(std::istream &in) {
+  auto start = in.tellg();
+  if (start < 0) {
+    return std::nullopt;
+  }
+  in.seekg(0, std::ios::end);
+  auto end = in.tellg();
+  in.seekg(start);
+  if (end < start) {
+    return std::nullopt;
+  }
+  return static_cast<u64>(end - start);
 }
 
-std::vector<FileHeader> Vault::read_file_headers() {
-  std::vector<FileHeader> headers;
+// the bytes at [offset, offset + size), straight from the mapping when the
+// backend has one, otherwise read into `buffer`
+const u8 *fetch(VaultFile &file, u64 offset, u64 size,
+                Botan::secure_vector<u8> &buffer) {
+  const u8 *data = file.view(offset, size);
+  if (data != nullptr) {
+    return data;
+  }
+  buffer.resize(size);
+  return file.read(offset, buffer.data(), size) ? buffer.data() : nullptr;
+}
 
-  m_file.clear();
-  m_file.seekg(AFTER_HEADER_OFFSET, std::ios::beg);
+// entries, shared chunks and directories are kept the same way in a whole
+// index and in the changes to one. from RENAME_VERSION on entries always
+// have their directory, since their flags can be the old header's, and
+// what their header says if that differs.
+void put_index_entry(Botan::secure_vector<u8> &out, const FileHeader &header,
+                     bool renames) {
+  put(out, header.offset);
+  put(out, header.name_ciphertext_size);
+  put(out, header.content_ciphertext_size);
+  put(out, header.flags);
+  put_bytes(out, header.name_nonce.data(), header.name_nonce.size());
+  put_bytes(out, header.content_nonce.data(), header.content_nonce.size());
+  put(out, static_cast<u64>(header.name.size()));
+  put_bytes(out, reinterpret_cast<const u8 *>(header.name.data()),
+            header.name.size());
+  if ((header.flags & (ENTRY_COMPRESSED | ENTRY_DEDUPLICATED)) != 0) {
+    put(out, header.plaintext_size);
+  }
+  if (renames || (header.flags & ENTRY_NESTED) != 0) {
+    put(out, header.directory);
+  }
+  if (!renames) {
+    return;
+  }
+  put(out, static_cast<u8>(header.stored_key.has_value()));
+  if (header.stored_key) {
+    put(out, header.stored_key->directory);
+    put(out, static_cast<u64>(header.stored_key->name.size()));
+    put_bytes(out,
+              reinterpret_cast<const u8 *>(header.stored_key->name.data()),
+              header.stored_key->name.size());
+  }
+}
 
-  while (true) {
-    auto header = read_file_header();
-    if (header) {
-      headers.push_back(header.value());
-      m_file.seekg(static_cast<i64>(header->content_ciphertext_size),
-                   std::ios::cur);
-    } else {
-      break;
+FileHeader get_index_entry(BufferReader &reader, bool renames) {
+  FileHeader header{};
+  header.offset = reader.get<u64>();
+  header.name_ciphertext_size = reader.get<u64>();
+  header.content_ciphertext_size = reader.get<u64>();
+  header.flags = reader.get<u8>();
+  reader.get_bytes(header.name_nonce.data(), header.name_nonce.size());
+  reader.get_bytes(header.content_nonce.data(), header.content_nonce.size());
+  header.name.resize(reader.get<u64>());
+  reader.get_bytes(reinterpret_cast<u8 *>(header.name.data()),
+                   header.name.size());
+  if ((header.flags & (ENTRY_COMPRESSED | ENTRY_DEDUPLICATED)) != 0) {
+    header.plaintext_size = reader.get<u64>();
+  }
+  if (renames || (header.flags & ENTRY_NESTED) != 0) {
+    header.directory = reader.get<u64>();
+  }
+  if (renames && reader.get<u8>() != 0) {
+    EntryKey &stored = header.stored_key.emplace();
+    stored.directory = reader.get<u64>();
+    stored.name.resize(reader.get<u64>());
+    reader.get_bytes(reinterpret_cast<u8 *>(stored.name.data()),
+                     stored.name.size());
+  }
+  return header;
+}
+
+void put_index_chunk(Botan::secure_vector<u8> &out, const StoredChunk &chunk) {
+  put(out, chunk.offset);
+  put(out, chunk.size);
+  put(out, chunk.references);
+}
+
+StoredChunk get_index_chunk(BufferReader &reader) {
+  StoredChunk chunk{};
+  chunk.offset = reader.get<u64>();
+  chunk.size = reader.get<u64>();
+  chunk.references = reader.get<u64>();
+  return chunk;
+}
+
+// the nonces aren't kept, only reads of the content would need them
+void put_index_directory(Botan::secure_vector<u8> &out,
+                         const FileHeader &header) {
+  put(out, header.directory);
+  put(out, header.offset);
+  put(out, header.name_ciphertext_size);
+  put(out, header.content_ciphertext_size);
+  put(out, static_cast<u64>(header.name.size()));
+  put_bytes(out, reinterpret_cast<const u8 *>(header.name.data()),
+            header.name.size());
+}
+
+FileHeader get_index_directory(BufferReader &reader) {
+  FileHeader header{};
+  header.directory = reader.get<u64>();
+  header.offset = reader.get<u64>();
+  header.name_ciphertext_size = reader.get<u64>();
+  header.content_ciphertext_size = reader.get<u64>();
+  header.flags = ENTRY_DIRECTORY |
+                 (header.directory != ROOT_DIRECTORY ? ENTRY_NESTED : 0);
+  header.name.resize(reader.get<u64>());
+  reader.get_bytes(reinterpret_cast<u8 *>(header.name.data()),
+                   header.name.size());
+  return header;
+}
+
+KeySlot make_key_slot(u8 kind, const std::string &secret,
+                      const Crypto::KdfParams &kdf,
+                      const Botan::secure_vector<u8> &master_key) {
+  thread_local Botan::AutoSeeded_RNG rng;
+
+  KeySlot slot{};
+  slot.kind = kind;
+  slot.kdf = kdf;
+  slot.salt = rng.random_array<16>();
+  slot.nonce = rng.random_array<24>();
+
+  auto key = Crypto::derive_key_argon2id(secret, slot.salt, kdf);
+  auto wrapped_key =
+      Crypto::encrypt_xchacha20_poly1305(master_key, key, slot.nonce);
+  ASSERT(wrapped_key.size() == slot.wrapped_key.size());
+  std::copy(wrapped_key.begin(), wrapped_key.end(), slot.wrapped_key.begin());
+  return slot;
+}
+
+std::optional<Botan::secure_vector<u8>>
+unwrap_key_slot(const KeySlot &slot, const std::string &secret) {
+  auto key = Crypto::derive_key_argon2id(secret, slot.salt, slot.kdf);
+  try {
+    return Crypto::decrypt_xchacha20_poly1305(
+        Botan::secure_vector<u8>(slot.wrapped_key.begin(),
+                                 slot.wrapped_key.end()),
+        key, slot.nonce);
+  } catch (const Botan::Invalid_Authentication_Tag &) {
+    return std::nullopt;
+  }
+}
+
+Botan::secure_vector<u8>
+encode_header(i16 version, const std::array<KeySlot, MAX_KEY_SLOTS> &slots,
+              u8 options, const Segments &segments) {
+  Botan::secure_vector<u8> header;
+  put_bytes(header, reinterpret_cast<const u8 *>("DULL"), 4);
+  put(header, version);
+  put(header, options);
+  if ((options & VAULT_SEGMENTED) != 0) {
+    header.resize(SEGMENTS_OFFSET);
+    put(header, segments.size);
+    put(header, segments.first);
+  }
+  header.resize(KEY_SLOTS_OFFSET);
+
+  for (const auto &slot : slots) {
+    u64 start = header.size();
+    put(header, slot.kind);
+    put(header, KDF_ARGON2ID);
+    put(header, slot.kdf.memory_kib);
+    put(header, slot.kdf.iterations);
+    put(header, slot.kdf.parallelism);
+    put_bytes(header, slot.salt.data(), slot.salt.size());
+    put_bytes(header, slot.nonce.data(), slot.nonce.size());
+    put_bytes(header, slot.wrapped_key.data(), slot.wrapped_key.size());
+    header.resize(start + KEY_SLOT_SIZE);
+  }
+
+  header.resize(HEADER_SIZE);
+  return header;
+}
+
+// straight from the vault file, the packs have to be known before the
+// journal can be replayed. nothing but a rekey, which writes a new file,
+// changes them.
+Segments read_segments(const std::string &path) {
+  std::array<u8, SEGMENTS_OFFSET + 2 * sizeof(u64)> bytes{};
+  std::ifstream file(path, std::ios::binary);
+  if (!file.read(to_char_ptr(bytes.data()), static_cast<i64>(bytes.size()))) {
+    return {};
+  }
+
+  i16 version = 0;
+  std::memcpy(&version, bytes.data() + 4, sizeof(version));
+  if (version < SEGMENT_VERSION || (bytes[6] & VAULT_SEGMENTED) == 0) {
+    return {};
+  }
+  Segments segments;
+  std::memcpy(&segments.size, bytes.data() + SEGMENTS_OFFSET, sizeof(u64));
+  std::memcpy(&segments.first, bytes.data() + SEGMENTS_OFFSET + sizeof(u64),
+              sizeof(u64));
+  segments.start = HEADER_SIZE;
+  ASSERT(segments.size >= MIN_SEGMENT_SIZE && segments.first > 0);
+  return segments;
+}
+
+CacheOwner cache_owner(const std::array<u8, 24> &content_nonce) {
+  CacheOwner owner{};
+  std::copy(content_nonce.begin(), content_nonce.end(), owner.begin());
+  return owner;
+}
+
+// where an entry named `name` goes under `base`, nullopt for names that
+// would end up outside of it, which vaults from before directories can
+// have
+std::optional<std::filesystem::path>
+output_path(const std::filesystem::path &base, const std::string &name) {
+  if (!Vault::valid_path(name)) {
+    return std::nullopt;
+  }
+  std::filesystem::path path = base;
+  for (const auto &component : split_path(name)) {
+    // backslashes and drive letters on Windows
+    std::filesystem::path part(component);
+    if (part.has_root_path() || part.has_parent_path()) {
+      return std::nullopt;
+    }
+    path /= part;
+  }
+  return path;
+}
+
+} // namespace
+
+std::vector<std::string> split_path(const std::string &path) {
+  std::vector<std::string> components;
+  for (u64 start = 0; start <= path.size();) {
+    u64 end = std::min(path.find('/', start), path.size());
+    std::string component = path.substr(start, end - start);
+    if (!component.empty() && component != ".") {
+      components.push_back(std::move(component));
+    }
+    start = end + 1;
+  }
+  return components;
+}
+
+void collect_import_files(const std::string &path,
+                          const std::string &directory,
+                          std::vector<ImportFile> &files) {
+  auto name = [&](const std::string &relative) {
+    return directory.empty() ? relative : directory + "/" + relative;
+  };
+  if (!std::filesystem::is_directory(path)) {
+    files.push_back({name(path_to_filename(path)), path});
+    return;
+  }
+
+  auto root = std::filesystem::path(path).lexically_normal();
+  if (!root.has_filename()) {
+    root = root.parent_path();
+  }
+  for (const auto &entry :
+       std::filesystem::recursive_directory_iterator(root)) {
+    if (entry.is_regular_file()) {
+      files.push_back(
+          {name(entry.path()
+                    .lexically_relative(root.parent_path())
+                    .generic_string()),
+           entry.path().string()});
+    }
+  }
+}
+
+Vault::Vault(std::string path, const std::string &password,
+             IOBackend backend)
+    : m_path(std::move(path)), m_backend(backend) {
+  set_threads(0);
+  auto header = read_header();
+  if (m_version >= KEY_SLOT_VERSION) {
+    set_key(unlock(password));
+  } else {
+    set_key(Crypto::derive_key_argon2id(password, header.salt, header.kdf));
+    check_key(header);
+
+    // version 3 headers have room for the key slots, legacy ones need rekey
+    if (m_version >= KDF_VERSION) {
+      upgrade_key_slots(password);
     }
   }
+  open_index();
+}
+
+Vault::Vault(std::string path, Botan::secure_vector<u8> key,
+             IOBackend backend)
+    : m_path(std::move(path)), m_backend(backend) {
+  set_key(std::move(key));
+  set_threads(0);
+  auto header = read_header();
+  if (m_version < KEY_SLOT_VERSION) {
+    check_key(header);
+  }
+  open_index();
+}
+
+std::unique_ptr<Vault> Vault::create(const std::string &path,
+                                     const std::string &password,
+                                     std::optional<Crypto::KdfParams> kdf,
+                                     IOBackend backend, u64 segment_size) {
+  static Botan::AutoSeeded_RNG rng;
+
+  if (segment_size > 0 && segment_size < MIN_SEGMENT_SIZE) {
+    throw std::invalid_argument("segment size too small");
+  }
+  if (!kdf) {
+    kdf = Crypto::calibrate_argon2id(KDF_TARGET_TIME);
+  }
+
+  // the data is encrypted with a random key, the password only unwraps it
+  auto key = rng.random_vec(32);
+  std::array<KeySlot, MAX_KEY_SLOTS> slots{};
+  slots[0] = make_key_slot(KEY_SLOT_PASSWORD, password, kdf.value(), key);
+  Segments segments{segment_size, 1, HEADER_SIZE};
+  auto header = encode_header(
+      VERSION, slots, segment_size > 0 ? VAULT_SEGMENTED : 0, segments);
+
+  // a journal or packs left behind by whatever was here before aren't this
+  // vault's
+  std::filesystem::remove(path + JOURNAL_SUFFIX);
+  remove_segments(path, segments.first);
+  std::ofstream create(path, std::ios::binary);
+  ASSERT(create.write(to_char_ptr(header.data()),
+                      static_cast<i64>(header.size())));
+  create.close();
+
+  // the empty index gets written by the first open
+  return std::unique_ptr<Vault>(new Vault(path, std::move(key), backend));
+}
 
+std::vector<FileHeader> Vault::read_file_headers() {
+  std::shared_lock lock(m_index_mutex);
+  std::vector<FileHeader> headers;
+  headers.reserve(m_index.size());
+  for (const auto &[name, header] : m_index) {
+    headers.push_back(header);
+  }
   return headers;
 }
 
+u64 Vault::file_count() const {
+  std::shared_lock lock(m_index_mutex);
+  return m_index.size();
+}
+
+std::optional<FileHeader> Vault::file_header(const std::string &name) const {
+  std::shared_lock lock(m_index_mutex);
+  auto it = find_entry(name);
+  if (it == m_index.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
 std::optional<std::string> Vault::read_file(const std::string &filename) {
-  m_file.clear();
-  m_file.seekg(AFTER_HEADER_OFFSET, std::ios::beg);
+  std::string content;
+  if (auto header = file_header(filename)) {
+    content.reserve(header->content_size());
+  }
 
-  while (true) {
-    auto header = read_file_header();
-    if (!header) {
-      break;
-    }
+  if (!read_file(filename, [&](const u8 *data, u64 size) {
+        content.append(to_char_ptr(data), size);
+      })) {
+    return std::nullopt;
+  }
+  return content;
+}
 
-    if (header->name == filename) {
-      Botan::secure_vector<u8> ciphertext;
-      ciphertext.resize(header->content_ciphertext_size);
-      if (!m_file.read(to_char_ptr(ciphertext.data()),
-                       static_cast<i64>(header->content_ciphertext_size))) {
-        break;
-      }
+bool Vault::read_file(const std::string &filename, std::ostream &out) {
+  return read_file(filename, [&](const u8 *data, u64 size) {
+    ASSERT(out.write(to_char_ptr(data), static_cast<i64>(size)));
+  });
+}
+
+bool Vault::read_file(const std::string &filename, const ContentSink &sink) {
+  std::shared_lock lock(m_index_mutex);
+  auto it = find_entry(filename);
+  if (it == m_index.end()) {
+    return false;
+  }
+  Metrics::Timer timer(Metric::EntryRead, it->second.content_size());
+  return read_content(it->second, sink);
+}
+
+bool Vault::read_content(const FileHeader &header, const ContentSink &sink) {
+  if ((header.flags & ENTRY_DEDUPLICATED) != 0) {
+    return read_deduplicated(header, 0, header.content_size(), sink);
+  }
+  if ((header.flags & ENTRY_CHUNKED) == 0) {
+    // cached whole, as its only chunk
+    CacheOwner owner = cache_owner(header.content_nonce);
+    if (auto cached = m_cache.find(owner, 0)) {
+      sink(cached->data(), cached->size());
+      return true;
+    }
 
-      auto plaintext = Crypto::decrypt_xchacha20_poly1305(
-          ciphertext, m_key, header->content_nonce);
-      return std::string(to_char_ptr(plaintext.data()), plaintext.size());
+    Botan::secure_vector<u8> ciphertext;
+    ciphertext.resize(header.content_ciphertext_size);
+    if (!m_file->read(header.content_offset(), ciphertext.data(),
+                      ciphertext.size())) {
+      return false;
     }
 
-    m_file.seekg(static_cast<i64>(header->content_ciphertext_size),
-                 std::ios::cur);
+    m_ciphers->acquire()->decrypt(ciphertext, header.content_nonce);
+    sink(ciphertext.data(), ciphertext.size());
+    m_cache.insert(owner, 0, std::move(ciphertext));
+    return true;
+  }
+
+  return read_chunks(header, 0, header.chunks(), sink);
+}
+
+std::optional<std::string> Vault::read_range(const std::string &filename,
+                                             u64 offset, u64 length) {
+  std::string content;
+  if (!read_range(filename, offset, length, [&](const u8 *data, u64 size) {
+        content.append(to_char_ptr(data), size);
+      })) {
+    return std::nullopt;
+  }
+  return content;
+}
+
+bool Vault::read_range(const std::string &filename, u64 offset, u64 length,
+                       const ContentSink &sink) {
+  std::shared_lock lock(m_index_mutex);
+  auto it = find_entry(filename);
+  if (it == m_index.end()) {
+    return false;
+  }
+  const FileHeader &header = it->second;
+
+  u64 size = header.content_size();
+  offset = std::min(offset, size);
+  length = std::min(length, size - offset);
+  Metrics::Timer timer(Metric::EntryRead, length);
+  return read_bytes(header, offset, length, sink);
+}
+
+bool Vault::read_bytes(const FileHeader &header, u64 offset, u64 length,
+                       const ContentSink &sink, bool use_cache) {
+  if ((header.flags & ENTRY_DEDUPLICATED) != 0) {
+    return read_deduplicated(header, offset, length, sink, use_cache);
+  }
+
+  // entries from before chunking can only be decrypted as a whole
+  if ((header.flags & ENTRY_CHUNKED) == 0) {
+    return read_content(
+        header, [&](const u8 *data, u64) { sink(data + offset, length); });
   }
 
-  return std::nullopt;
+  if (length == 0) {
+    return true;
+  }
+
+  u64 first = offset / CHUNK_SIZE;
+  u64 last = (offset + length - 1) / CHUNK_SIZE;
+  u64 skip = offset - first * CHUNK_SIZE;
+  return read_chunks(
+      header, first, last + 1,
+      [&](const u8 *data, u64 size) {
+        u64 count = std::min(size - skip, length);
+        sink(data + skip, count);
+        length -= count;
+        skip = 0;
+      },
+      use_cache);
 }
 
 void Vault::create_file(const std::string &filename,
                         const std::string &content) {
-  m_file.clear();
-  m_file.seekp(0, std::ios::end);
+  std::lock_guard write_lock(m_write_mutex);
+  Metrics::Timer timer(Metric::EntryWrite, content.size());
+  u64 position = 0;
+  write_file(filename, content.size(), [&](u8 *buffer, u64 size) {
+    u64 count = std::min(size, content.size() - position);
+    std::memcpy(buffer, content.data() + position, count);
+    position += count;
+    return count;
+  });
+}
 
-  static Botan::AutoSeeded_RNG rng;
-  auto name_nonce = rng.random_array<24>();
-  auto content_nonce = rng.random_array<24>();
-
-  Botan::secure_vector<u8> filename_sv(filename.begin(), filename.end());
-  auto filename_ciphertext =
-      Crypto::encrypt_xchacha20_poly1305(filename_sv, m_key, name_nonce);
-  u64 filename_ciphertext_size = filename_ciphertext.size();
-
-  Botan::secure_vector<u8> content_sv(content.begin(), content.end());
-  auto ciphertext =
-      Crypto::encrypt_xchacha20_poly1305(content_sv, m_key, content_nonce);
-  u64 ciphertext_size = ciphertext.size();
-
-  ASSERT(m_file.write(to_char_ptr(name_nonce.data()), name_nonce.size()));
-  ASSERT(m_file.write(to_char_ptr(&filename_ciphertext_size), sizeof(u64)));
-  ASSERT(m_file.write(to_char_ptr(filename_ciphertext.data()),
-                      static_cast<i64>(filename_ciphertext_size)));
-  ASSERT(m_file.write(to_char_ptr(content_nonce.data()), content_nonce.size()));
-  ASSERT(m_file.write(to_char_ptr(&ciphertext_size), sizeof(u64)));
-  ASSERT(m_file.write(to_char_ptr(ciphertext.data()),
-                      static_cast<i64>(ciphertext_size)));
-  m_file.flush();
+void Vault::create_file(const std::string &filename, std::istream &content) {
+  std::lock_guard write_lock(m_write_mutex);
+  Metrics::Timer timer(Metric::EntryWrite);
+  write_file(filename, remaining_size(content), [&](u8 *buffer, u64 size) {
+    content.read(to_char_ptr(buffer), static_cast<i64>(size));
+    timer.add_bytes(static_cast<u64>(content.gcount()));
+    return static_cast<u64>(content.gcount());
+  });
 }
 
 void Vault::delete_file(const std::string &filename) {
-  m_file.clear();
-  m_file.seekg(AFTER_HEADER_OFFSET, std::ios::beg);
+  std::lock_guard write_lock(m_write_mutex);
+  std::unique_lock lock(m_index_mutex);
+  auto it = find_entry(filename);
+  if (it == m_index.end()) {
+    return;
+  }
 
-  i64 entry_start = -1;
-  u64 entry_total_size = 0;
+  drop_entry(it->second);
+  m_index_changes.entries.insert(it->first);
+  m_index.erase(it);
+  lock.unlock();
+  commit();
+}
 
-  while (true) {
-    i64 current_pos = m_file.tellg();
+void Vault::create_files(const std::vector<ImportFile> &files,
+                         const ProgressCallback &progress) {
+  std::lock_guard write_lock(m_write_mutex);
+  u64 group_size = BATCH_CHUNKS_PER_THREAD * m_pool->threads();
+  std::vector<FileHeader> written;
+  written.reserve(files.size());
 
-    auto header = read_file_header();
-    if (!header) {
+  // directories go in first, the entries only need their ids. they're
+  // committed along with the entries, a failure takes them back out.
+  std::vector<EntryKey> keys;
+  keys.reserve(files.size());
+  u64 data_end = m_data_end;
+  u64 first_directory = m_next_directory_id;
+
+  // entries are laid out back to back from m_data_end, small ones are
+  // collected in `buffer` and written out in one go. readers don't see any
+  // of them until the batch is committed.
+  u64 end = data_end;
+  PendingChunks pending;
+  Botan::secure_vector<u8> buffer;
+  u64 buffer_offset = end;
+  auto flush_buffer = [&]() {
+    m_file->write(buffer_offset, buffer.data(), buffer.size());
+    buffer.clear();
+    buffer_offset = end;
+  };
+
+  try {
+    {
+      std::unique_lock lock(m_index_mutex);
+      for (const auto &file : files) {
+        keys.push_back(make_entry_key(file.name));
+      }
+    }
+    end = m_data_end;
+    buffer_offset = end;
+
+    for (u64 start = 0; start < files.size(); start += group_size) {
+      struct Encoded {
+        FileHeader header;
+        Botan::secure_vector<u8> bytes;
+        bool large;
+      };
+      std::vector<Encoded> encoded(std::min(group_size, files.size() - start));
+
+      m_pool->parallel_for(encoded.size(), [&](u64 i) {
+        const ImportFile &file = files[start + i];
+        std::ifstream in(file.path, std::ios::binary);
+        if (!in.good()) {
+          throw std::runtime_error("can't read " + file.path);
+        }
+
+        // deduplication has to look at every chunk in order
+        auto size = remaining_size(in);
+        if (!size || size.value() > BATCH_MAX_FILE_SIZE || deduplicating()) {
+          encoded[i].large = true;
+          return;
+        }
+
+        Botan::secure_vector<u8> content(size.value());
+        if (!in.read(to_char_ptr(content.data()),
+                     static_cast<i64>(content.size()))) {
+          throw std::runtime_error("can't read " + file.path);
+        }
+        encoded[i].header =
+            encode_chunked_entry(keys[start + i], content, encoded[i].bytes);
+      });
+
+      for (u64 i = 0; i < encoded.size(); i++) {
+        if (encoded[i].large) {
+          // big files are streamed, they parallelize over their own chunks
+          flush_buffer();
+          std::ifstream in(files[start + i].path, std::ios::binary);
+          if (!in.good()) {
+            throw std::runtime_error("can't read " + files[start + i].path);
+          }
+          FileHeader header = write_new_entry(
+              keys[start + i], end,
+              [&](u8 *data, u64 size) {
+                in.read(to_char_ptr(data), static_cast<i64>(size));
+                return static_cast<u64>(in.gcount());
+              },
+              pending);
+          end = header.offset + header.total_size();
+          buffer_offset = end;
+          written.push_back(header);
+          continue;
+        }
+
+        encoded[i].header.offset = end;
+        end += encoded[i].bytes.size();
+        buffer.insert(buffer.end(), encoded[i].bytes.begin(),
+                      encoded[i].bytes.end());
+        written.push_back(encoded[i].header);
+      }
+
+      if (buffer.size() >= BATCH_WRITE_SIZE) {
+        flush_buffer();
+      }
+      if (progress) {
+        progress(start + encoded.size(), files.size());
+      }
+    }
+    flush_buffer();
+  } catch (...) {
+    std::unique_lock lock(m_index_mutex);
+    for (auto it = m_directories.lower_bound(first_directory);
+         it != m_directories.end();) {
+      m_live_size -= it->second.total_size();
+      m_directory_ids.erase(it->second.key());
+      it = m_directories.erase(it);
+    }
+    m_next_directory_id = first_directory;
+    m_data_end = data_end;
+
+    // whatever was written went over the index, it's written again
+    write_index();
+    m_index_log.clear();
+    lock.unlock();
+    commit();
+    throw;
+  }
+
+  // commit the whole batch with one index write
+  std::unique_lock lock(m_index_mutex);
+  m_data_end = end;
+  publish_chunks(pending);
+  for (u64 i = 0; i < written.size(); i++) {
+    // might be an entry from before directories, under another key
+    auto it = find_entry(files[i].name);
+    if (it != m_index.end()) {
+      drop_entry(it->second);
+      m_index_changes.entries.insert(it->first);
+      m_index.erase(it);
+    }
+    m_index[written[i].key()] = written[i];
+    m_index_changes.entries.insert(written[i].key());
+    m_live_size += written[i].total_size();
+  }
+  lock.unlock();
+  commit();
+}
+
+bool Vault::extract_all(const std::string &directory,
+                        const ProgressCallback &progress,
+                        const std::atomic<bool> *cancel) {
+  std::shared_lock lock(m_index_mutex);
+  return extract(ROOT_DIRECTORY, directory, progress, cancel);
+}
+
+bool Vault::extract_directory(const std::string &path,
+                              const std::string &directory,
+                              const ProgressCallback &progress,
+                              const std::atomic<bool> *cancel) {
+  std::shared_lock lock(m_index_mutex);
+  auto id = find_directory(path);
+  if (!id) {
+    return false;
+  }
+  return extract(id.value(), directory, progress, cancel);
+}
+
+bool Vault::extract(u64 directory, const std::string &out_directory,
+                    const ProgressCallback &progress,
+                    const std::atomic<bool> *cancel) {
+  // empty directories are extracted too
+  std::vector<u64> directories = subtree(directory);
+  u64 skipped = 0;
+  for (u64 id : directories) {
+    if (id != directory) {
+      const FileHeader &header = m_directories.at(id);
+      auto path = output_path(
+          out_directory, path_of(header.directory, header.name, directory));
+      if (path) {
+        std::filesystem::create_directories(path.value());
+      } else {
+        skipped++;
+      }
+    }
+  }
+
+  // one sequential pass over the file instead of a lookup per entry. names
+  // that would land outside of `out_directory` are left out.
+  std::vector<const FileHeader *> entries;
+  for (u64 id : directories) {
+    for (auto it = m_index.lower_bound({id, ""});
+         it != m_index.end() && it->first.directory == id; ++it) {
+      if (output_path(out_directory,
+                      path_of(id, it->second.name, directory))) {
+        entries.push_back(&it->second);
+      } else {
+        skipped++;
+      }
+    }
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const auto *a, const auto *b) { return a->offset < b->offset; });
+
+  struct Piece {
+    u64 entry;
+    u64 first_chunk;
+    std::vector<Botan::secure_vector<u8>> data;
+    bool last;
+    // already decrypted by the reader
+    bool plain = false;
+  };
+  BoundedQueue<Piece> encrypted(PIPELINE_DEPTH);
+  BoundedQueue<Piece> decrypted(PIPELINE_DEPTH);
+
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto fail = [&]() {
+    std::lock_guard lock(error_mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+    encrypted.close();
+    decrypted.close();
+  };
+
+  // stage 1: read the ciphertext in file order
+  std::thread reader([&]() {
+    try {
+      u64 batch_size = BATCH_CHUNKS_PER_THREAD * m_pool->threads();
+      for (u64 i = 0; i < entries.size(); i++) {
+        const FileHeader &header = *entries[i];
+        if ((header.flags & ENTRY_DEDUPLICATED) != 0) {
+          // shared chunks can be anywhere in the file, they're read and
+          // decrypted a batch at a time right here
+          u64 size = header.content_size();
+          u64 step = batch_size * CHUNK_SIZE;
+          for (u64 start = 0; start == 0 || start < size; start += step) {
+            Piece piece{i, start, {}, start + step >= size, true};
+            piece.data.emplace_back();
+            auto append = [&](const u8 *data, u64 count) {
+              put_bytes(piece.data[0], data, count);
+            };
+            if (!read_deduplicated(header, start,
+                                   std::min(step, size - start), append,
+                                   false)) {
+              throw std::runtime_error("can't read " + header.name);
+            }
+            if (!encrypted.push(std::move(piece))) {
+              return;
+            }
+          }
+          continue;
+        }
+
+        auto table = read_chunk_table(header);
+        ASSERT(table);
+        const auto &offsets = table->offsets;
+        u64 chunks = offsets.size() - 1;
+
+        for (u64 start = 0; start < chunks; start += batch_size) {
+          Piece piece{i, start, {}, start + batch_size >= chunks};
+          piece.data.resize(std::min(batch_size, chunks - start));
+          for (u64 j = 0; j < piece.data.size(); j++) {
+            u64 index = start + j;
+            piece.data[j].resize(offsets[index + 1] - offsets[index]);
+            ASSERT(m_file->read(header.content_offset() + offsets[index],
+                                piece.data[j].data(), piece.data[j].size()));
+          }
+          if (!encrypted.push(std::move(piece))) {
+            return;
+          }
+        }
+      }
+      encrypted.close();
+    } catch (...) {
+      fail();
+    }
+  });
+
+  // stage 2: decrypt, each batch spread over the pool
+  std::thread decryptor([&]() {
+    try {
+      Piece piece;
+      while (encrypted.pop(piece)) {
+        const FileHeader &header = *entries[piece.entry];
+        if (piece.plain) {
+          // nothing to decrypt
+        } else if ((header.flags & ENTRY_CHUNKED) == 0) {
+          m_ciphers->acquire()->decrypt(piece.data[0], header.content_nonce);
+        } else {
+          m_pool->parallel_for(piece.data.size(), [&](u64 j) {
+            open_chunk(header, piece.first_chunk + j, piece.data[j]);
+          });
+        }
+        if (!decrypted.push(std::move(piece))) {
+          return;
+        }
+      }
+      decrypted.close();
+    } catch (...) {
+      fail();
+    }
+  });
+
+  // stage 3: write the files out on the calling thread
+  std::ofstream out;
+  std::filesystem::path out_path;
+  u64 done = 0;
+  Piece piece;
+  while (decrypted.pop(piece)) {
+    if (cancel != nullptr && cancel->load()) {
+      encrypted.close();
+      decrypted.close();
       break;
     }
 
-    if (header->name == filename) {
-      entry_start = current_pos;
-      entry_total_size = 24 + sizeof(u64) + header->name_ciphertext_size + 24 +
-                         sizeof(u64) + header->content_ciphertext_size;
-      m_file.seekg(static_cast<i64>(header->content_ciphertext_size),
-                   std::ios::cur);
+    try {
+      if (piece.first_chunk == 0) {
+        const FileHeader &header = *entries[piece.entry];
+        out_path = output_path(out_directory,
+                               path_of(header.directory, header.name,
+                                       directory))
+                       .value();
+        // names from before directories can have them in the name
+        std::filesystem::create_directories(out_path.parent_path());
+        out.open(out_path, std::ios::binary);
+      }
+      for (const auto &plaintext : piece.data) {
+        out.write(to_char_ptr(plaintext.data()),
+                  static_cast<i64>(plaintext.size()));
+      }
+      if (!out) {
+        throw std::runtime_error("can't write " + out_path.string());
+      }
+    } catch (...) {
+      fail();
       break;
     }
+    if (piece.last) {
+      out.close();
+      done++;
+      if (progress) {
+        progress(done, entries.size());
+      }
+    }
+  }
+
+  reader.join();
+  decryptor.join();
+
+  // don't leave a half written file behind
+  if (out.is_open()) {
+    out.close();
+    std::filesystem::remove(out_path);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  if (skipped > 0 && done == entries.size()) {
+    throw std::runtime_error(std::to_string(skipped) +
+                             " entries have names that point outside of " +
+                             out_directory);
+  }
+  return done == entries.size();
+}
+
+std::vector<DamagedEntry> Vault::verify(const ProgressCallback &progress,
+                                        const std::atomic<bool> *cancel) {
+  std::shared_lock lock(m_index_mutex);
+
+  struct Record {
+    FileHeader header;
+    // as it's encrypted, nested entries have their directory id first
+    std::string name;
+    std::string path;
+  };
+  std::vector<Record> records;
+  // the index doesn't keep the nonces of these, they're taken from the file
+  constexpr u8 UNINDEXED_NONCES = ENTRY_SHARED_CHUNK | ENTRY_DIRECTORY;
+  auto add_record = [&](const FileHeader &header, std::string path) {
+    EntryKey key = header.stored_key.value_or(header.key());
+    std::string name = key.name;
+    if ((header.flags & ENTRY_NESTED) != 0) {
+      name.insert(0, reinterpret_cast<const char *>(&key.directory),
+                  sizeof(u64));
+    }
+    records.push_back({header, std::move(name), std::move(path)});
+  };
+  for (const auto &[key, header] : m_index) {
+    add_record(header, path_of(key.directory, key.name));
+  }
+  for (const auto &[id, header] : m_directories) {
+    add_record(header, path_of(header.directory, header.name));
+  }
+  for (const auto &[id, chunk] : m_chunks) {
+    FileHeader header{};
+    header.offset = chunk.offset;
+    header.name = std::string(id.begin(), id.end());
+    header.name_ciphertext_size = sizeof(ChunkId) + TAG_SIZE;
+    header.content_ciphertext_size = chunk.size - SHARED_CHUNK_HEADER_SIZE;
+    header.flags = ENTRY_SHARED_CHUNK;
+    add_record(header, "");
+  }
+
+  // index headers aren't kept, they're read again. checking the name size
+  // first keeps read_file_header from asserting on a broken one.
+  std::vector<DamagedEntry> damaged;
+  std::vector<u64> indexes = m_index_log;
+  if (indexes.empty()) {
+    indexes.push_back(m_data_end);
+  }
+  for (u64 offset : indexes) {
+    try {
+      u64 name_size = 0;
+      std::optional<FileHeader> index;
+      if (m_file->read(offset + 24, reinterpret_cast<u8 *>(&name_size),
+                       sizeof(u64)) &&
+          name_size < MAX_NAME_CIPHERTEXT_SIZE) {
+        index = read_file_header(offset);
+      }
+      if (index && (index->flags & ENTRY_INDEX) != 0) {
+        add_record(index.value(), "");
+      } else {
+        damaged.push_back({offset, "", "unreadable index header"});
+      }
+    } catch (const Botan::Exception &e) {
+      damaged.push_back({offset, "", e.what()});
+    }
+  }
 
-    m_file.seekg(static_cast<i64>(header->content_ciphertext_size),
-                 std::ios::cur);
+  std::sort(records.begin(), records.end(), [](const auto &a, const auto &b) {
+    return a.header.offset < b.header.offset;
+  });
+  u64 total = 0;
+  for (const auto &record : records) {
+    total += record.header.total_size();
   }
 
-  if (entry_start != -1) {
-    i64 entry_end = entry_start + static_cast<i64>(entry_total_size);
+  // one independently authenticated part of a record
+  enum class Part { Header, Content, Chunk };
+  struct Check {
+    u64 record;
+    Part part;
+    u64 chunk;
+    // what whole content is decrypted with
+    std::array<u8, 24> nonce;
+    Botan::secure_vector<u8> data;
+  };
+  BoundedQueue<std::vector<Check>> batches(PIPELINE_DEPTH);
+
+  // the first thing wrong with each record
+  std::mutex errors_mutex;
+  std::map<u64, std::string> errors;
+  auto report = [&](u64 record, const std::string &error) {
+    std::lock_guard lock(errors_mutex);
+    errors.emplace(record, error);
+  };
+
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto fail = [&]() {
+    std::lock_guard lock(error_mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+    batches.close();
+  };
+
+  // the reader streams through the file, up to PIPELINE_DEPTH batches
+  // ahead of the checks
+  std::thread reader([&]() {
+    try {
+      u64 batch_size = BATCH_CHUNKS_PER_THREAD * m_pool->threads();
+      std::vector<Check> batch;
+      u64 batch_bytes = 0;
+      auto push = [&](Check check) {
+        batch_bytes += check.data.size();
+        batch.push_back(std::move(check));
+        if (batch.size() < batch_size &&
+            batch_bytes < batch_size * CHUNK_CIPHERTEXT_SIZE) {
+          return true;
+        }
+        batch_bytes = 0;
+        bool pushed = batches.push(std::move(batch));
+        batch.clear();
+        return pushed;
+      };
+      auto read = [&](u64 offset, Botan::secure_vector<u8> &data) {
+        return m_file->read(offset, data.data(), data.size());
+      };
+
+      for (u64 i = 0; i < records.size(); i++) {
+        const FileHeader &header = records[i].header;
+        Check check{i, Part::Header, 0, header.content_nonce, {}};
+        check.data.resize(header.content_offset() - header.offset);
+        if (!read(header.offset, check.data)) {
+          report(i, "cut off by the end of the file");
+          continue;
+        }
+        if ((header.flags & UNINDEXED_NONCES) != 0) {
+          std::memcpy(check.nonce.data(),
+                      check.data.data() + check.data.size() - 24 -
+                          sizeof(u64),
+                      24);
+        }
+        std::array<u8, 24> nonce = check.nonce;
+        if (!push(std::move(check))) {
+          return;
+        }
+
+        if ((header.flags & ENTRY_CHUNKED) == 0) {
+          Check content{i, Part::Content, 0, nonce, {}};
+          content.data.resize(header.content_ciphertext_size);
+          if (!read(header.content_offset(), content.data)) {
+            report(i, "cut off by the end of the file");
+          } else if (!push(std::move(content))) {
+            return;
+          }
+          continue;
+        }
+
+        std::optional<ChunkTable> table;
+        try {
+          table = read_chunk_table(header);
+        } catch (const Botan::Exception &e) {
+          report(i, std::string("chunk table: ") + e.what());
+          continue;
+        }
+        if (!table || table->content_size != header.content_size()) {
+          report(i, "chunk table doesn't match the index");
+          continue;
+        }
+        const auto &offsets = table->offsets;
+        for (u64 j = 0; j + 1 < offsets.size(); j++) {
+          Check chunk{i, Part::Chunk, j, {}, {}};
+          chunk.data.resize(offsets[j + 1] - offsets[j]);
+          if (!read(header.content_offset() + offsets[j], chunk.data)) {
+            report(i, "cut off by the end of the file");
+            break;
+          }
+          if (!push(std::move(chunk))) {
+            return;
+          }
+        }
+      }
+      if (!batch.empty() && !batches.push(std::move(batch))) {
+        return;
+      }
+      batches.close();
+    } catch (...) {
+      fail();
+    }
+  });
+
+  // the headers are compared with the index byte for byte, everything
+  // encrypted has to decrypt
+  auto check_header = [&](const Record &record, const Check &check) {
+    const FileHeader &header = record.header;
+    const u8 *data = check.data.data();
+    std::array<u8, 24> name_nonce{};
+    std::memcpy(name_nonce.data(), data, name_nonce.size());
+    u64 name_size = 0;
+    std::memcpy(&name_size, data + 24, sizeof(u64));
+    u64 size_and_flags = 0;
+    std::memcpy(&size_and_flags,
+                data + check.data.size() - sizeof(u64), sizeof(u64));
+
+    bool indexed = (header.flags & UNINDEXED_NONCES) == 0;
+    if (name_size != header.name_ciphertext_size ||
+        size_and_flags != (header.content_ciphertext_size |
+                           static_cast<u64>(header.flags) << 56) ||
+        (indexed && (name_nonce != header.name_nonce ||
+                     std::memcmp(data + check.data.size() - 24 - sizeof(u64),
+                                 header.content_nonce.data(), 24) != 0))) {
+      report(check.record, "header doesn't match the index");
+      return;
+    }
+
+    Botan::secure_vector<u8> name;
+    try {
+      m_ciphers->acquire()->decrypt(data + 24 + sizeof(u64), name_size,
+                                    name_nonce, name);
+    } catch (const Botan::Exception &e) {
+      report(check.record, std::string("name: ") + e.what());
+      return;
+    }
+    if (std::string(name.begin(), name.end()) != record.name) {
+      report(check.record, "name doesn't match the index");
+    }
+  };
 
-    m_file.clear();
-    m_file.seekg(entry_end, std::ios::beg);
-    std::string remaining;
-    remaining.assign(std::istreambuf_iterator<char>(m_file),
-                     std::istreambuf_iterator<char>());
+  u64 done = 0;
+  bool cancelled = false;
+  std::vector<Check> batch;
+  while (batches.pop(batch)) {
+    if (cancel != nullptr && cancel->load()) {
+      batches.close();
+      cancelled = true;
+      break;
+    }
 
-    m_file.clear();
-    m_file.seekp(entry_start, std::ios::beg);
-    ASSERT(m_file.write(remaining.data(), static_cast<i64>(remaining.size())));
+    // by their ciphertext, decrypting shrinks them
+    for (const auto &check : batch) {
+      done += check.data.size();
+    }
+    try {
+      m_pool->parallel_for(batch.size(), [&](u64 j) {
+        Check &check = batch[j];
+        const Record &record = records[check.record];
+        if (check.part == Part::Header) {
+          check_header(record, check);
+          return;
+        }
+        try {
+          if (check.part == Part::Content) {
+            m_ciphers->acquire()->decrypt(check.data, check.nonce);
+          } else {
+            open_chunk(record.header, check.chunk, check.data);
+          }
+        } catch (const Botan::Exception &e) {
+          report(check.record, check.part == Part::Content
+                                   ? std::string("content: ") + e.what()
+                                   : "chunk " + std::to_string(check.chunk) +
+                                         ": " + e.what());
+        }
+      });
+    } catch (...) {
+      // anything but a broken record, the reader is stopped first
+      fail();
+      break;
+    }
 
-    i64 new_size = entry_start + static_cast<i64>(remaining.size());
-    m_file.flush();
-    m_file.close();
+    if (progress) {
+      progress(std::min(done, total), total);
+    }
+  }
 
-    std::filesystem::resize_file(m_path, new_size);
+  reader.join();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  // chunk tables and whatever was skipped past a broken part aren't counted
+  if (progress && !cancelled && done != total) {
+    progress(total, total);
+  }
 
-    m_file.open(m_path, std::ios::in | std::ios::out | std::ios::binary);
-    ASSERT(m_file.good());
+  for (const auto &[record, message] : errors) {
+    damaged.push_back(
+        {records[record].header.offset, records[record].path, message});
   }
+  std::sort(damaged.begin(), damaged.end(),
+            [](const auto &a, const auto &b) { return a.offset < b.offset; });
+  return damaged;
 }
 
 void Vault::update_file(const std::string &filename,
                         const std::string &content) {
-  delete_file(filename);
   create_file(filename, content);
 }
 
-std::optional<FileHeader> Vault::read_file_header() {
-  FileHeader header{};
+void Vault::update_file(const std::string &filename, std::istream &content) {
+  create_file(filename, content);
+}
 
-  if (!m_file.read(to_char_ptr(header.name_nonce.data()), 24)) {
-    return std::nullopt;
+void Vault::patch_file(const std::string &filename, u64 size,
+                       const ContentBlocks &blocks) {
+  std::lock_guard write_lock(m_write_mutex);
+  Metrics::Timer timer(Metric::EntryWrite, size);
+  auto it = find_entry(filename);
+  std::optional<FileHeader> old;
+  if (it != m_index.end()) {
+    old = it->second;
   }
+  u64 old_size = old ? old->content_size() : 0;
 
-  if (!m_file.read(to_char_ptr(&header.name_ciphertext_size), sizeof(u64))) {
-    return std::nullopt;
-  }
+  // what wasn't replaced is decrypted from the old entry as it's needed
+  u64 position = 0;
+  auto read_content = [&](u8 *buffer, u64 count) {
+    count = std::min(count, size - position);
+    for (u64 done = 0; done < count;) {
+      u64 index = position / CHUNK_SIZE;
+      u64 skip = position - index * CHUNK_SIZE;
+      u64 length = std::min(count - done, CHUNK_SIZE - skip);
+      u8 *out = buffer + done;
 
-  ASSERT(header.name_ciphertext_size < 10000);
+      u64 copied = 0;
+      auto block = blocks.find(index);
+      if (block != blocks.end()) {
+        if (block->second.size() > skip) {
+          copied = std::min(length, block->second.size() - skip);
+          std::memcpy(out, block->second.data() + skip, copied);
+        }
+      } else if (position < old_size) {
+        ASSERT(read_bytes(*old, position, std::min(length, old_size - position),
+                          [&](const u8 *data, u64 size) {
+                            std::memcpy(out + copied, data, size);
+                            copied += size;
+                          }));
+      }
+      std::memset(out + copied, 0, length - copied);
 
-  Botan::secure_vector<u8> name_ciphertext;
-  name_ciphertext.resize(header.name_ciphertext_size);
-  if (!m_file.read(to_char_ptr(name_ciphertext.data()),
-                   static_cast<i64>(header.name_ciphertext_size))) {
-    return std::nullopt;
-  }
+      done += length;
+      position += length;
+    }
+    return count;
+  };
 
-  auto name = Crypto::decrypt_xchacha20_poly1305(name_ciphertext, m_key,
-                                                 header.name_nonce);
-  header.name = std::string(name.begin(), name.end());
+  // no content size, the old entry is still being read while the new one is
+  // written and can't be overwritten in place
+  write_file(filename, std::nullopt, read_content);
+}
 
-  if (!m_file.read(to_char_ptr(header.content_nonce.data()), 24)) {
-    return std::nullopt;
+Vault::Batch::Batch(Vault &vault) : m_vault(vault) { m_vault.m_batches++; }
+
+Vault::Batch::~Batch() {
+  // not in the middle of somebody else's change
+  std::lock_guard write_lock(m_vault.m_write_mutex);
+  if (--m_vault.m_batches == 0) {
+    m_vault.commit();
   }
+}
 
-  if (!m_file.read(to_char_ptr(&header.content_ciphertext_size), sizeof(u64))) {
+std::optional<DirectoryListing>
+Vault::list_directory(const std::string &path) {
+  std::shared_lock lock(m_index_mutex);
+  Metrics::Timer timer(Metric::DirectoryListing);
+  auto id = find_directory(path);
+  if (!id) {
     return std::nullopt;
   }
-  return header;
+
+  DirectoryListing listing;
+  for (auto it = m_directory_ids.lower_bound({id.value(), ""});
+       it != m_directory_ids.end() && it->first.directory == id.value();
+       ++it) {
+    listing.directories.push_back(it->first.name);
+  }
+  for (auto it = m_index.lower_bound({id.value(), ""});
+       it != m_index.end() && it->first.directory == id.value(); ++it) {
+    listing.files.push_back(it->second);
+  }
+  return listing;
+}
+
+bool Vault::has_directory(const std::string &path) const {
+  std::shared_lock lock(m_index_mutex);
+  return find_directory(path).has_value();
+}
+
+bool Vault::create_directory(const std::string &path) {
+  std::lock_guard write_lock(m_write_mutex);
+  std::unique_lock lock(m_index_mutex);
+  if (!upgradable()) {
+    return false;
+  }
+
+  ASSERT(valid_path(path));
+  u64 end = m_data_end;
+  make_directories(split_path(path));
+  if (m_data_end != end) {
+    lock.unlock();
+    commit();
+  }
+  return true;
+}
+
+void Vault::delete_directory(const std::string &path) {
+  std::lock_guard write_lock(m_write_mutex);
+  std::unique_lock lock(m_index_mutex);
+  auto id = find_directory(path);
+  if (!id || id.value() == ROOT_DIRECTORY) {
+    return;
+  }
+
+  // children first, so a torn delete never orphans anything
+  std::vector<u64> directories = subtree(id.value());
+  for (auto directory = directories.rbegin(); directory != directories.rend();
+       ++directory) {
+    auto it = m_index.lower_bound({*directory, ""});
+    while (it != m_index.end() && it->first.directory == *directory) {
+      drop_entry(it->second);
+      m_index_changes.entries.insert(it->first);
+      it = m_index.erase(it);
+    }
+
+    const FileHeader &header = m_directories.at(*directory);
+    mark_deleted(header);
+    m_live_size -= header.total_size();
+    m_directory_ids.erase(header.key());
+    m_directories.erase(*directory);
+    m_index_changes.directories.insert(*directory);
+  }
+  lock.unlock();
+  commit();
+}
+
+bool Vault::rename(const std::string &from, const std::string &to) {
+  std::lock_guard write_lock(m_write_mutex);
+  std::unique_lock lock(m_index_mutex);
+  ASSERT(valid_path(to));
+  if (find_directory(to) || find_entry(to) != m_index.end()) {
+    return false;
+  }
+
+  std::vector<std::string> components = split_path(to);
+  std::string name = components.back();
+  components.pop_back();
+
+  auto id = find_directory(from);
+  if (id && id.value() != ROOT_DIRECTORY) {
+    // a directory can't go anywhere under itself
+    u64 parent = ROOT_DIRECTORY;
+    for (const auto &component : components) {
+      auto it = m_directory_ids.find({parent, component});
+      if (it == m_directory_ids.end()) {
+        break;
+      }
+      if (it->second == id.value()) {
+        return false;
+      }
+      parent = it->second;
+    }
+
+    // only its own record changes, everything in it refers to it by id
+    EntryKey key = {make_directories(components), name};
+    FileHeader old = m_directories.at(id.value());
+    FileHeader header = write_directory(id.value(), key, m_data_end);
+    m_data_end = header.offset + header.total_size();
+    m_live_size += header.total_size();
+    mark_deleted(old);
+    m_live_size -= old.total_size();
+
+    m_directory_ids.erase(old.key());
+    m_directory_ids[key] = id.value();
+    m_directories[id.value()] = header;
+    m_index_changes.directories.insert(id.value());
+    lock.unlock();
+    commit();
+    return true;
+  }
+
+  auto it = find_entry(from);
+  if (it == m_index.end()) {
+    return false;
+  }
+  FileHeader old = it->second;
+  EntryKey key = make_entry_key(to);
+
+  // only the index takes the new name, nothing is written but the change.
+  // shared chunks stay referenced, by the same entry.
+  if (upgradable()) {
+    // what's logged so far has entries the old way, the next index is a
+    // whole one
+    if (m_version < RENAME_VERSION) {
+      raise_version(RENAME_VERSION);
+      m_index_log.clear();
+    }
+    FileHeader header = old;
+    header.directory = key.directory;
+    header.name = key.name;
+    EntryKey stored = old.stored_key.value_or(old.key());
+    if (stored == key) {
+      header.stored_key.reset();
+    } else {
+      header.stored_key = stored;
+    }
+    m_index.erase(old.key());
+    m_index_changes.entries.insert(old.key());
+    m_index[key] = header;
+    m_index_changes.entries.insert(key);
+    lock.unlock();
+    commit();
+    return true;
+  }
+
+  // legacy indexes have no room for another name. a new header goes in
+  // front of a copy of the same ciphertext, which only depends on the
+  // content nonce.
+  Botan::secure_vector<u8> bytes;
+  FileHeader header =
+      encode_entry_header(key, static_cast<u8>(old.flags & ~ENTRY_NESTED),
+                          old.content_ciphertext_size, bytes);
+  header.content_nonce = old.content_nonce;
+  std::memcpy(bytes.data() + bytes.size() - sizeof(u64) - 24,
+              old.content_nonce.data(), 24);
+  header.plaintext_size = old.plaintext_size;
+  header.offset = m_data_end;
+  m_file->write(header.offset, bytes.data(), bytes.size());
+  move_bytes(old.content_offset(), header.content_offset(),
+             old.content_ciphertext_size);
+
+  mark_deleted(old);
+  m_live_size -= old.total_size();
+  m_index.erase(old.key());
+  m_index_changes.entries.insert(old.key());
+  append_entry(header);
+  lock.unlock();
+  commit();
+  return true;
+}
+
+std::string Vault::entry_path(const FileHeader &header) const {
+  std::shared_lock lock(m_index_mutex);
+  return path_of(header.directory, header.name);
+}
+
+bool Vault::valid_path(const std::string &path) {
+  auto components = split_path(path);
+  return !components.empty() &&
+         std::none_of(components.begin(), components.end(),
+                      [](const auto &component) { return component == ".."; });
+}
+
+void Vault::set_threads(u32 threads) {
+  std::lock_guard write_lock(m_write_mutex);
+  std::unique_lock lock(m_index_mutex);
+  if (threads == 0) {
+    threads = std::max<u32>(std::thread::hardware_concurrency(), 1);
+  }
+  m_pool = std::make_unique<ThreadPool>(threads);
+}
+
+void Vault::set_deduplication(bool enabled) {
+  std::lock_guard write_lock(m_write_mutex);
+  m_deduplication = enabled;
+  // legacy headers have no room for it, it's written by rekey instead.
+  // turning it off needs no newer build.
+  if (enabled && upgradable()) {
+    m_version = std::max(m_version, DEDUP_VERSION);
+  }
+  if (m_version >= DEDUP_VERSION) {
+    write_header();
+  }
+}
+
+u64 Vault::free_space() const {
+  std::shared_lock lock(m_index_mutex);
+  // what compaction gave back at the ends of packs isn't there anymore
+  return m_data_end - m_data_offset - m_live_size - m_file->discarded();
+}
+
+CompactionProgress Vault::compact_step(u64 max_bytes) {
+  // live entries get moved, so no reads while a step runs
+  std::lock_guard write_lock(m_write_mutex);
+  std::unique_lock lock(m_index_mutex);
+  // what a batch has deleted is still in use until it's committed, and so
+  // is an index log in the data area, which moves would go over
+  if (!m_index_log.empty() || !m_index_changes.empty()) {
+    write_index();
+    m_index_log.clear();
+  }
+  m_file->sync();
+
+  // named entries and shared chunks move the same way, only where their
+  // offset is kept differs
+  struct Live {
+    u64 *offset;
+    u64 size;
+  };
+  std::vector<Live> entries;
+  for (auto &[name, header] : m_index) {
+    if (header.offset >= m_compact_cursor) {
+      entries.push_back({&header.offset, header.total_size()});
+    }
+  }
+  for (auto &[id, chunk] : m_chunks) {
+    if (chunk.offset >= m_compact_cursor) {
+      entries.push_back({&chunk.offset, chunk.size});
+    }
+  }
+  for (auto &[id, header] : m_directories) {
+    if (header.offset >= m_compact_cursor) {
+      entries.push_back({&header.offset, header.total_size()});
+    }
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Live &a, const Live &b) { return *a.offset < *b.offset; });
+
+  // gaps that are left get a filler, the packs they run past the end of
+  // are cut short once the step is committed
+  std::vector<std::pair<u64, u64>> released;
+  auto release = [&](u64 offset, u64 size) {
+    write_filler(offset, size);
+    if (segment_start(offset) != segment_start(offset + size)) {
+      released.emplace_back(offset + FILLER_MIN_SIZE,
+                            size - FILLER_MIN_SIZE);
+    }
+  };
+
+  // moves into space the committed index doesn't use, from the cursor to
+  // where the first moved entry was, go straight to the file
+  u64 write = m_compact_cursor;
+  u64 committed_from = UINT64_MAX;
+  u64 moved = 0;
+  u64 i = 0;
+  for (; i < entries.size() && moved < max_bytes; i++) {
+    Live &entry = entries[i];
+    // nothing moves into an earlier pack, so the ones in front stay as
+    // they are
+    u64 target = std::max(write, segment_start(*entry.offset));
+    if (target > write) {
+      target = std::max(target, write + FILLER_MIN_SIZE);
+      release(write, target - write);
+      write = target;
+    }
+    if (*entry.offset != write) {
+      bool unused =
+          write + entry.size <= std::min(committed_from, *entry.offset);
+      if (!unused && entry.size > MAX_JOURNALED_OVERWRITE) {
+        // too big to be journaled, its gap stays until it gets deleted
+        release(write, *entry.offset - write);
+        write = *entry.offset + entry.size;
+        continue;
+      }
+      move_bytes(*entry.offset, write, entry.size, unused);
+      committed_from = std::min(committed_from, *entry.offset);
+      *entry.offset = write;
+      moved += entry.size;
+    }
+    write += entry.size;
+  }
+
+  // nothing committed uses the released bytes anymore once it's synced
+  auto discard_released = [&] {
+    u64 before = m_file->discarded();
+    for (const auto &[offset, size] : released) {
+      m_file->discard(offset, size);
+    }
+    m_compact_discarded += m_file->discarded() - before;
+  };
+
+  CompactionProgress progress{};
+  progress.total = m_data_end - m_data_offset;
+
+  if (i == entries.size()) {
+    progress.processed = progress.total;
+    progress.reclaimed = m_data_end - write;
+    progress.done = true;
+
+    m_data_end = write;
+    m_compact_cursor = m_data_offset;
+    write_index();
+    // the next step writes over what this one freed, it can't wait for
+    // a batch
+    m_file->sync();
+    discard_released();
+    progress.reclaimed += m_compact_discarded;
+    m_compact_discarded = 0;
+    return progress;
+  }
+
+  // keep the file walkable until the next step closes the gap
+  u64 gap_end = *entries[i].offset;
+  if (gap_end > write) {
+    release(write, gap_end - write);
+  }
+  if (moved > 0) {
+    write_index();
+  }
+  m_file->sync();
+  discard_released();
+
+  m_compact_cursor = write;
+  progress.processed = write - m_data_offset;
+  progress.reclaimed = gap_end - write + m_compact_discarded;
+  progress.done = false;
+  return progress;
+}
+
+u64 Vault::compact(const std::atomic<bool> *cancel) {
+  while (cancel == nullptr || !cancel->load()) {
+    auto progress = compact_step();
+    if (progress.done) {
+      return progress.reclaimed;
+    }
+  }
+  return 0;
+}
+
+void Vault::rekey(const std::string &password,
+                  std::optional<Crypto::KdfParams> kdf) {
+  std::lock_guard write_lock(m_write_mutex);
+  std::unique_lock lock(m_index_mutex);
+
+  // everything is re-encrypted into a new vault next to this one, which
+  // then takes its place
+  std::string temp_path = m_path + ".rekey";
+  auto target =
+      Vault::create(temp_path, password, kdf, m_backend, m_segments.size);
+  target->set_compression(m_compression);
+  target->set_deduplication(m_deduplication);
+
+  std::vector<const FileHeader *> entries;
+  entries.reserve(m_index.size());
+  for (const auto &[name, header] : m_index) {
+    entries.push_back(&header);
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const auto *a, const auto *b) { return a->offset < b->offset; });
+
+  try {
+    // empty directories too
+    for (const auto &[id, header] : m_directories) {
+      target->make_directories(
+          split_path(path_of(header.directory, header.name)));
+    }
+
+    u64 step = BATCH_CHUNKS_PER_THREAD * m_pool->threads() * CHUNK_SIZE;
+    PendingChunks target_chunks;
+    for (const FileHeader *header : entries) {
+      u64 size = header->content_size();
+      // entries from before chunking are decrypted in one go
+      bool whole = (header->flags & (ENTRY_CHUNKED | ENTRY_DEDUPLICATED)) == 0;
+      u64 batch = whole ? size : step;
+
+      // decrypt a batch of content whenever the previous one has been used up
+      Botan::secure_vector<u8> pending;
+      u64 pending_position = 0;
+      u64 next = 0;
+      auto append = [&](const u8 *data, u64 count) {
+        put_bytes(pending, data, count);
+      };
+      // names from before directories get split up here, unless they clash
+      // with a directory or a file
+      std::string path = path_of(header->directory, header->name);
+      EntryKey key = {ROOT_DIRECTORY, path};
+      if (valid_path(path)) {
+        try {
+          key = target->make_entry_key(path);
+        } catch (const std::runtime_error &) {
+        }
+      }
+      FileHeader written = target->write_new_entry(
+          key, target->m_data_end,
+          [&](u8 *out, u64 count) {
+            if (pending_position == pending.size() && next < size) {
+              pending.clear();
+              pending_position = 0;
+              u64 length = std::min(batch, size - next);
+              ASSERT(read_bytes(*header, next, length, append, false));
+              next += length;
+            }
+
+            count = std::min(count, pending.size() - pending_position);
+            if (count > 0) {
+              std::memcpy(out, pending.data() + pending_position, count);
+            }
+            pending_position += count;
+            return count;
+          },
+          target_chunks);
+
+      target->m_data_end = written.offset + written.total_size();
+      target->m_live_size += written.total_size();
+      target->m_index[written.key()] = written;
+    }
+    target->publish_chunks(target_chunks);
+    target->write_index();
+    target->commit();
+  } catch (...) {
+    target.reset();
+    std::filesystem::remove(temp_path);
+    std::filesystem::remove(temp_path + JOURNAL_SUFFIX);
+    remove_segments(temp_path, 1);
+    throw;
+  }
+
+  // the new packs are numbered past the old ones, with a gap in between.
+  // until the new header is in place the old vault ends at the gap, after
+  // that the new one drops whatever is in front of it.
+  u64 old_first = m_segments.first;
+  u64 new_first = old_first;
+  if (m_segments.size > 0) {
+    while (std::filesystem::exists(segment_path(m_path, new_first))) {
+      new_first++;
+    }
+    new_first++;
+    target->m_segments.first = new_first;
+    target->write_header();
+  }
+
+  // both journals are empty once their files are closed, this one's stays
+  Botan::secure_vector<u8> key = target->m_key;
+  target.reset();
+  m_file.reset();
+  std::filesystem::remove(temp_path + JOURNAL_SUFFIX);
+  if (m_segments.size > 0) {
+    remove_segments(m_path, new_first);
+    for (u64 number = 1;
+         std::filesystem::exists(segment_path(temp_path, number)); number++) {
+      std::filesystem::rename(segment_path(temp_path, number),
+                              segment_path(m_path, new_first + number - 1));
+    }
+  }
+  std::filesystem::rename(temp_path, m_path);
+  if (m_segments.size > 0) {
+    remove_segments(m_path, old_first);
+  }
+
+  set_key(std::move(key));
+  read_header();
+  open_index();
+}
+
+void Vault::change_password(const std::string &password,
+                            std::optional<Crypto::KdfParams> kdf) {
+  if (m_version < KEY_SLOT_VERSION) {
+    rekey(password, kdf);
+    return;
+  }
+
+  // calibrating takes about as long as unlocking, writers needn't wait
+  if (!kdf) {
+    kdf = Crypto::calibrate_argon2id(KDF_TARGET_TIME);
+  }
+
+  std::lock_guard write_lock(m_write_mutex);
+  auto it = std::find_if(m_slots.begin(), m_slots.end(), [](const auto &slot) {
+    return slot.kind == KEY_SLOT_PASSWORD;
+  });
+  ASSERT(it != m_slots.end());
+  *it = make_key_slot(KEY_SLOT_PASSWORD, password, kdf.value(), m_key);
+  m_kdf = kdf.value();
+  write_header();
+}
+
+std::optional<std::string> Vault::add_recovery_key() {
+  std::lock_guard write_lock(m_write_mutex);
+  auto it = std::find_if(m_slots.begin(), m_slots.end(), [](const auto &slot) {
+    return slot.kind == KEY_SLOT_EMPTY;
+  });
+  if (m_version < KEY_SLOT_VERSION || it == m_slots.end()) {
+    return std::nullopt;
+  }
+
+  // 256 random bits as dash separated groups of hex digits
+  thread_local Botan::AutoSeeded_RNG rng;
+  auto bytes = rng.random_array<32>();
+  std::string recovery_key;
+  for (u64 i = 0; i < bytes.size(); i++) {
+    if (i > 0 && i % 4 == 0) {
+      recovery_key += '-';
+    }
+    recovery_key += "0123456789abcdef"[bytes[i] >> 4];
+    recovery_key += "0123456789abcdef"[bytes[i] & 0xf];
+  }
+
+  *it = make_key_slot(KEY_SLOT_RECOVERY, recovery_key, RECOVERY_KDF_PARAMS,
+                      m_key);
+  write_header();
+  return recovery_key;
+}
+
+void Vault::remove_recovery_keys() {
+  std::lock_guard write_lock(m_write_mutex);
+  for (auto &slot : m_slots) {
+    if (slot.kind == KEY_SLOT_RECOVERY) {
+      slot = KeySlot{};
+    }
+  }
+  if (m_version >= KEY_SLOT_VERSION) {
+    write_header();
+  }
+}
+
+void Vault::set_key(Botan::secure_vector<u8> key) {
+  m_key = std::move(key);
+  m_ciphers = std::make_unique<Crypto::CipherPool>(m_key);
+  m_chunk_id_key = Crypto::derive_subkey(m_key, "dull chunk ids");
+
+  // 4 gear values out of every hash
+  auto gear_key = Crypto::derive_subkey(m_key, "dull chunk boundaries");
+  std::array<u64, 256> gear{};
+  for (u8 i = 0; i < gear.size() / 4; i++) {
+    auto hash = Crypto::hmac_sha256(gear_key, &i, 1);
+    std::memcpy(gear.data() + i * 4, hash.data(), hash.size());
+  }
+  m_chunker = std::make_unique<Chunker>(gear);
+
+  // what's cached was decrypted with the old key, under nonces and ids
+  // nothing uses anymore
+  m_cache.clear();
+}
+
+VaultHeader Vault::read_header() {
+  // replays or drops what a crash left in the journal
+  m_segments = read_segments(m_path);
+  m_file = std::make_unique<JournaledFile>(m_path, m_backend, m_segments);
+
+  std::array<u8, 4 + sizeof(i16)> magic{};
+  ASSERT(m_file->read(0, magic.data(), magic.size()));
+  ASSERT(std::memcmp(magic.data(), "DULL", 4) == 0);
+
+  std::memcpy(&m_version, magic.data() + 4, sizeof(m_version));
+  ASSERT(m_version >= 1 && m_version <= VERSION);
+  m_data_offset = m_version < KDF_VERSION ? LEGACY_HEADER_SIZE : HEADER_SIZE;
+  m_compact_cursor = m_data_offset;
+  m_compact_discarded = 0;
+
+  Botan::secure_vector<u8> bytes(m_data_offset - magic.size());
+  ASSERT(m_file->read(magic.size(), bytes.data(), bytes.size()));
+  BufferReader reader(bytes);
+
+  VaultHeader header{};
+  m_slots = {};
+  m_deduplication = false;
+  if (m_version >= DEDUP_VERSION) {
+    m_deduplication = (reader.get<u8>() & VAULT_DEDUPLICATED) != 0;
+  }
+  if (m_version >= KEY_SLOT_VERSION) {
+    for (u64 i = 0; i < MAX_KEY_SLOTS; i++) {
+      u64 start = KEY_SLOTS_OFFSET + i * KEY_SLOT_SIZE - magic.size();
+      reader.skip_to(start);
+
+      KeySlot &slot = m_slots[i];
+      slot.kind = reader.get<u8>();
+      if (slot.kind == KEY_SLOT_EMPTY) {
+        continue;
+      }
+      ASSERT(reader.get<u8>() == KDF_ARGON2ID);
+      slot.kdf.memory_kib = reader.get<u64>();
+      slot.kdf.iterations = reader.get<u32>();
+      slot.kdf.parallelism = reader.get<u32>();
+      reader.get_bytes(slot.salt.data(), slot.salt.size());
+      reader.get_bytes(slot.nonce.data(), slot.nonce.size());
+      reader.get_bytes(slot.wrapped_key.data(), slot.wrapped_key.size());
+      if (slot.kind == KEY_SLOT_PASSWORD) {
+        m_kdf = slot.kdf;
+      }
+    }
+    return header;
+  }
+
+  // older vaults all used the same parameters
+  header.kdf = Crypto::DEFAULT_KDF_PARAMS;
+  if (m_version >= KDF_VERSION) {
+    ASSERT(reader.get<u8>() == KDF_ARGON2ID);
+    header.kdf.memory_kib = reader.get<u64>();
+    header.kdf.iterations = reader.get<u32>();
+    header.kdf.parallelism = reader.get<u32>();
+  }
+  m_kdf = header.kdf;
+
+  reader.get_bytes(header.salt.data(), header.salt.size());
+  reader.get_bytes(header.check_nonce.data(), header.check_nonce.size());
+  header.check_ciphertext.resize(22);
+  reader.get_bytes(header.check_ciphertext.data(), 22);
+  return header;
+}
+
+void Vault::write_header() {
+  u8 options = m_deduplication ? VAULT_DEDUPLICATED : 0;
+  if (m_segments.size > 0) {
+    options |= VAULT_SEGMENTED;
+  }
+  auto header = encode_header(m_version, m_slots, options, m_segments);
+  m_file->write(0, header.data(), header.size());
+  // the sync takes what a batch has written so far along, its index too
+  flush_index();
+  m_file->sync();
+}
+
+void Vault::check_key(const VaultHeader &header) {
+  Botan::secure_vector<u8> check_ciphertext = header.check_ciphertext;
+  m_ciphers->acquire()->decrypt(check_ciphertext, header.check_nonce);
+}
+
+Botan::secure_vector<u8> Vault::unlock(const std::string &secret) {
+  for (const auto &slot : m_slots) {
+    if (slot.kind == KEY_SLOT_EMPTY) {
+      continue;
+    }
+    if (auto key = unwrap_key_slot(slot, secret)) {
+      return key.value();
+    }
+  }
+  throw Botan::Invalid_Authentication_Tag("no key slot matches");
+}
+
+void Vault::upgrade_key_slots(const std::string &password) {
+  // the existing key becomes the master key, so no data has to change
+  m_slots = {};
+  m_slots[0] = make_key_slot(KEY_SLOT_PASSWORD, password, m_kdf, m_key);
+  m_version = KEY_SLOT_VERSION;
+  write_header();
+}
+
+void Vault::open_index() {
+  Metrics::Timer timer(Metric::IndexLoad);
+  m_index_changes = {};
+  // version 1 vaults have no index, build one and upgrade them in place
+  if (m_version < INDEX_VERSION || !load_index()) {
+    rebuild_index();
+    write_index();
+
+    if (m_version < INDEX_VERSION) {
+      m_version = INDEX_VERSION;
+      m_file->write(4, reinterpret_cast<const u8 *>(&m_version),
+                    sizeof(m_version));
+    }
+    commit();
+  }
+}
+
+std::optional<FileHeader> Vault::read_file_header(u64 offset) {
+  Metrics::Timer timer(Metric::EntryHeader);
+  FileHeader header{};
+  header.offset = offset;
+
+  Botan::secure_vector<u8> buffer;
+  const u8 *data = fetch(*m_file, offset, 24 + sizeof(u64), buffer);
+  if (data == nullptr) {
+    return std::nullopt;
+  }
+  std::memcpy(header.name_nonce.data(), data, 24);
+  std::memcpy(&header.name_ciphertext_size, data + 24, sizeof(u64));
+
+  ASSERT(header.name_ciphertext_size < MAX_NAME_CIPHERTEXT_SIZE);
+
+  // the name ciphertext, the content nonce and the size in one go
+  offset += 24 + sizeof(u64);
+  data = fetch(*m_file, offset, header.name_ciphertext_size + 24 + sizeof(u64),
+               buffer);
+  if (data == nullptr) {
+    return std::nullopt;
+  }
+  const u8 *name_ciphertext = data;
+  data += header.name_ciphertext_size;
+  std::memcpy(header.content_nonce.data(), data, 24);
+  std::memcpy(&header.content_ciphertext_size, data + 24, sizeof(u64));
+  header.flags = static_cast<u8>(header.content_ciphertext_size >> 56);
+  header.content_ciphertext_size &= CONTENT_SIZE_MASK;
+
+  if (header.content_offset() + header.content_ciphertext_size >
+      m_file->size()) {
+    return std::nullopt;
+  }
+
+  // dead entries are only ever skipped over
+  if ((header.flags & ENTRY_DELETED) != 0) {
+    return header;
+  }
+
+  Botan::secure_vector<u8> name;
+  m_ciphers->acquire()->decrypt(name_ciphertext, header.name_ciphertext_size,
+                                header.name_nonce, name);
+  auto start = name.begin();
+  if ((header.flags & ENTRY_NESTED) != 0) {
+    ASSERT(name.size() >= sizeof(u64));
+    std::memcpy(&header.directory, name.data(), sizeof(u64));
+    start += sizeof(u64);
+  }
+  header.name = std::string(start, name.end());
+  return header;
+}
+
+bool Vault::load_index() {
+  u64 file_size = m_file->size();
+  if (file_size < m_data_offset + INDEX_TRAILER_SIZE) {
+    return false;
+  }
+
+  std::array<u8, INDEX_TRAILER_SIZE> trailer{};
+  ASSERT(m_file->read(file_size - INDEX_TRAILER_SIZE, trailer.data(),
+                      trailer.size()));
+  u64 index_offset = 0;
+  std::memcpy(&index_offset, trailer.data(), sizeof(u64));
+  if (std::memcmp(trailer.data() + sizeof(u64), INDEX_MAGIC.data(),
+                  INDEX_MAGIC.size()) != 0 ||
+      index_offset < m_data_offset || index_offset >= file_size) {
+    return false;
+  }
+
+  auto index_header = read_file_header(index_offset);
+  if (!index_header || (index_header->flags & ENTRY_INDEX) == 0 ||
+      index_header->content_offset() + index_header->content_ciphertext_size +
+              INDEX_TRAILER_SIZE !=
+          file_size) {
+    return false;
+  }
+
+  // from INDEX_LOG_VERSION on every index starts with the offset of the one
+  // before it, which it only has the changes to. 0 ends the log at a whole
+  // index.
+  std::vector<FileHeader> log = {index_header.value()};
+  std::vector<Botan::secure_vector<u8>> plaintexts;
+  while (true) {
+    const FileHeader &header = log.back();
+    Botan::secure_vector<u8> &plaintext =
+        plaintexts.emplace_back(header.content_ciphertext_size);
+    ASSERT(m_file->read(header.content_offset(), plaintext.data(),
+                        plaintext.size()));
+    m_ciphers->acquire()->decrypt(plaintext, header.content_nonce);
+
+    u64 previous = 0;
+    if (m_version >= INDEX_LOG_VERSION) {
+      ASSERT(plaintext.size() >= sizeof(u64));
+      std::memcpy(&previous, plaintext.data(), sizeof(u64));
+    }
+    if (previous == 0) {
+      break;
+    }
+    if (previous < m_data_offset || previous >= header.offset) {
+      return false;
+    }
+    auto older = read_file_header(previous);
+    if (!older || (older->flags & ENTRY_INDEX) == 0 ||
+        older->offset + older->total_size() > header.offset) {
+      return false;
+    }
+    log.push_back(older.value());
+  }
+
+  read_whole_index(plaintexts.back());
+  for (u64 i = log.size() - 1; i-- > 0;) {
+    read_index_changes(plaintexts[i]);
+  }
+
+  m_live_size = 0;
+  m_next_directory_id = ROOT_DIRECTORY + 1;
+  for (const auto &[key, header] : m_index) {
+    m_live_size += header.total_size();
+  }
+  for (const auto &[id, chunk] : m_chunks) {
+    m_live_size += chunk.size;
+  }
+  for (const auto &[id, header] : m_directories) {
+    m_next_directory_id = std::max(m_next_directory_id, id + 1);
+    m_live_size += header.total_size();
+  }
+
+  // a whole index at the end gets written over by the next change, a log
+  // stays in the data area until a whole index takes its place
+  m_index_log.clear();
+  m_index_base_size = 0;
+  m_index_log_size = 0;
+  if (log.size() == 1) {
+    m_data_end = index_offset;
+    return true;
+  }
+  for (auto it = log.rbegin(); it != log.rend(); ++it) {
+    m_index_log.push_back(it->offset);
+    m_index_log_size += it->total_size();
+  }
+  m_index_base_size = log.back().total_size();
+  m_index_log_size -= m_index_base_size;
+  m_data_end = index_offset + index_header->total_size();
+  return true;
+}
+
+void Vault::read_whole_index(const Botan::secure_vector<u8> &plaintext) {
+  BufferReader reader(plaintext);
+  if (m_version >= INDEX_LOG_VERSION) {
+    reader.get<u64>();
+  }
+
+  u64 count = reader.get<u64>();
+  m_index.clear();
+  for (u64 i = 0; i < count; i++) {
+    FileHeader header =
+        get_index_entry(reader, m_version >= RENAME_VERSION);
+    m_index[header.key()] = header;
+  }
+
+  // indexes from before deduplication end here
+  m_chunks.clear();
+  if (!reader.at_end()) {
+    u64 chunks = reader.get<u64>();
+    for (u64 i = 0; i < chunks; i++) {
+      ChunkId id{};
+      reader.get_bytes(id.data(), id.size());
+      m_chunks[id] = get_index_chunk(reader);
+    }
+  }
+
+  // and indexes from before directories end here
+  m_directories.clear();
+  m_directory_ids.clear();
+  if (!reader.at_end()) {
+    u64 directories = reader.get<u64>();
+    for (u64 i = 0; i < directories; i++) {
+      u64 id = reader.get<u64>();
+      FileHeader header = get_index_directory(reader);
+      m_directory_ids[header.key()] = id;
+      m_directories[id] = header;
+    }
+  }
+}
+
+void Vault::read_index_changes(const Botan::secure_vector<u8> &plaintext) {
+  BufferReader reader(plaintext);
+  reader.get<u64>();
+
+  // each key is followed by whether it's still there and then by what it is
+  u64 count = reader.get<u64>();
+  for (u64 i = 0; i < count; i++) {
+    EntryKey key{};
+    key.directory = reader.get<u64>();
+    key.name.resize(reader.get<u64>());
+    reader.get_bytes(reinterpret_cast<u8 *>(key.name.data()),
+                     key.name.size());
+    m_index.erase(key);
+    if (reader.get<u8>() != 0) {
+      FileHeader header =
+          get_index_entry(reader, m_version >= RENAME_VERSION);
+      m_index[header.key()] = header;
+    }
+  }
+
+  u64 chunks = reader.get<u64>();
+  for (u64 i = 0; i < chunks; i++) {
+    ChunkId id{};
+    reader.get_bytes(id.data(), id.size());
+    m_chunks.erase(id);
+    if (reader.get<u8>() != 0) {
+      m_chunks[id] = get_index_chunk(reader);
+    }
+  }
+
+  u64 directories = reader.get<u64>();
+  for (u64 i = 0; i < directories; i++) {
+    u64 id = reader.get<u64>();
+    auto old = m_directories.find(id);
+    if (old != m_directories.end()) {
+      m_directory_ids.erase(old->second.key());
+      m_directories.erase(old);
+    }
+    if (reader.get<u8>() != 0) {
+      FileHeader header = get_index_directory(reader);
+      m_directory_ids[header.key()] = id;
+      m_directories[id] = header;
+    }
+  }
+}
+
+void Vault::rebuild_index() {
+  m_index.clear();
+  m_chunks.clear();
+  m_directories.clear();
+  m_directory_ids.clear();
+  m_next_directory_id = ROOT_DIRECTORY + 1;
+  m_live_size = 0;
+  m_data_end = m_data_offset;
+  m_index_log.clear();
+  m_index_base_size = 0;
+  m_index_log_size = 0;
+
+  while (true) {
+    auto header = read_file_header(m_data_end);
+    if (!header) {
+      break;
+    }
+    // before index logs the only index is the one at the end
+    if ((header->flags & ENTRY_INDEX) != 0) {
+      if (m_version < INDEX_LOG_VERSION) {
+        break;
+      }
+      m_data_end = header->offset + header->total_size();
+      continue;
+    }
+    bool live = (header->flags & ENTRY_DELETED) == 0;
+
+    // only the chunk table knows the size of compressed content
+    if (live && (header->flags & ENTRY_COMPRESSED) != 0) {
+      auto table = read_chunk_table(header.value());
+      if (!table) {
+        break;
+      }
+      header->plaintext_size = table->content_size;
+    }
+
+    // deduplicated entries always come after the chunks they use
+    if (live && (header->flags & ENTRY_DEDUPLICATED) != 0) {
+      auto references = read_references(header.value());
+      if (!references ||
+          !std::all_of(references->begin(), references->end(),
+                       [&](const auto &reference) {
+                         return m_chunks.contains(reference.id);
+                       })) {
+        break;
+      }
+      header->plaintext_size = 0;
+      for (const auto &reference : references.value()) {
+        header->plaintext_size += reference.size;
+        m_chunks[reference.id].references++;
+      }
+    }
+
+    u64 directory_id = ROOT_DIRECTORY;
+    if (live && (header->flags & ENTRY_DIRECTORY) != 0) {
+      Botan::secure_vector<u8> content;
+      if (!read_content(header.value(), [&](const u8 *data, u64 size) {
+            put_bytes(content, data, size);
+          }) ||
+          content.size() != sizeof(u64)) {
+        break;
+      }
+      std::memcpy(&directory_id, content.data(), sizeof(u64));
+    }
+
+    m_data_end = header->offset + header->total_size();
+    if (!live) {
+      continue;
+    }
+    if ((header->flags & ENTRY_SHARED_CHUNK) != 0) {
+      ChunkId id{};
+      ASSERT(header->name.size() == id.size());
+      std::memcpy(id.data(), header->name.data(), id.size());
+      m_chunks[id] = {header->offset, header->total_size(), 0};
+    } else if ((header->flags & ENTRY_DIRECTORY) != 0) {
+      // a directory that was moved, the newer record wins
+      auto old = m_directories.find(directory_id);
+      if (old != m_directories.end()) {
+        m_directory_ids.erase(old->second.key());
+        m_live_size -= old->second.total_size();
+      }
+      m_directories[directory_id] = header.value();
+      m_directory_ids[header->key()] = directory_id;
+      m_next_directory_id = std::max(m_next_directory_id, directory_id + 1);
+    } else {
+      m_index[header->key()] = header.value();
+    }
+    m_live_size += header->total_size();
+  }
+
+  // whatever lost its directory to a torn write ends up in the root
+  for (auto &[id, header] : m_directories) {
+    if (header.directory != ROOT_DIRECTORY &&
+        !m_directories.contains(header.directory)) {
+      m_directory_ids.erase(header.key());
+      header.directory = ROOT_DIRECTORY;
+      m_directory_ids[header.key()] = id;
+    }
+  }
+  for (auto it = m_index.begin(); it != m_index.end();) {
+    if (it->first.directory != ROOT_DIRECTORY &&
+        !m_directories.contains(it->first.directory)) {
+      FileHeader header = it->second;
+      it = m_index.erase(it);
+      header.directory = ROOT_DIRECTORY;
+      m_index[header.key()] = header;
+    } else {
+      ++it;
+    }
+  }
+
+  // left behind by writes that never got committed
+  for (auto it = m_chunks.begin(); it != m_chunks.end();) {
+    if (it->second.references == 0) {
+      m_live_size -= it->second.size;
+      it = m_chunks.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+FileHeader Vault::write_index() {
+  // the version is only raised once the vault holds something older builds
+  // don't know, so merely opening it doesn't lock them out
+  i16 version = m_version;
+  if (!m_chunks.empty()) {
+    version = std::max(version, DEDUP_VERSION);
+  }
+  if (!m_directories.empty()) {
+    version = std::max(version, DIRECTORY_VERSION);
+  }
+
+  // a whole index has nothing before it
+  Botan::secure_vector<u8> plaintext;
+  put(plaintext, static_cast<u64>(0));
+  put(plaintext, static_cast<u64>(m_index.size()));
+  for (const auto &[key, header] : m_index) {
+    if ((header.flags & ENTRY_DEDUPLICATED) != 0) {
+      version = std::max(version, DEDUP_VERSION);
+    } else if ((header.flags & ENTRY_COMPRESSED) != 0) {
+      version = std::max(version, COMPRESSION_VERSION);
+    }
+    put_index_entry(plaintext, header, m_version >= RENAME_VERSION);
+  }
+  put(plaintext, static_cast<u64>(m_chunks.size()));
+  for (const auto &[id, chunk] : m_chunks) {
+    put_bytes(plaintext, id.data(), id.size());
+    put_index_chunk(plaintext, chunk);
+  }
+  put(plaintext, static_cast<u64>(m_directories.size()));
+  for (const auto &[id, header] : m_directories) {
+    put(plaintext, id);
+    put_index_directory(plaintext, header);
+  }
+  raise_version(version);
+
+  m_index_changes = {};
+  return write_index_record(plaintext);
+}
+
+void Vault::flush_index() {
+  if (m_index_changes.empty()) {
+    return;
+  }
+  if (!upgradable()) {
+    write_index();
+    return;
+  }
+  raise_version(INDEX_LOG_VERSION);
+
+  // the changes pile up behind a whole index until they're as big as it,
+  // then another whole one starts over. loading never reads more than
+  // twice the index, and each change costs about twice its own size.
+  if (m_index_log.empty() || m_index_log_size > m_index_base_size) {
+    FileHeader header = write_index();
+    std::unique_lock lock(m_index_mutex);
+    m_index_log = {header.offset};
+    m_index_base_size = header.total_size();
+    m_index_log_size = 0;
+    m_data_end += header.total_size();
+    return;
+  }
+
+  // each key with whether it's still there and if so what it is now
+  Botan::secure_vector<u8> plaintext;
+  put(plaintext, m_index_log.back());
+  put(plaintext, static_cast<u64>(m_index_changes.entries.size()));
+  for (const auto &key : m_index_changes.entries) {
+    put(plaintext, key.directory);
+    put(plaintext, static_cast<u64>(key.name.size()));
+    put_bytes(plaintext, reinterpret_cast<const u8 *>(key.name.data()),
+              key.name.size());
+    auto it = m_index.find(key);
+    put(plaintext, static_cast<u8>(it != m_index.end()));
+    if (it != m_index.end()) {
+      put_index_entry(plaintext, it->second, m_version >= RENAME_VERSION);
+    }
+  }
+  put(plaintext, static_cast<u64>(m_index_changes.chunks.size()));
+  for (const auto &id : m_index_changes.chunks) {
+    put_bytes(plaintext, id.data(), id.size());
+    auto it = m_chunks.find(id);
+    put(plaintext, static_cast<u8>(it != m_chunks.end()));
+    if (it != m_chunks.end()) {
+      put_index_chunk(plaintext, it->second);
+    }
+  }
+  put(plaintext, static_cast<u64>(m_index_changes.directories.size()));
+  for (u64 id : m_index_changes.directories) {
+    put(plaintext, id);
+    auto it = m_directories.find(id);
+    put(plaintext, static_cast<u8>(it != m_directories.end()));
+    if (it != m_directories.end()) {
+      put_index_directory(plaintext, it->second);
+    }
+  }
+
+  m_index_changes = {};
+  FileHeader header = write_index_record(plaintext);
+  std::unique_lock lock(m_index_mutex);
+  m_index_log.push_back(header.offset);
+  m_index_log_size += header.total_size();
+  m_data_end += header.total_size();
+}
+
+FileHeader
+Vault::write_index_record(const Botan::secure_vector<u8> &plaintext) {
+  u64 skip = m_version < INDEX_LOG_VERSION ? sizeof(u64) : 0;
+
+  // the entry and the trailer go out in a single write
+  Botan::secure_vector<u8> bytes;
+  FileHeader header =
+      encode_entry_header({ROOT_DIRECTORY, ""}, ENTRY_INDEX,
+                          plaintext.size() - skip + TAG_SIZE, bytes);
+  m_ciphers->acquire()->encrypt(plaintext.data() + skip,
+                                plaintext.size() - skip,
+                                header.content_nonce, bytes);
+  put(bytes, m_data_end);
+  put_bytes(bytes, reinterpret_cast<const u8 *>(INDEX_MAGIC.data()),
+            INDEX_MAGIC.size());
+  m_file->write(m_data_end, bytes.data(), bytes.size());
+
+  u64 new_size = m_data_end + bytes.size();
+  if (m_file->size() > new_size) {
+    m_file->resize(new_size);
+  }
+  header.offset = m_data_end;
+  return header;
+}
+
+void Vault::raise_version(i16 version) {
+  if (version > m_version) {
+    ASSERT(upgradable());
+    m_version = version;
+    m_file->write(4, reinterpret_cast<const u8 *>(&m_version),
+                  sizeof(m_version));
+  }
+}
+
+bool Vault::read_chunks(const FileHeader &header, u64 first, u64 last,
+                        const ContentSink &sink, bool use_cache) {
+  auto table = read_chunk_table(header);
+  if (!table) {
+    return false;
+  }
+  const auto &offsets = table->offsets;
+  ASSERT(first <= last && last < offsets.size());
+
+  // read a batch of chunks at once, then decrypt them on all threads.
+  // cached ones are skipped over.
+  CacheOwner owner = cache_owner(header.content_nonce);
+  u64 batch_size = BATCH_CHUNKS_PER_THREAD * m_pool->threads();
+  std::vector<Botan::secure_vector<u8>> batch;
+  std::vector<ChunkCache::Chunk> cached;
+  for (u64 start = first; start < last; start += batch_size) {
+    batch.resize(std::min(batch_size, last - start));
+    cached.assign(batch.size(), nullptr);
+    for (u64 i = 0; i < batch.size(); i++) {
+      u64 index = start + i;
+      cached[i] = m_cache.find(owner, index);
+      if (cached[i]) {
+        continue;
+      }
+      batch[i].resize(offsets[index + 1] - offsets[index]);
+      if (!m_file->read(header.content_offset() + offsets[index],
+                        batch[i].data(), batch[i].size())) {
+        return false;
+      }
+    }
+
+    m_pool->parallel_for(batch.size(), [&](u64 i) {
+      if (!cached[i]) {
+        open_chunk(header, start + i, batch[i]);
+      }
+    });
+
+    for (u64 i = 0; i < batch.size(); i++) {
+      if (cached[i]) {
+        sink(cached[i]->data(), cached[i]->size());
+        continue;
+      }
+      sink(batch[i].data(), batch[i].size());
+      if (use_cache) {
+        m_cache.insert(owner, start + i, std::move(batch[i]));
+      }
+    }
+  }
+  return true;
+}
+
+std::optional<ChunkTable> Vault::read_chunk_table(const FileHeader &header) {
+  ChunkTable table{header.content_size(), {}};
+  u64 size = header.content_ciphertext_size;
+  if ((header.flags & ENTRY_COMPRESSED) == 0) {
+    // fixed size chunks, nothing to read
+    u64 chunks = header.chunks();
+    u64 chunk_size = chunks == 1 ? size : CHUNK_CIPHERTEXT_SIZE;
+    for (u64 i = 0; i < chunks; i++) {
+      table.offsets.push_back(i * chunk_size);
+    }
+    table.offsets.push_back(size);
+    return table;
+  }
+
+  // the content ends with the encrypted table and the number of chunks
+  u32 chunks = 0;
+  if (size < sizeof(u32) ||
+      !m_file->read(header.content_offset() + size - sizeof(u32),
+                    reinterpret_cast<u8 *>(&chunks), sizeof(u32))) {
+    return std::nullopt;
+  }
+  u64 table_size = sizeof(u64) + chunks * sizeof(u32) + TAG_SIZE;
+  if (table_size + sizeof(u32) > size) {
+    return std::nullopt;
+  }
+
+  Botan::secure_vector<u8> bytes(table_size);
+  if (!m_file->read(header.content_offset() + size - sizeof(u32) - table_size,
+                    bytes.data(), bytes.size())) {
+    return std::nullopt;
+  }
+  m_ciphers->acquire()->decrypt(
+      bytes, Crypto::chunk_nonce(header.content_nonce, chunks, true));
+
+  BufferReader reader(bytes);
+  table.content_size = reader.get<u64>();
+  table.offsets.push_back(0);
+  for (u32 i = 0; i < chunks; i++) {
+    table.offsets.push_back(table.offsets.back() + reader.get<u32>());
+  }
+  if (table.offsets.back() + table_size + sizeof(u32) != size) {
+    return std::nullopt;
+  }
+  return table;
+}
+
+std::optional<std::vector<ChunkReference>>
+Vault::read_references(const FileHeader &header) {
+  Botan::secure_vector<u8> list(header.content_ciphertext_size);
+  if (list.size() < sizeof(u64) + TAG_SIZE ||
+      !m_file->read(header.content_offset(), list.data(), list.size())) {
+    return std::nullopt;
+  }
+  m_ciphers->acquire()->decrypt(list, header.content_nonce);
+
+  BufferReader reader(list);
+  u64 count = reader.get<u64>();
+  if (list.size() != sizeof(u64) + count * (sizeof(ChunkId) + sizeof(u32))) {
+    return std::nullopt;
+  }
+  std::vector<ChunkReference> references(count);
+  for (auto &reference : references) {
+    reader.get_bytes(reference.id.data(), reference.id.size());
+    reference.size = reader.get<u32>();
+  }
+  return references;
+}
+
+bool Vault::read_deduplicated(const FileHeader &header, u64 offset,
+                              u64 length, const ContentSink &sink,
+                              bool use_cache) {
+  auto references = read_references(header);
+  if (!references) {
+    return false;
+  }
+
+  // only the chunks covering [offset, offset + length) are read
+  u64 first = 0;
+  while (first < references->size() &&
+         offset >= references->at(first).size) {
+    offset -= references->at(first).size;
+    first++;
+  }
+  u64 last = first;
+  for (u64 covered = 0;
+       last < references->size() && covered < offset + length; last++) {
+    covered += references->at(last).size;
+  }
+
+  u64 batch_size = BATCH_CHUNKS_PER_THREAD * m_pool->threads();
+  std::vector<Botan::secure_vector<u8>> batch;
+  std::vector<std::array<u8, 24>> nonces;
+  std::vector<ChunkCache::Chunk> cached;
+  for (u64 start = first; start < last; start += batch.size()) {
+    batch.resize(std::min(batch_size, last - start));
+    nonces.resize(batch.size());
+    cached.assign(batch.size(), nullptr);
+    for (u64 i = 0; i < batch.size(); i++) {
+      const ChunkId &id = references->at(start + i).id;
+      cached[i] = m_cache.find(id, 0);
+      if (cached[i]) {
+        continue;
+      }
+      auto it = m_chunks.find(id);
+      if (it == m_chunks.end()) {
+        return false;
+      }
+
+      // the content nonce, its size and then the ciphertext
+      u64 nonce_offset =
+          it->second.offset + SHARED_CHUNK_HEADER_SIZE - 24 - sizeof(u64);
+      batch[i].resize(it->second.offset + it->second.size - nonce_offset);
+      if (!m_file->read(nonce_offset, batch[i].data(), batch[i].size())) {
+        return false;
+      }
+      std::memcpy(nonces[i].data(), batch[i].data(), nonces[i].size());
+      batch[i].erase(batch[i].begin(),
+                     batch[i].begin() + 24 + sizeof(u64));
+    }
+
+    std::atomic<bool> mismatch = false;
+    m_pool->parallel_for(batch.size(), [&](u64 i) {
+      if (cached[i]) {
+        return;
+      }
+      m_ciphers->acquire()->decrypt(batch[i], nonces[i]);
+      Compression::unpack(batch[i]);
+      if (batch[i].size() != references->at(start + i).size) {
+        mismatch = true;
+      }
+    });
+    if (mismatch) {
+      return false;
+    }
+
+    for (u64 i = 0; i < batch.size(); i++) {
+      const auto &plaintext = cached[i] ? *cached[i] : batch[i];
+      u64 count = std::min(plaintext.size() - offset, length);
+      sink(plaintext.data() + offset, count);
+      length -= count;
+      offset = 0;
+      if (!cached[i] && use_cache) {
+        m_cache.insert(references->at(start + i).id, 0, std::move(batch[i]));
+      }
+    }
+  }
+  return true;
+}
+
+void Vault::open_chunk(const FileHeader &header, u64 index,
+                       Botan::secure_vector<u8> &chunk) {
+  // the chunk table comes last in compressed entries
+  bool compressed = (header.flags & ENTRY_COMPRESSED) != 0;
+  m_ciphers->acquire()->decrypt(
+      chunk,
+      Crypto::chunk_nonce(header.content_nonce, static_cast<u32>(index),
+                          !compressed && index + 1 == header.chunks()));
+  if (compressed) {
+    Compression::unpack(chunk);
+  }
+}
+
+bool Vault::compressing() const { return m_compression && upgradable(); }
+
+bool Vault::deduplicating() const { return m_deduplication && upgradable(); }
+
+bool Vault::upgradable() const { return m_version >= KEY_SLOT_VERSION; }
+
+void Vault::append_chunk_table(const FileHeader &header, u64 content_size,
+                               const std::vector<u32> &sizes,
+                               Botan::secure_vector<u8> &out) {
+  ASSERT(sizes.size() <= UINT32_MAX);
+  auto chunks = static_cast<u32>(sizes.size());
+
+  Botan::secure_vector<u8> table;
+  put(table, content_size);
+  for (u32 size : sizes) {
+    put(table, size);
+  }
+  m_ciphers->acquire()->encrypt(
+      table, Crypto::chunk_nonce(header.content_nonce, chunks, true));
+  put_bytes(out, table.data(), table.size());
+  put(out, chunks);
+}
+
+FileHeader Vault::encode_entry_header(const EntryKey &key, u8 flags,
+                                      u64 content_ciphertext_size,
+                                      Botan::secure_vector<u8> &out) {
+  // entries get encoded on pool threads too
+  thread_local Botan::AutoSeeded_RNG rng;
+
+  // the root's entries are stored just like before directories
+  Botan::secure_vector<u8> name;
+  if (key.directory != ROOT_DIRECTORY) {
+    flags |= ENTRY_NESTED;
+    put(name, key.directory);
+  }
+  put_bytes(name, reinterpret_cast<const u8 *>(key.name.data()),
+            key.name.size());
+
+  FileHeader header{};
+  header.name = key.name;
+  header.directory = key.directory;
+  header.name_nonce = rng.random_array<24>();
+  header.content_nonce = rng.random_array<24>();
+  header.content_ciphertext_size = content_ciphertext_size;
+  header.flags = flags;
+
+  header.name_ciphertext_size = name.size() + TAG_SIZE;
+  u64 size_and_flags =
+      content_ciphertext_size | (static_cast<u64>(flags) << 56);
+
+  put_bytes(out, header.name_nonce.data(), header.name_nonce.size());
+  put(out, header.name_ciphertext_size);
+  m_ciphers->acquire()->encrypt(name.data(), name.size(), header.name_nonce,
+                                out);
+  put_bytes(out, header.content_nonce.data(), header.content_nonce.size());
+  put(out, size_and_flags);
+  return header;
+}
+
+FileHeader Vault::encode_chunked_entry(const EntryKey &key,
+                                       const Botan::secure_vector<u8> &content,
+                                       Botan::secure_vector<u8> &out) {
+  // the first chunk decides whether the content gets compressed, and is
+  // kept packed if it does
+  Botan::secure_vector<u8> first;
+  if (compressing()) {
+    first.assign(content.begin(),
+                 content.begin() +
+                     static_cast<i64>(std::min(CHUNK_SIZE, content.size())));
+  }
+  if (compressing() && Compression::pack(first)) {
+    FileHeader header =
+        encode_entry_header(key, ENTRY_CHUNKED | ENTRY_COMPRESSED, 0, out);
+    header.plaintext_size = content.size();
+    u64 content_start = out.size();
+
+    auto cipher = m_ciphers->acquire();
+    std::vector<u32> sizes;
+    for (u64 i = 0; i < header.chunks(); i++) {
+      u64 start = i * CHUNK_SIZE;
+      Botan::secure_vector<u8> chunk;
+      u64 end = std::min(start + CHUNK_SIZE, content.size());
+      if (i == 0) {
+        chunk = std::move(first);
+      } else {
+        chunk.assign(content.begin() + static_cast<i64>(start),
+                     content.begin() + static_cast<i64>(end));
+        Compression::pack(chunk);
+      }
+      cipher->encrypt(chunk, Crypto::chunk_nonce(header.content_nonce,
+                                                 static_cast<u32>(i), false));
+      sizes.push_back(static_cast<u32>(chunk.size()));
+      put_bytes(out, chunk.data(), chunk.size());
+    }
+    append_chunk_table(header, content.size(), sizes, out);
+
+    header.content_ciphertext_size = out.size() - content_start;
+    u64 size_and_flags = header.content_ciphertext_size |
+                         (static_cast<u64>(header.flags) << 56);
+    std::memcpy(out.data() + content_start - sizeof(u64), &size_and_flags,
+                sizeof(u64));
+    return header;
+  }
+
+  FileHeader header = encode_entry_header(
+      key, ENTRY_CHUNKED, chunked_ciphertext_size(content.size()), out);
+
+  // the chunks are encrypted straight out of `content` into `out`
+  auto cipher = m_ciphers->acquire();
+  out.reserve(out.size() + header.content_ciphertext_size);
+  u64 chunks = chunk_count(header.content_ciphertext_size);
+  for (u64 i = 0; i < chunks; i++) {
+    u64 start = i * CHUNK_SIZE;
+    cipher->encrypt(content.data() + start,
+                    std::min(CHUNK_SIZE, content.size() - start),
+                    Crypto::chunk_nonce(header.content_nonce,
+                                        static_cast<u32>(i), i + 1 == chunks),
+                    out);
+  }
+  return header;
+}
+
+FileHeader Vault::write_entry_header(const EntryKey &key, u8 flags,
+                                     u64 content_ciphertext_size, u64 offset) {
+  Botan::secure_vector<u8> bytes;
+  FileHeader header =
+      encode_entry_header(key, flags, content_ciphertext_size, bytes);
+  header.offset = offset;
+  m_file->write(offset, bytes.data(), bytes.size());
+  return header;
+}
+
+void Vault::write_file(const std::string &name,
+                       std::optional<u64> content_size,
+                       const std::function<u64(u8 *, u64)> &read_content) {
+  // called with m_write_mutex held. only writers change the index, so it
+  // can be read without m_index_mutex until the change gets published.
+  PendingChunks pending;
+  EntryKey key = [&] {
+    std::unique_lock lock(m_index_mutex);
+    return make_entry_key(name);
+  }();
+  auto it = find_entry(name);
+  if (it == m_index.end()) {
+    FileHeader header = write_new_entry(key, m_data_end, read_content, pending);
+    std::unique_lock lock(m_index_mutex);
+    publish_chunks(pending);
+    append_entry(header);
+    lock.unlock();
+    commit();
+    return;
+  }
+  FileHeader old = it->second;
+
+  // what was read ahead before the source turned out to be a different
+  // size than it said, it goes first
+  Botan::secure_vector<u8> read_ahead;
+  u64 read_ahead_position = 0;
+  auto read_rest = [&](u8 *buffer, u64 size) -> u64 {
+    if (read_ahead_position == read_ahead.size()) {
+      return read_content(buffer, size);
+    }
+    u64 count = std::min(size, read_ahead.size() - read_ahead_position);
+    std::memcpy(buffer, read_ahead.data() + read_ahead_position, count);
+    read_ahead_position += count;
+    return count;
+  };
+
+  // the name doesn't change, so neither does the size of its ciphertext.
+  // entries that didn't compress are overwritten the same way, compressed
+  // ones can't know their new size up front and deduplicated ones are
+  // appended to share what they can. so are big ones, the journal would
+  // have to hold all of them, and renamed ones, whose header has another
+  // name.
+  bool plain = (old.flags & (ENTRY_COMPRESSED | ENTRY_DEDUPLICATED)) == 0;
+  if (content_size && plain && !deduplicating() && old.key() == key &&
+      !old.stored_key && old.total_size() <= MAX_JOURNALED_OVERWRITE) {
+    u64 old_size = old.total_size();
+    u64 new_size = old.content_offset() - old.offset +
+                   chunked_ciphertext_size(content_size.value());
+
+    bool fits = new_size == old_size ||
+                (new_size < old_size && old_size - new_size >= FILLER_MIN_SIZE);
+
+    // all of it is read before the old content is touched, with one byte
+    // more to tell a source that has more than it said. one that doesn't
+    // match gets appended like any other.
+    if (fits) {
+      read_ahead.resize(content_size.value() + 1);
+      u64 size = 0;
+      while (size < read_ahead.size()) {
+        u64 count =
+            read_content(read_ahead.data() + size, read_ahead.size() - size);
+        if (count == 0) {
+          break;
+        }
+        size += count;
+      }
+      read_ahead.resize(size);
+    }
+
+    if (fits && read_ahead.size() == content_size.value()) {
+      // the old content is overwritten, keep readers out of it
+      std::unique_lock lock(m_index_mutex);
+      FileHeader header =
+          write_chunked_entry(key, old.offset, read_rest, false);
+      ASSERT(header.total_size() == new_size);
+      if (new_size < old_size) {
+        write_filler(old.offset + new_size, old_size - new_size);
+      }
+      m_cache.erase(cache_owner(old.content_nonce));
+
+      m_live_size -= old_size - new_size;
+      m_index[key] = header;
+      m_index_changes.entries.insert(key);
+      lock.unlock();
+      commit();
+      return;
+    }
+  }
+
+  // doesn't fit, append a new version and invalidate the old one. its
+  // chunks are published first so the ones both share never drop to 0.
+  FileHeader header = write_new_entry(key, m_data_end, read_rest, pending);
+  std::unique_lock lock(m_index_mutex);
+  publish_chunks(pending);
+  drop_entry(old);
+  m_index.erase(old.key());
+  m_index_changes.entries.insert(old.key());
+  append_entry(header);
+  lock.unlock();
+  commit();
+}
+
+FileHeader Vault::write_chunked_entry(
+    const EntryKey &key, u64 offset,
+    const std::function<u64(u8 *, u64)> &read_content, bool compress) {
+  auto fill = [&](Botan::secure_vector<u8> &buffer) {
+    buffer.resize(CHUNK_SIZE);
+    u64 size = 0;
+    while (size < CHUNK_SIZE) {
+      u64 count = read_content(buffer.data() + size, CHUNK_SIZE - size);
+      if (count == 0) {
+        break;
+      }
+      size += count;
+    }
+    buffer.resize(size);
+  };
+
+  // read one chunk ahead so we know which one is the last, the first one
+  // also decides whether the content gets compressed and is kept packed
+  // if it does
+  Botan::secure_vector<u8> next;
+  fill(next);
+  Botan::secure_vector<u8> first;
+  if (compress && compressing()) {
+    first = next;
+    compress = Compression::pack(first);
+  } else {
+    compress = false;
+  }
+  u8 flags = compress ? ENTRY_CHUNKED | ENTRY_COMPRESSED : ENTRY_CHUNKED;
+  FileHeader header = write_entry_header(key, flags, 0, offset);
+  header.plaintext_size = 0;
+  std::vector<u32> sizes;
+
+  u64 batch_size = BATCH_CHUNKS_PER_THREAD * m_pool->threads();
+  std::vector<Botan::secure_vector<u8>> batch;
+  bool last = false;
+  for (u64 start = 0; !last; start += batch.size()) {
+    batch.clear();
+    while (batch.size() < batch_size && !last) {
+      header.plaintext_size += next.size();
+      batch.push_back(std::move(next));
+      if (batch.back().size() == CHUNK_SIZE) {
+        fill(next);
+      } else {
+        next.clear();
+      }
+      last = next.empty();
+    }
+    ASSERT(start + batch.size() - 1 <= UINT32_MAX);
+
+    m_pool->parallel_for(batch.size(), [&](u64 i) {
+      if (compress && start + i == 0) {
+        batch[i] = std::move(first);
+      } else if (compress) {
+        Compression::pack(batch[i]);
+      }
+      m_ciphers->acquire()->encrypt(
+          batch[i],
+          Crypto::chunk_nonce(header.content_nonce,
+                              static_cast<u32>(start + i),
+                              !compress && last && i + 1 == batch.size()));
+    });
+
+    // one write per batch instead of one per chunk
+    Botan::secure_vector<u8> bytes;
+    for (const auto &ciphertext : batch) {
+      put_bytes(bytes, ciphertext.data(), ciphertext.size());
+      if (compress) {
+        sizes.push_back(static_cast<u32>(ciphertext.size()));
+      }
+    }
+    if (compress && last) {
+      append_chunk_table(header, header.plaintext_size, sizes, bytes);
+    }
+    m_file->write(header.content_offset() + header.content_ciphertext_size,
+                  bytes.data(), bytes.size());
+    header.content_ciphertext_size += bytes.size();
+  }
+
+  // the size isn't known until the content has been consumed
+  u64 size_and_flags = header.content_ciphertext_size |
+                       (static_cast<u64>(header.flags) << 56);
+  m_file->write(header.content_offset() - sizeof(u64),
+                reinterpret_cast<const u8 *>(&size_and_flags), sizeof(u64));
+  return header;
+}
+
+FileHeader Vault::write_deduplicated_entry(
+    const EntryKey &key, u64 offset,
+    const std::function<u64(u8 *, u64)> &read_content,
+    PendingChunks &pending) {
+  u64 batch_size = BATCH_CHUNKS_PER_THREAD * m_pool->threads();
+
+  // enough content to cut a whole batch of chunks out of, topped up
+  // whenever what's left might not reach the next cut point
+  Botan::secure_vector<u8> buffer;
+  u64 position = 0;
+  bool eof = false;
+  auto refill = [&]() {
+    buffer.erase(buffer.begin(), buffer.begin() + static_cast<i64>(position));
+    position = 0;
+    u64 size = buffer.size();
+    buffer.resize(batch_size * CDC_MAX_SIZE);
+    while (size < buffer.size()) {
+      u64 count = read_content(buffer.data() + size, buffer.size() - size);
+      if (count == 0) {
+        eof = true;
+        break;
+      }
+      size += count;
+    }
+    buffer.resize(size);
+  };
+
+  u64 end = offset;
+  u64 plaintext_size = 0;
+  std::vector<ChunkReference> references;
+  std::vector<Botan::secure_vector<u8>> batch;
+  while (true) {
+    batch.clear();
+    while (batch.size() < batch_size) {
+      if (!eof && buffer.size() - position < CDC_MAX_SIZE) {
+        refill();
+      }
+      if (position == buffer.size()) {
+        break;
+      }
+      u64 size =
+          m_chunker->cut(buffer.data() + position, buffer.size() - position);
+      batch.emplace_back(buffer.begin() + static_cast<i64>(position),
+                         buffer.begin() + static_cast<i64>(position + size));
+      position += size;
+    }
+    if (batch.empty()) {
+      break;
+    }
+
+    std::vector<ChunkId> ids(batch.size());
+    m_pool->parallel_for(batch.size(), [&](u64 i) {
+      ids[i] = Crypto::hmac_sha256(m_chunk_id_key, batch[i].data(),
+                                   batch[i].size());
+    });
+
+    // chunks the vault doesn't have yet, each one only once
+    std::vector<u64> fresh;
+    for (u64 i = 0; i < batch.size(); i++) {
+      references.push_back({ids[i], static_cast<u32>(batch[i].size())});
+      pending.referenced.push_back(ids[i]);
+      plaintext_size += batch[i].size();
+      if (!m_chunks.contains(ids[i]) &&
+          pending.written.try_emplace(ids[i]).second) {
+        fresh.push_back(i);
+      }
+    }
+
+    std::vector<Botan::secure_vector<u8>> records(fresh.size());
+    m_pool->parallel_for(fresh.size(), [&](u64 i) {
+      auto &chunk = batch[fresh[i]];
+      if (compressing()) {
+        Compression::pack(chunk);
+      } else {
+        chunk.insert(chunk.begin(), Compression::STORED);
+      }
+      const ChunkId &id = ids[fresh[i]];
+      FileHeader header = encode_entry_header(
+          {ROOT_DIRECTORY, std::string(id.begin(), id.end())},
+          ENTRY_SHARED_CHUNK, chunk.size() + TAG_SIZE, records[i]);
+      m_ciphers->acquire()->encrypt(chunk.data(), chunk.size(),
+                                    header.content_nonce, records[i]);
+    });
+
+    Botan::secure_vector<u8> bytes;
+    for (u64 i = 0; i < fresh.size(); i++) {
+      pending.written[ids[fresh[i]]] = {end + bytes.size(), records[i].size(),
+                                        0};
+      put_bytes(bytes, records[i].data(), records[i].size());
+    }
+    m_file->write(end, bytes.data(), bytes.size());
+    end += bytes.size();
+  }
+
+  // the entry itself comes after its chunks, so walking the file always
+  // finds them first
+  Botan::secure_vector<u8> list;
+  put(list, static_cast<u64>(references.size()));
+  for (const auto &reference : references) {
+    put_bytes(list, reference.id.data(), reference.id.size());
+    put(list, reference.size);
+  }
+  Botan::secure_vector<u8> bytes;
+  FileHeader header = encode_entry_header(key, ENTRY_DEDUPLICATED,
+                                          list.size() + TAG_SIZE, bytes);
+  m_ciphers->acquire()->encrypt(list.data(), list.size(),
+                                header.content_nonce, bytes);
+  m_file->write(end, bytes.data(), bytes.size());
+  header.offset = end;
+  header.plaintext_size = plaintext_size;
+  return header;
+}
+
+FileHeader
+Vault::write_new_entry(const EntryKey &key, u64 offset,
+                       const std::function<u64(u8 *, u64)> &read_content,
+                       PendingChunks &pending) {
+  if (deduplicating()) {
+    return write_deduplicated_entry(key, offset, read_content, pending);
+  }
+  return write_chunked_entry(key, offset, read_content);
+}
+
+void Vault::publish_chunks(const PendingChunks &pending) {
+  for (const auto &[id, chunk] : pending.written) {
+    m_chunks[id] = chunk;
+    m_live_size += chunk.size;
+    m_index_changes.chunks.insert(id);
+  }
+  for (const auto &id : pending.referenced) {
+    m_chunks.at(id).references++;
+    m_index_changes.chunks.insert(id);
+  }
+}
+
+void Vault::append_entry(const FileHeader &header) {
+  m_data_end = header.offset + header.total_size();
+  m_live_size += header.total_size();
+  m_index[header.key()] = header;
+  m_index_changes.entries.insert(header.key());
+}
+
+void Vault::drop_entry(const FileHeader &header) {
+  std::optional<std::vector<ChunkReference>> references;
+  if ((header.flags & ENTRY_DEDUPLICATED) != 0) {
+    references = read_references(header);
+    ASSERT(references);
+  }
+  mark_deleted(header);
+  m_live_size -= header.total_size();
+  m_cache.erase(cache_owner(header.content_nonce));
+  if (!references) {
+    return;
+  }
+
+  for (const auto &reference : references.value()) {
+    auto it = m_chunks.find(reference.id);
+    ASSERT(it != m_chunks.end());
+    m_index_changes.chunks.insert(reference.id);
+    if (--it->second.references > 0) {
+      continue;
+    }
+
+    // nothing uses it anymore, compaction reclaims it with the entry
+    FileHeader chunk{};
+    chunk.offset = it->second.offset;
+    chunk.name_ciphertext_size = sizeof(ChunkId) + TAG_SIZE;
+    chunk.content_ciphertext_size = it->second.size - SHARED_CHUNK_HEADER_SIZE;
+    chunk.flags = ENTRY_SHARED_CHUNK;
+    mark_deleted(chunk);
+    m_live_size -= it->second.size;
+    m_cache.erase(it->first);
+    m_chunks.erase(it);
+  }
+}
+
+void Vault::mark_deleted(const FileHeader &header) {
+  u64 size_and_flags =
+      header.content_ciphertext_size |
+      (static_cast<u64>(header.flags | ENTRY_DELETED) << 56);
+
+  m_file->write(header.content_offset() - sizeof(u64),
+                reinterpret_cast<const u8 *>(&size_and_flags), sizeof(u64));
+}
+
+void Vault::write_filler(u64 offset, u64 size) {
+  static Botan::AutoSeeded_RNG rng;
+
+  // a dead entry with a dummy name that covers the whole gap
+  FileHeader header{};
+  header.offset = offset;
+  header.name_ciphertext_size = TAG_SIZE;
+  ASSERT(size >= FILLER_MIN_SIZE);
+  header.content_ciphertext_size = size - header.total_size();
+  header.flags = ENTRY_DELETED;
+
+  auto name_ciphertext = rng.random_array<TAG_SIZE>();
+  u64 size_and_flags = header.content_ciphertext_size |
+                       (static_cast<u64>(header.flags) << 56);
+
+  Botan::secure_vector<u8> bytes;
+  put_bytes(bytes, header.name_nonce.data(), header.name_nonce.size());
+  put(bytes, header.name_ciphertext_size);
+  put_bytes(bytes, name_ciphertext.data(), name_ciphertext.size());
+  put_bytes(bytes, header.content_nonce.data(), header.content_nonce.size());
+  put(bytes, size_and_flags);
+  m_file->write(offset, bytes.data(), bytes.size());
+}
+
+std::optional<u64> Vault::find_directory(const std::string &path) const {
+  u64 id = ROOT_DIRECTORY;
+  for (const auto &component : split_path(path)) {
+    auto it = m_directory_ids.find({id, component});
+    if (it == m_directory_ids.end()) {
+      return std::nullopt;
+    }
+    id = it->second;
+  }
+  return id;
+}
+
+std::map<EntryKey, FileHeader>::const_iterator
+Vault::find_entry(const std::string &path) const {
+  std::vector<std::string> components = split_path(path);
+  if (!components.empty()) {
+    std::string name = components.back();
+    components.pop_back();
+
+    u64 id = ROOT_DIRECTORY;
+    bool found = true;
+    for (const auto &component : components) {
+      auto it = m_directory_ids.find({id, component});
+      if (it == m_directory_ids.end()) {
+        found = false;
+        break;
+      }
+      id = it->second;
+    }
+    if (found) {
+      auto it = m_index.find({id, name});
+      if (it != m_index.end()) {
+        return it;
+      }
+    }
+  }
+
+  // entries from before directories have the whole path as their name
+  return m_index.find({ROOT_DIRECTORY, path});
+}
+
+std::string Vault::path_of(u64 directory, const std::string &name,
+                           u64 base) const {
+  std::string path = name;
+  while (directory != base) {
+    const FileHeader &header = m_directories.at(directory);
+    path = header.name + "/" + path;
+    directory = header.directory;
+  }
+  return path;
+}
+
+std::vector<u64> Vault::subtree(u64 directory) const {
+  // every directory comes after its parent
+  std::vector<u64> directories = {directory};
+  for (u64 i = 0; i < directories.size(); i++) {
+    u64 parent = directories[i];
+    for (auto it = m_directory_ids.lower_bound({parent, ""});
+         it != m_directory_ids.end() && it->first.directory == parent; ++it) {
+      directories.push_back(it->second);
+    }
+  }
+  return directories;
+}
+
+EntryKey Vault::make_entry_key(const std::string &path) {
+  if (!upgradable()) {
+    return {ROOT_DIRECTORY, path};
+  }
+
+  ASSERT(valid_path(path));
+  std::vector<std::string> components = split_path(path);
+  std::string name = components.back();
+  components.pop_back();
+
+  EntryKey key = {make_directories(components), name};
+  if (m_directory_ids.contains(key)) {
+    throw std::runtime_error(path + " is a directory");
+  }
+  return key;
+}
+
+u64 Vault::make_directories(const std::vector<std::string> &components) {
+  u64 id = ROOT_DIRECTORY;
+  for (const auto &component : components) {
+    EntryKey key = {id, component};
+    auto it = m_directory_ids.find(key);
+    if (it != m_directory_ids.end()) {
+      id = it->second;
+      continue;
+    }
+    // only the first missing one can clash, the rest go in new directories
+    if (m_index.contains(key)) {
+      throw std::runtime_error(path_of(id, component) + " is a file");
+    }
+
+    u64 created = m_next_directory_id++;
+    FileHeader header = write_directory(created, key, m_data_end);
+    m_data_end = header.offset + header.total_size();
+    m_live_size += header.total_size();
+    m_directories[created] = header;
+    m_directory_ids[key] = created;
+    m_index_changes.directories.insert(created);
+    id = created;
+  }
+  return id;
+}
+
+FileHeader Vault::write_directory(u64 id, const EntryKey &key, u64 offset) {
+  Botan::secure_vector<u8> bytes;
+  FileHeader header = encode_entry_header(key, ENTRY_DIRECTORY,
+                                          sizeof(u64) + TAG_SIZE, bytes);
+  m_ciphers->acquire()->encrypt(reinterpret_cast<const u8 *>(&id),
+                                sizeof(u64), header.content_nonce, bytes);
+  m_file->write(offset, bytes.data(), bytes.size());
+  header.offset = offset;
+  return header;
+}
+
+u64 Vault::segment_start(u64 offset) const {
+  if (m_segments.size == 0 || offset < m_segments.start) {
+    return m_data_offset;
+  }
+  u64 relative = offset - m_segments.start;
+  return m_segments.start + relative - relative % m_segments.size;
+}
+
+void Vault::move_bytes(u64 from, u64 to, u64 size, bool unused) {
+  // entries only ever move towards the start or past their own end, so
+  // copying front to back is safe even when the ranges overlap
+  ASSERT(to < from || to >= from + size);
+
+  std::vector<u8> buffer(std::min(size, CHUNK_CIPHERTEXT_SIZE));
+  for (u64 done = 0; done < size;) {
+    u64 count = std::min(size - done, static_cast<u64>(buffer.size()));
+
+    ASSERT(m_file->read(from + done, buffer.data(), count));
+    if (unused) {
+      m_file->write_unused(to + done, buffer.data(), count);
+    } else {
+      m_file->write(to + done, buffer.data(), count);
+    }
+
+    done += count;
+  }
+}
+
+void Vault::commit() {
+  if (m_batches == 0) {
+    flush_index();
+    m_file->sync();
+  }
 }
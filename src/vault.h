@@ -1,39 +1,598 @@
 #pragma once
 
+#include "chunkcache.h"
+#include "chunker.h"
 #include "common.h"
+#include "crypto.h"
+#include "journal.h"
+#include "threadpool.h"
+#include "vaultfile.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <botan/secmem.h>
+#include <chrono>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <shared_mutex>
+#include <vector>
 
-constexpr i16 VERSION = 1;
-constexpr u64 AFTER_HEADER_OFFSET = 68;
+constexpr i16 VERSION = 10;
+// the first version with an index
+constexpr i16 INDEX_VERSION = 2;
+// the first version with the KDF parameters in the header
+constexpr i16 KDF_VERSION = 3;
+// the first version with a random master key wrapped in key slots
+constexpr i16 KEY_SLOT_VERSION = 4;
+// the first version that can have compressed entries
+constexpr i16 COMPRESSION_VERSION = 5;
+// the first version that can have deduplicated entries
+constexpr i16 DEDUP_VERSION = 6;
+// the first version with directories
+constexpr i16 DIRECTORY_VERSION = 7;
+// the first version that can keep its entries in pack files
+constexpr i16 SEGMENT_VERSION = 8;
+// the first version that appends what changed to the index instead of
+// writing all of it again
+constexpr i16 INDEX_LOG_VERSION = 9;
+// the first version whose index can rename entries without their header
+constexpr i16 RENAME_VERSION = 10;
+
+// versions 1 and 2 have a fixed header, the data starts right after it
+constexpr u64 LEGACY_HEADER_SIZE = 68;
+// later headers are padded to this, so they can grow without moving data
+constexpr u64 HEADER_SIZE = 4096;
+
+// vault options, the byte right after the version
+constexpr u8 VAULT_DEDUPLICATED = 1 << 0;
+// the data is in pack files, their size and the first one's number follow
+// at SEGMENTS_OFFSET
+constexpr u8 VAULT_SEGMENTED = 1 << 1;
+constexpr u64 SEGMENTS_OFFSET = 8;
+// smaller packs would just mean more files
+constexpr u64 MIN_SEGMENT_SIZE = static_cast<u64>(1024 * 1024);
+
+constexpr u8 KDF_ARGON2ID = 1;
+// new vaults get KDF parameters that take about this long to unlock
+constexpr std::chrono::milliseconds KDF_TARGET_TIME{2000};
+
+// the top byte of the on-disk content size holds the entry flags
+constexpr u64 CONTENT_SIZE_MASK = (static_cast<u64>(1) << 56) - 1;
+constexpr u8 ENTRY_INDEX = 1 << 0;
+// content is a sequence of independently authenticated CHUNK_SIZE chunks
+constexpr u8 ENTRY_CHUNKED = 1 << 1;
+// tombstone, the space is reclaimed by Vault::compact
+constexpr u8 ENTRY_DELETED = 1 << 2;
+// chunked, but every chunk starts with its Compression method and they're
+// located through an encrypted chunk table at the end of the content
+constexpr u8 ENTRY_COMPRESSED = 1 << 3;
+// a chunk of content shared by deduplicated entries, named by its ChunkId
+constexpr u8 ENTRY_SHARED_CHUNK = 1 << 4;
+// content is a list of ChunkReferences to shared chunks
+constexpr u8 ENTRY_DEDUPLICATED = 1 << 5;
+// a directory, its content is its id
+constexpr u8 ENTRY_DIRECTORY = 1 << 6;
+// the name starts with the id of the directory the entry is in, entries
+// without it are in the root
+constexpr u8 ENTRY_NESTED = 1 << 7;
+
+// directories keep their id when they're renamed or moved
+constexpr u64 ROOT_DIRECTORY = 0;
+
+// where an entry is, names only have to be unique within their directory
+struct EntryKey {
+  u64 directory;
+  std::string name;
+
+  auto operator<=>(const EntryKey &) const = default;
+};
+
+constexpr u64 CHUNK_SIZE = static_cast<u64>(64 * 1024);
+constexpr u64 TAG_SIZE = 16;
+constexpr u64 CHUNK_CIPHERTEXT_SIZE = CHUNK_SIZE + TAG_SIZE;
+
+// every chunked entry has at least one (possibly empty) last chunk
+constexpr u64 chunk_count(u64 ciphertext_size) {
+  return std::max<u64>(1, (ciphertext_size + CHUNK_CIPHERTEXT_SIZE - 1) /
+                              CHUNK_CIPHERTEXT_SIZE);
+}
+
+constexpr u64 chunked_ciphertext_size(u64 plaintext_size) {
+  return plaintext_size +
+         std::max<u64>(1, (plaintext_size + CHUNK_SIZE - 1) / CHUNK_SIZE) *
+             TAG_SIZE;
+}
+
+// chunks are encrypted and decrypted in batches of this many per thread
+constexpr u64 BATCH_CHUNKS_PER_THREAD = 4;
+
+// anything longer is taken for a broken header
+constexpr u64 MAX_NAME_CIPHERTEXT_SIZE = 10000;
+
+// the smallest possible entry, used to cover leftover space
+constexpr u64 FILLER_MIN_SIZE = 24 + sizeof(u64) + TAG_SIZE + 24 + sizeof(u64);
+
+// the vault ends with the index entry followed by its offset and this magic
+constexpr std::array<char, 8> INDEX_MAGIC = {'D', 'U', 'L', 'L',
+                                             'I', 'D', 'X', '1'};
+constexpr u64 INDEX_TRAILER_SIZE = sizeof(u64) + INDEX_MAGIC.size();
+
+constexpr u8 KEY_SLOT_EMPTY = 0;
+constexpr u8 KEY_SLOT_PASSWORD = 1;
+constexpr u8 KEY_SLOT_RECOVERY = 2;
+constexpr u64 MAX_KEY_SLOTS = 8;
+// where the key slots start in the header, each one is padded to the size
+constexpr u64 KEY_SLOTS_OFFSET = 64;
+constexpr u64 KEY_SLOT_SIZE = 128;
+// recovery keys are random, so they don't need an expensive KDF
+constexpr Crypto::KdfParams RECOVERY_KDF_PARAMS = {
+    static_cast<u64>(64 * 1024), 1, 1};
+
+// the master key, encrypted with a key derived from a password or a
+// recovery key
+struct KeySlot {
+  u8 kind;
+  Crypto::KdfParams kdf;
+  std::array<u8, 16> salt;
+  std::array<u8, 24> nonce;
+  std::array<u8, 32 + TAG_SIZE> wrapped_key;
+};
+
+// what's needed to derive the key and check it, versions before key slots
+// have a single salt and a check value instead
+struct VaultHeader {
+  std::array<u8, 16> salt;
+  Crypto::KdfParams kdf;
+  std::array<u8, 24> check_nonce;
+  Botan::secure_vector<u8> check_ciphertext;
+};
 
-// !!! REMEMBER TO UPDATE entry_total_size IN Vault::delete_file
 struct FileHeader {
+  u64 offset;
   std::array<u8, 24> name_nonce;
   u64 name_ciphertext_size;
   std::string name;
+  u64 directory;
   std::array<u8, 24> content_nonce;
   u64 content_ciphertext_size;
+  u8 flags;
+  // compressed and deduplicated entries only, it can't be derived from the
+  // ciphertext size
+  u64 plaintext_size;
+  // what the entry's own header says, if the index renamed it since
+  std::optional<EntryKey> stored_key;
+
+  EntryKey key() const { return {directory, name}; }
+  u64 content_offset() const {
+    return offset + 24 + sizeof(u64) + name_ciphertext_size + 24 +
+           sizeof(u64);
+  }
+  u64 total_size() const {
+    return content_offset() - offset + content_ciphertext_size;
+  }
+  u64 content_size() const {
+    if ((flags & (ENTRY_COMPRESSED | ENTRY_DEDUPLICATED)) != 0) {
+      return plaintext_size;
+    }
+    if ((flags & ENTRY_CHUNKED) != 0) {
+      return content_ciphertext_size -
+             chunk_count(content_ciphertext_size) * TAG_SIZE;
+    }
+    return content_ciphertext_size - TAG_SIZE;
+  }
+  u64 chunks() const {
+    if ((flags & ENTRY_COMPRESSED) != 0) {
+      return std::max<u64>(1, (plaintext_size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+    }
+    if ((flags & ENTRY_CHUNKED) != 0) {
+      return chunk_count(content_ciphertext_size);
+    }
+    return 1;
+  }
+};
+
+// where every chunk of an entry's content is, chunk i takes up
+// [offsets[i], offsets[i + 1]) from the content offset
+struct ChunkTable {
+  u64 content_size;
+  std::vector<u64> offsets;
+};
+
+// keyed hash of a chunk's plaintext, equal chunks have equal ids without
+// the content being recognizable from them
+using ChunkId = std::array<u8, 32>;
+
+// shared chunk entries have their id as the name
+constexpr u64 SHARED_CHUNK_HEADER_SIZE =
+    24 + sizeof(u64) + sizeof(ChunkId) + TAG_SIZE + 24 + sizeof(u64);
+
+struct StoredChunk {
+  u64 offset;
+  // of the whole entry
+  u64 size;
+  // how many times deduplicated entries list it, deleted once it drops to 0
+  u64 references;
+};
+
+struct ChunkReference {
+  ChunkId id;
+  u32 size;
+};
+
+// shared chunks written and referenced by a write, until it's published
+struct PendingChunks {
+  std::map<ChunkId, StoredChunk> written;
+  std::vector<ChunkId> referenced;
 };
 
+// what changed in the index since it was last written, by key
+struct IndexChanges {
+  std::set<EntryKey> entries;
+  std::set<ChunkId> chunks;
+  std::set<u64> directories;
+
+  bool empty() const {
+    return entries.empty() && chunks.empty() && directories.empty();
+  }
+};
+
+// receives decrypted content piece by piece
+using ContentSink = std::function<void(const u8 *data, u64 size)>;
+
+// CHUNK_SIZE blocks of content by their index, the last one may be shorter
+using ContentBlocks = std::map<u64, Botan::secure_vector<u8>>;
+
+// (done, total), called from the thread running the operation
+using ProgressCallback = std::function<void(u64 done, u64 total)>;
+
+// batches in flight between each pair of extract_all stages
+constexpr u64 PIPELINE_DEPTH = 4;
+
+// create_files encrypts files up to this size whole and in parallel, larger
+// ones are streamed chunk by chunk
+constexpr u64 BATCH_MAX_FILE_SIZE = static_cast<u64>(1024 * 1024);
+// small entries are collected up to this size before being written
+constexpr u64 BATCH_WRITE_SIZE = static_cast<u64>(16 * 1024 * 1024);
+
+// what's directly in a directory, both sorted by name
+struct DirectoryListing {
+  std::vector<std::string> directories;
+  std::vector<FileHeader> files;
+};
+
+// the names in a vault path, skipping empty ones and "."
+std::vector<std::string> split_path(const std::string &path);
+
+struct ImportFile {
+  std::string name;
+  // file on disk the content is read from
+  std::string path;
+};
+
+// `path` and, if it's a directory, every regular file under it, named
+// relative to the directory containing it and placed in `directory` of the
+// vault. adding "photos" gives "photos/2024/a.jpg".
+void collect_import_files(const std::string &path,
+                          const std::string &directory,
+                          std::vector<ImportFile> &files);
+
+// how much data a single compaction step moves at most
+constexpr u64 COMPACTION_STEP_SIZE = static_cast<u64>(16 * 1024 * 1024);
+// overwrites of committed bytes are held in memory until the commit, so
+// entries bigger than this are appended or moved in one piece instead
+constexpr u64 MAX_JOURNALED_OVERWRITE = static_cast<u64>(16 * 1024 * 1024);
+
+struct CompactionProgress {
+  // bytes of the data area that are already compacted, out of total
+  u64 processed;
+  u64 total;
+  // dead bytes skipped over so far, freed from the file once done
+  u64 reclaimed;
+  bool done;
+};
+
+// a record Vault::verify found broken, by where it starts in the file
+struct DamagedEntry {
+  u64 offset;
+  // empty for shared chunks and the index
+  std::string path;
+  std::string error;
+};
+
+// Safe to share between threads. Writes run one at a time, reads run
+// alongside each other and alongside most of a write.
 class Vault {
 public:
-  explicit Vault(std::string path, const std::string &password);
+  explicit Vault(std::string path, const std::string &password,
+                 IOBackend backend = DEFAULT_IO_BACKEND);
+
+  // KDF parameters are calibrated to KDF_TARGET_TIME unless given. with a
+  // segment size the entries go to numbered pack files of at most that
+  // many bytes next to `path`, which only keeps the header. 0 keeps
+  // everything in `path`.
+  static std::unique_ptr<Vault>
+  create(const std::string &path, const std::string &password,
+         std::optional<Crypto::KdfParams> kdf = std::nullopt,
+         IOBackend backend = DEFAULT_IO_BACKEND, u64 segment_size = 0);
 
+  // names are paths, with the directories they're in separated by '/'.
+  // missing directories are created along the way. vaults from before
+  // KEY_SLOT_VERSION keep the whole path as the name until re-keyed.
   std::vector<FileHeader> read_file_headers();
+  u64 file_count() const;
+  std::optional<FileHeader> file_header(const std::string &name) const;
   std::optional<std::string> read_file(const std::string &name);
+  bool read_file(const std::string &name, std::ostream &out);
+  bool read_file(const std::string &name, const ContentSink &sink);
+  std::optional<std::string> read_range(const std::string &name, u64 offset,
+                                        u64 length);
+  // false if there's no such entry
+  bool read_range(const std::string &name, u64 offset, u64 length,
+                  const ContentSink &sink);
   void create_file(const std::string &name, const std::string &content);
+  void create_file(const std::string &name, std::istream &content);
+  // nothing is added if one of the files can't be read, not even directories
+  void create_files(const std::vector<ImportFile> &files,
+                    const ProgressCallback &progress = nullptr);
   void delete_file(const std::string &name);
+  // entries whose names would land outside of `directory` are skipped and
+  // reported with a runtime_error once the rest is out. the index is held
+  // shared for the whole run, so writers wait until it's done or cancelled.
+  bool extract_all(const std::string &directory,
+                   const ProgressCallback &progress = nullptr,
+                   const std::atomic<bool> *cancel = nullptr);
+  // everything under `path` into `directory`, false if there's no such
+  // directory in the vault. holds the index like extract_all().
+  bool extract_directory(const std::string &path, const std::string &directory,
+                         const ProgressCallback &progress = nullptr,
+                         const std::atomic<bool> *cancel = nullptr);
+  // decrypts every live record without keeping anything, in file order and
+  // across the pool, and reports each one that doesn't authenticate or
+  // doesn't match the index instead of stopping at it. chunks are read
+  // from the file even if they're cached. progress is in bytes. writers
+  // wait for it, the index is held shared throughout.
+  std::vector<DamagedEntry>
+  verify(const ProgressCallback &progress = nullptr,
+         const std::atomic<bool> *cancel = nullptr);
   void update_file(const std::string &name, const std::string &content);
+  void update_file(const std::string &name, std::istream &content);
+  // rewrites `name` as its content cut or zero-extended to `size`, with
+  // `blocks` in place of the ones at their index. a missing entry counts as
+  // empty. deduplicating vaults only store the chunks that changed.
+  void patch_file(const std::string &name, u64 size,
+                  const ContentBlocks &blocks);
+
+  // each change is committed on its own, with its own fsync, unless a batch
+  // is alive. then it waits for the last batch to end and is committed
+  // along with everything else made meanwhile, a crash keeps all or none.
+  // the index is written once for all of them.
+  class Batch {
+  public:
+    explicit Batch(Vault &vault);
+    ~Batch();
+
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+
+  private:
+    Vault &m_vault;
+  };
+
+  // "" is the root
+  std::optional<DirectoryListing> list_directory(const std::string &path);
+  bool has_directory(const std::string &path) const;
+  // false if the vault is from before KEY_SLOT_VERSION
+  bool create_directory(const std::string &path);
+  // everything in it goes too
+  void delete_directory(const std::string &path);
+  // only the index changes, files and directories stay where they are.
+  // directories get a new record of their own, files keep their header and
+  // go by their old name if the index is ever rebuilt from the entries.
+  // vaults from before KEY_SLOT_VERSION copy the file under the new name
+  // instead. false if `from` doesn't exist, `to` does or `to` is inside
+  // `from`.
+  bool rename(const std::string &from, const std::string &to);
+  // the path of an entry from read_file_headers or list_directory
+  std::string entry_path(const FileHeader &header) const;
+  // at least one name, and no ".." among them
+  static bool valid_path(const std::string &path);
+
+  // bytes taken up by deleted entries and index records
+  u64 free_space() const;
+  // entries of segmented vaults stay in the pack they're in, so only packs
+  // with something deleted in them get rewritten. what's left at the end of
+  // a pack is given back.
+  CompactionProgress compact_step(u64 max_bytes = COMPACTION_STEP_SIZE);
+  u64 compact(const std::atomic<bool> *cancel = nullptr);
+
+  // re-encrypts everything under a new master key, protected by `password`
+  // alone, upgrading old vaults to the current version. recovery keys stop
+  // working.
+  void rekey(const std::string &password,
+             std::optional<Crypto::KdfParams> kdf = std::nullopt);
+  // only rewrites the password's key slot, vaults from before key slots
+  // get re-keyed instead
+  void change_password(const std::string &password,
+                       std::optional<Crypto::KdfParams> kdf = std::nullopt);
+  // a random key that unlocks the vault just like the password, nullopt if
+  // the vault has no free key slot
+  std::optional<std::string> add_recovery_key();
+  void remove_recovery_keys();
+  const Crypto::KdfParams &kdf_params() const { return m_kdf; }
+  i16 version() const { return m_version; }
+  // 0 if the vault is a single file
+  u64 segment_size() const { return m_segments.size; }
+
+  // new entries are compressed when that makes them smaller, on by default.
+  // vaults from before KEY_SLOT_VERSION only get it once re-keyed.
+  void set_compression(bool enabled) { m_compression = enabled; }
+  bool compression() const { return m_compression; }
+  // new entries are split into content-defined chunks that are only stored
+  // once across the whole vault. off by default, remembered by the vault.
+  void set_deduplication(bool enabled);
+  bool deduplication() const { return m_deduplication; }
+
+  // 0 means one thread per core
+  void set_threads(u32 threads);
+  u32 threads() const { return m_pool->threads(); }
+
+  // recently read chunks are kept decrypted up to this many bytes, reading
+  // them again costs no I/O and no decryption. 0 turns it off.
+  void set_cache_size(u64 bytes) { m_cache.set_budget(bytes); }
+  CacheStats cache_stats() const { return m_cache.stats(); }
 
   const std::string &path() const { return m_path; }
 
 private:
+  Vault(std::string path, Botan::secure_vector<u8> key, IOBackend backend);
+
   std::string m_path;
-  std::fstream m_file;
+  IOBackend m_backend;
+  std::unique_ptr<JournaledFile> m_file;
+  std::atomic<u32> m_batches = 0;
+  i16 m_version = VERSION;
+  Crypto::KdfParams m_kdf = Crypto::DEFAULT_KDF_PARAMS;
+  std::array<KeySlot, MAX_KEY_SLOTS> m_slots{};
+  // entries start right after the header
+  u64 m_data_offset = HEADER_SIZE;
+  Segments m_segments;
   Botan::secure_vector<u8> m_key;
+  // keyed once, every thread takes one for as long as it needs it
+  std::unique_ptr<Crypto::CipherPool> m_ciphers;
+  std::unique_ptr<ThreadPool> m_pool;
+  ChunkCache m_cache{DEFAULT_CACHE_SIZE};
+  std::atomic<bool> m_compression = true;
+  std::atomic<bool> m_deduplication = false;
+  // chunk ids and boundaries use keys of their own
+  Botan::secure_vector<u8> m_chunk_id_key;
+  std::unique_ptr<Chunker> m_chunker;
+
+  // writes are serialized on m_write_mutex. they only take m_index_mutex
+  // exclusively to publish their changes or to touch bytes readers could be
+  // looking at, so reads of other entries keep going while they run.
+  std::mutex m_write_mutex;
+  mutable std::shared_mutex m_index_mutex;
+
+  // (directory, name) -> entry, loaded once on open and kept in sync on
+  // every change
+  std::map<EntryKey, FileHeader> m_index;
+  // id -> the directory's record, whose key says where the directory is
+  std::map<u64, FileHeader> m_directories;
+  // (parent, name) -> id
+  std::map<EntryKey, u64> m_directory_ids;
+  u64 m_next_directory_id = ROOT_DIRECTORY + 1;
+  // every shared chunk, also loaded once on open
+  std::map<ChunkId, StoredChunk> m_chunks;
+  // new entries are appended here, over the index if it's a whole one
+  u64 m_data_end = HEADER_SIZE;
+  // index records in the data area, a whole index and then the changes to
+  // it, oldest first. empty while the index is a whole one at m_data_end.
+  std::vector<u64> m_index_log;
+  // of the whole index in m_index_log and of everything after it
+  u64 m_index_base_size = 0;
+  u64 m_index_log_size = 0;
+  IndexChanges m_index_changes;
+  u64 m_live_size = 0;
+  // everything before this offset has been compacted in the current run
+  u64 m_compact_cursor = HEADER_SIZE;
+  // ends of packs given back in the current run
+  u64 m_compact_discarded = 0;
 
-  std::optional<FileHeader> read_file_header();
+  void set_key(Botan::secure_vector<u8> key);
+  VaultHeader read_header();
+  void write_header();
+  void check_key(const VaultHeader &header);
+  Botan::secure_vector<u8> unlock(const std::string &secret);
+  void upgrade_key_slots(const std::string &password);
+  void open_index();
+  std::optional<FileHeader> read_file_header(u64 offset);
+  bool load_index();
+  // into the maps, starting from a whole index or on top of what's there
+  void read_whole_index(const Botan::secure_vector<u8> &plaintext);
+  void read_index_changes(const Botan::secure_vector<u8> &plaintext);
+  void rebuild_index();
+  // the whole index at m_data_end, with nothing before it in the log
+  FileHeader write_index();
+  // changes only go into m_index_changes, commit() writes them once per
+  // batch. readers see a change as soon as m_index_mutex is let go, writers
+  // commit after letting go of it so neither the index nor the fsyncs hold
+  // them up. vaults from before KEY_SLOT_VERSION get a whole index every
+  // time.
+  void flush_index();
+  // `plaintext` starts with the offset of the previous index, which
+  // versions before INDEX_LOG_VERSION leave out
+  FileHeader write_index_record(const Botan::secure_vector<u8> &plaintext);
+  void raise_version(i16 version);
+  bool read_content(const FileHeader &header, const ContentSink &sink);
+  // with `use_cache` off chunks are still taken from the cache but none are
+  // added to it, for reads that go over everything once
+  bool read_chunks(const FileHeader &header, u64 first, u64 last,
+                   const ContentSink &sink, bool use_cache = true);
+  std::optional<ChunkTable> read_chunk_table(const FileHeader &header);
+  bool read_bytes(const FileHeader &header, u64 offset, u64 length,
+                  const ContentSink &sink, bool use_cache = true);
+  std::optional<std::vector<ChunkReference>>
+  read_references(const FileHeader &header);
+  // false if a chunk is missing or doesn't unpack to its recorded size
+  bool read_deduplicated(const FileHeader &header, u64 offset, u64 length,
+                         const ContentSink &sink, bool use_cache = true);
+  void open_chunk(const FileHeader &header, u64 index,
+                  Botan::secure_vector<u8> &chunk);
+  bool compressing() const;
+  bool deduplicating() const;
+  // headers from KEY_SLOT_VERSION on are all the same, newer features can
+  // be used on them and raise the version once they're written
+  bool upgradable() const;
+  void append_chunk_table(const FileHeader &header, u64 content_size,
+                          const std::vector<u32> &sizes,
+                          Botan::secure_vector<u8> &out);
+  FileHeader encode_entry_header(const EntryKey &key, u8 flags,
+                                 u64 content_ciphertext_size,
+                                 Botan::secure_vector<u8> &out);
+  FileHeader encode_chunked_entry(const EntryKey &key,
+                                  const Botan::secure_vector<u8> &content,
+                                  Botan::secure_vector<u8> &out);
+  FileHeader write_entry_header(const EntryKey &key, u8 flags,
+                                u64 content_ciphertext_size, u64 offset);
+  void write_file(const std::string &name, std::optional<u64> content_size,
+                  const std::function<u64(u8 *, u64)> &read_content);
+  FileHeader
+  write_chunked_entry(const EntryKey &key, u64 offset,
+                      const std::function<u64(u8 *, u64)> &read_content,
+                      bool compress = true);
+  FileHeader
+  write_deduplicated_entry(const EntryKey &key, u64 offset,
+                           const std::function<u64(u8 *, u64)> &read_content,
+                           PendingChunks &pending);
+  FileHeader write_new_entry(const EntryKey &key, u64 offset,
+                             const std::function<u64(u8 *, u64)> &read_content,
+                             PendingChunks &pending);
+  void publish_chunks(const PendingChunks &pending);
+  void append_entry(const FileHeader &header);
+  void drop_entry(const FileHeader &header);
+  void mark_deleted(const FileHeader &header);
+  void write_filler(u64 offset, u64 size);
+  std::optional<u64> find_directory(const std::string &path) const;
+  std::map<EntryKey, FileHeader>::const_iterator
+  find_entry(const std::string &path) const;
+  std::string path_of(u64 directory, const std::string &name,
+                      u64 base = ROOT_DIRECTORY) const;
+  std::vector<u64> subtree(u64 directory) const;
+  EntryKey make_entry_key(const std::string &path);
+  u64 make_directories(const std::vector<std::string> &components);
+  FileHeader write_directory(u64 id, const EntryKey &key, u64 offset);
+  bool extract(u64 directory, const std::string &out,
+               const ProgressCallback &progress,
+               const std::atomic<bool> *cancel);
+  // where the pack `offset` is in starts, the data offset if there are none
+  u64 segment_start(u64 offset) const;
+  // `unused` if nothing committed is at `to`, so it needn't be journaled
+  void move_bytes(u64 from, u64 to, u64 size, bool unused = false);
+  // flushes the index and syncs, unless a batch is alive
+  void commit();
 };
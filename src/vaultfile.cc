@@ -0,0 +1,503 @@
+#include "vaultfile.h"
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// gets what was written to `path` onto the disk. syncing one handle covers
+// every other one to the same file, fstream doesn't give out its own.
+void sync_path(const std::string &path) {
+#ifdef _WIN32
+  int fd = ::_open(path.c_str(), _O_RDWR | _O_BINARY);
+  ASSERT(fd >= 0);
+  int result = ::_commit(fd);
+  ::_close(fd);
+#else
+  int fd = ::open(path.c_str(), O_RDWR);
+  ASSERT(fd >= 0);
+  int result = ::fsync(fd);
+  ::close(fd);
+#endif
+  ASSERT(result == 0);
+}
+
+class StreamFile : public VaultFile {
+public:
+  explicit StreamFile(std::string path) : m_path(std::move(path)) {
+    m_file.open(m_path, std::ios::in | std::ios::out | std::ios::binary);
+    ASSERT(m_file.good());
+    m_size = std::filesystem::file_size(m_path);
+  }
+
+  u64 size() const override {
+    std::lock_guard lock(m_mutex);
+    return m_size;
+  }
+
+  bool read(u64 offset, u8 *out, u64 size) override {
+    std::lock_guard lock(m_mutex);
+    if (offset + size > m_size) {
+      return false;
+    }
+    m_file.clear();
+    m_file.seekg(static_cast<i64>(offset), std::ios::beg);
+    return static_cast<bool>(
+        m_file.read(to_char_ptr(out), static_cast<i64>(size)));
+  }
+
+  void write(u64 offset, const u8 *data, u64 size) override {
+    std::lock_guard lock(m_mutex);
+    m_file.clear();
+    m_file.seekp(static_cast<i64>(offset), std::ios::beg);
+    ASSERT(m_file.write(to_char_ptr(data), static_cast<i64>(size)));
+    m_size = std::max(m_size, offset + size);
+  }
+
+  void resize(u64 size) override {
+    std::lock_guard lock(m_mutex);
+    m_file.flush();
+    m_file.close();
+
+    std::filesystem::resize_file(m_path, size);
+    m_size = size;
+
+    m_file.open(m_path, std::ios::in | std::ios::out | std::ios::binary);
+    ASSERT(m_file.good());
+  }
+
+  void sync() override {
+    std::lock_guard lock(m_mutex);
+    ASSERT(m_file.flush());
+    sync_path(m_path);
+  }
+
+private:
+  std::string m_path;
+  std::fstream m_file;
+  mutable std::mutex m_mutex;
+  u64 m_size = 0;
+};
+
+#ifndef _WIN32
+
+class PreadFile : public VaultFile {
+public:
+  explicit PreadFile(const std::string &path) {
+    m_fd = ::open(path.c_str(), O_RDWR);
+    ASSERT(m_fd >= 0);
+
+    struct stat st {};
+    ASSERT(::fstat(m_fd, &st) == 0);
+    m_size = static_cast<u64>(st.st_size);
+  }
+
+  ~PreadFile() override { ::close(m_fd); }
+
+  PreadFile(const PreadFile &) = delete;
+  PreadFile &operator=(const PreadFile &) = delete;
+
+  u64 size() const override { return m_size; }
+
+  bool read(u64 offset, u8 *out, u64 size) override {
+    if (offset + size > m_size) {
+      return false;
+    }
+    while (size > 0) {
+      ssize_t count = ::pread(m_fd, out, size, static_cast<off_t>(offset));
+      if (count <= 0) {
+        return false;
+      }
+      out += count;
+      offset += static_cast<u64>(count);
+      size -= static_cast<u64>(count);
+    }
+    return true;
+  }
+
+  void write(u64 offset, const u8 *data, u64 size) override {
+    u64 end = offset + size;
+    while (size > 0) {
+      ssize_t count = ::pwrite(m_fd, data, size, static_cast<off_t>(offset));
+      ASSERT(count > 0);
+      data += count;
+      offset += static_cast<u64>(count);
+      size -= static_cast<u64>(count);
+    }
+
+    u64 current = m_size;
+    while (current < end && !m_size.compare_exchange_weak(current, end)) {
+    }
+  }
+
+  void resize(u64 size) override {
+    ASSERT(::ftruncate(m_fd, static_cast<off_t>(size)) == 0);
+    m_size = size;
+  }
+
+  void sync() override { ASSERT(::fsync(m_fd) == 0); }
+
+protected:
+  int m_fd = -1;
+  std::atomic<u64> m_size = 0;
+};
+
+class MmapFile : public PreadFile {
+public:
+  using PreadFile::PreadFile;
+
+  ~MmapFile() override {
+    for (const auto &[map, size] : m_maps) {
+      ::munmap(map, size);
+    }
+  }
+
+  MmapFile(const MmapFile &) = delete;
+  MmapFile &operator=(const MmapFile &) = delete;
+
+  bool read(u64 offset, u8 *out, u64 size) override {
+    const u8 *data = view(offset, size);
+    if (data == nullptr) {
+      return PreadFile::read(offset, out, size);
+    }
+    std::memcpy(out, data, size);
+    return true;
+  }
+
+  const u8 *view(u64 offset, u64 size) override {
+    if (offset + size > m_size) {
+      return nullptr;
+    }
+
+    std::lock_guard lock(m_mutex);
+    if (offset + size > m_map_size) {
+      // map well past the end so appends rarely need a new mapping, old
+      // mappings stay around so views handed out earlier stay valid
+      u64 map_size = std::max(MIN_MAP_SIZE, (offset + size) * 2);
+      void *map = ::mmap(nullptr, map_size, PROT_READ, MAP_SHARED, m_fd, 0);
+      if (map == MAP_FAILED) {
+        return nullptr;
+      }
+      m_maps.emplace_back(map, map_size);
+      m_map = static_cast<const u8 *>(map);
+      m_map_size = map_size;
+    }
+    return m_map + offset;
+  }
+
+private:
+  static constexpr u64 MIN_MAP_SIZE = static_cast<u64>(1) << 30;
+
+  std::mutex m_mutex;
+  const u8 *m_map = nullptr;
+  u64 m_map_size = 0;
+  std::vector<std::pair<void *, u64>> m_maps;
+};
+
+#endif
+
+#ifdef DULL_METRICS
+
+// times whatever backend it's put in front of
+class MeasuredFile : public VaultFile {
+public:
+  explicit MeasuredFile(std::unique_ptr<VaultFile> file)
+      : m_file(std::move(file)) {}
+
+  u64 size() const override { return m_file->size(); }
+
+  bool read(u64 offset, u8 *out, u64 size) override {
+    Metrics::Timer timer(Metric::FileRead, size);
+    return m_file->read(offset, out, size);
+  }
+
+  void write(u64 offset, const u8 *data, u64 size) override {
+    Metrics::Timer timer(Metric::FileWrite, size);
+    m_file->write(offset, data, size);
+  }
+
+  void resize(u64 size) override { m_file->resize(size); }
+
+  void sync() override {
+    Metrics::Timer timer(Metric::FileSync);
+    m_file->sync();
+  }
+
+  const u8 *view(u64 offset, u64 size) override {
+    return m_file->view(offset, size);
+  }
+
+private:
+  std::unique_ptr<VaultFile> m_file;
+};
+
+#endif
+
+// the bytes before the start in the vault file, the rest spread over packs
+class SegmentedFile : public VaultFile {
+public:
+  SegmentedFile(std::string path, IOBackend backend, const Segments &segments)
+      : m_path(std::move(path)), m_backend(backend), m_segments(segments) {
+    ASSERT(m_segments.size > 0 && m_segments.first > 0);
+    m_head = VaultFile::open(m_path, m_backend);
+    for (u64 number = m_segments.first;
+         std::filesystem::exists(segment_path(m_path, number)); number++) {
+      m_packs.push_back(std::make_unique<Pack>(
+          VaultFile::open(segment_path(m_path, number), m_backend)));
+    }
+
+    // a rekey that replaced the header but didn't get to remove the old
+    // packs, they end right before the gap in front of the new ones
+    if (m_segments.first > 2) {
+      for (u64 number = m_segments.first - 2;
+           number > 0 && std::filesystem::remove(segment_path(m_path, number));
+           number--) {
+      }
+    }
+  }
+
+  u64 size() const override {
+    std::shared_lock lock(m_mutex);
+    return size_locked();
+  }
+
+  bool read(u64 offset, u8 *out, u64 size) override {
+    std::shared_lock lock(m_mutex);
+    if (offset + size > size_locked()) {
+      return false;
+    }
+    for (u64 done = 0; done < size;) {
+      Piece piece = locate(offset + done, size - done);
+      if (!file(piece.file).read(piece.offset, out + done, piece.size)) {
+        return false;
+      }
+      done += piece.size;
+    }
+    return true;
+  }
+
+  void write(u64 offset, const u8 *data, u64 size) override {
+    add_packs(packs_for(offset + size));
+    std::shared_lock lock(m_mutex);
+    for (u64 done = 0; done < size;) {
+      Piece piece = locate(offset + done, size - done);
+      file(piece.file).write(piece.offset, data + done, piece.size);
+      dirty(piece.file) = true;
+      done += piece.size;
+    }
+  }
+
+  // growing leaves the packs it adds in front of the last one empty,
+  // nothing reads what a resize adds
+  void resize(u64 size) override {
+    u64 count = packs_for(size);
+    add_packs(count);
+    std::unique_lock lock(m_mutex);
+    while (m_packs.size() > count) {
+      m_packs.pop_back();
+      std::filesystem::remove(
+          segment_path(m_path, m_segments.first + m_packs.size()));
+    }
+    if (count == 0) {
+      m_head->resize(size);
+      m_head_dirty = true;
+    } else {
+      m_packs.back()->file->resize(size - m_segments.start -
+                                   (count - 1) * m_segments.size);
+      m_packs.back()->dirty = true;
+    }
+  }
+
+  void sync() override {
+    std::shared_lock lock(m_mutex);
+    if (m_head_dirty.exchange(false)) {
+      m_head->sync();
+    }
+    for (auto &pack : m_packs) {
+      if (pack->dirty.exchange(false)) {
+        pack->file->sync();
+      }
+    }
+  }
+
+  const u8 *view(u64 offset, u64 size) override {
+    std::shared_lock lock(m_mutex);
+    if (offset + size > size_locked()) {
+      return nullptr;
+    }
+    // only ranges within a single file
+    Piece piece = locate(offset, size);
+    if (piece.size != size) {
+      return nullptr;
+    }
+    return file(piece.file).view(piece.offset, size);
+  }
+
+  void discard(u64 offset, u64 size) override {
+    std::unique_lock lock(m_mutex);
+    for (u64 done = 0; done < size;) {
+      Piece piece = locate(offset + done, size - done);
+      done += piece.size;
+
+      // the last pack is only ever cut by resize
+      if (piece.file == 0 || piece.file >= m_packs.size()) {
+        continue;
+      }
+      VaultFile &pack = file(piece.file);
+      u64 end = pack.size();
+      if (piece.offset < end && piece.offset + piece.size >= end) {
+        pack.resize(piece.offset);
+        dirty(piece.file) = true;
+      }
+    }
+  }
+
+  u64 discarded() const override {
+    std::shared_lock lock(m_mutex);
+    u64 total = 0;
+    for (u64 i = 0; i + 1 < m_packs.size(); i++) {
+      total += m_segments.size -
+               std::min(m_segments.size, m_packs[i]->file->size());
+    }
+    return total;
+  }
+
+private:
+  struct Pack {
+    explicit Pack(std::unique_ptr<VaultFile> pack_file)
+        : file(std::move(pack_file)) {}
+
+    std::unique_ptr<VaultFile> file;
+    std::atomic<bool> dirty = false;
+  };
+
+  // the vault file is file 0, pack i is file i + 1
+  struct Piece {
+    u64 file;
+    u64 offset;
+    u64 size;
+  };
+
+  std::string m_path;
+  IOBackend m_backend;
+  Segments m_segments;
+  std::unique_ptr<VaultFile> m_head;
+  std::atomic<bool> m_head_dirty = false;
+  // guards the list of packs, what's in them is up to the packs
+  mutable std::shared_mutex m_mutex;
+  std::vector<std::unique_ptr<Pack>> m_packs;
+
+  u64 size_locked() const {
+    if (m_packs.empty()) {
+      return m_head->size();
+    }
+    return m_segments.start + (m_packs.size() - 1) * m_segments.size +
+           m_packs.back()->file->size();
+  }
+
+  u64 packs_for(u64 size) const {
+    if (size <= m_segments.start) {
+      return 0;
+    }
+    return (size - m_segments.start + m_segments.size - 1) / m_segments.size;
+  }
+
+  // the part of [offset, offset + size) in the file `offset` is in
+  Piece locate(u64 offset, u64 size) const {
+    if (offset < m_segments.start) {
+      return {0, offset, std::min(size, m_segments.start - offset)};
+    }
+    u64 relative = offset - m_segments.start;
+    u64 local = relative % m_segments.size;
+    return {relative / m_segments.size + 1, local,
+            std::min(size, m_segments.size - local)};
+  }
+
+  VaultFile &file(u64 index) const {
+    return index == 0 ? *m_head : *m_packs[index - 1]->file;
+  }
+
+  std::atomic<bool> &dirty(u64 index) {
+    return index == 0 ? m_head_dirty : m_packs[index - 1]->dirty;
+  }
+
+  void add_packs(u64 count) {
+    {
+      std::shared_lock lock(m_mutex);
+      if (m_packs.size() >= count) {
+        return;
+      }
+    }
+
+    std::unique_lock lock(m_mutex);
+    while (m_packs.size() < count) {
+      u64 number = m_segments.first + m_packs.size();
+      // past a gap there can only be what an unfinished rekey left behind,
+      // which this pack would join up with
+      remove_segments(m_path, number + 1);
+
+      std::string pack_path = segment_path(m_path, number);
+      std::ofstream create(pack_path, std::ios::binary);
+      ASSERT(create.good());
+      create.close();
+      m_packs.push_back(
+          std::make_unique<Pack>(VaultFile::open(pack_path, m_backend)));
+    }
+  }
+};
+
+std::unique_ptr<VaultFile> open_backend(const std::string &path,
+                                        IOBackend backend) {
+  switch (backend) {
+#ifndef _WIN32
+  case IOBackend::Pread:
+    return std::make_unique<PreadFile>(path);
+  case IOBackend::Mmap:
+    return std::make_unique<MmapFile>(path);
+#endif
+  default:
+    return std::make_unique<StreamFile>(path);
+  }
+}
+
+} // namespace
+
+std::string segment_path(const std::string &path, u64 number) {
+  return path + "." + std::to_string(number);
+}
+
+void remove_segments(const std::string &path, u64 first) {
+  while (std::filesystem::remove(segment_path(path, first))) {
+    first++;
+  }
+}
+
+std::unique_ptr<VaultFile> VaultFile::open(const std::string &path,
+                                           IOBackend backend,
+                                           const Segments &segments) {
+  if (segments.size > 0) {
+    return std::make_unique<SegmentedFile>(path, backend, segments);
+  }
+#ifdef DULL_METRICS
+  return std::make_unique<MeasuredFile>(open_backend(path, backend));
+#else
+  return open_backend(path, backend);
+#endif
+}
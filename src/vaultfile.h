@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.h"
+#include <memory>
+#include <string>
+
+enum class IOBackend {
+  // std::fstream behind a mutex, works everywhere
+  Stream,
+  // pread/pwrite, no shared file position
+  Pread,
+  // reads straight out of a shared read-only mapping, writes with pwrite
+  Mmap,
+};
+
+#ifdef _WIN32
+constexpr IOBackend DEFAULT_IO_BACKEND = IOBackend::Stream;
+#else
+constexpr IOBackend DEFAULT_IO_BACKEND = IOBackend::Mmap;
+#endif
+
+// Segmented vaults keep everything before `start` in the vault file itself
+// and the rest in numbered pack files of `size` bytes next to it,
+// "<path>.<first>", "<path>.<first + 1>" and so on. Only the last one
+// grows.
+struct Segments {
+  // 0 keeps everything in the one file
+  u64 size = 0;
+  u64 first = 1;
+  u64 start = 0;
+};
+
+// the pack file numbered `number`
+std::string segment_path(const std::string &path, u64 number);
+// the pack numbered `first` and the ones right after it, up to the first
+// one that's missing
+void remove_segments(const std::string &path, u64 first);
+
+// Positional I/O on the vault file. Safe to use from several threads at
+// once as long as they don't touch the same bytes.
+class VaultFile {
+public:
+  virtual ~VaultFile() = default;
+
+  // segmented vaults get their packs opened with the same backend, each on
+  // its own, so reads of different segments don't share anything
+  static std::unique_ptr<VaultFile> open(const std::string &path,
+                                         IOBackend backend,
+                                         const Segments &segments = {});
+
+  virtual u64 size() const = 0;
+  // false if the range goes past the end of the file
+  virtual bool read(u64 offset, u8 *out, u64 size) = 0;
+  virtual void write(u64 offset, const u8 *data, u64 size) = 0;
+  virtual void resize(u64 size) = 0;
+  virtual void sync() = 0;
+
+  // the bytes at [offset, offset + size) without copying them, nullptr if
+  // the backend can't do that or the range is past the end of the file
+  virtual const u8 *view(u64 /*offset*/, u64 /*size*/) { return nullptr; }
+
+  // nothing reads [offset, offset + size) anymore. segmented files give the
+  // space back where it reaches the end of a pack, others keep it.
+  virtual void discard(u64 /*offset*/, u64 /*size*/) {}
+  // bytes below size() that discard gave back
+  virtual u64 discarded() const { return 0; }
+};
@@ -0,0 +1,531 @@
+#include "vaultfs.h"
+
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// shared by every handle to the same entry
+struct OpenFile {
+  std::mutex mutex;
+  // follows renames, changed with the mount's mutex held too
+  std::string path;
+  u64 size = 0;
+  // how much of it is in the vault, the rest reads as zeros
+  u64 stored = 0;
+  // whole CHUNK_SIZE blocks written since the last commit
+  ContentBlocks blocks;
+  bool changed = false;
+  // unlinked while open, nothing is written back
+  bool deleted = false;
+  u64 handles = 0;
+};
+
+struct Mount {
+  Vault &vault;
+  std::time_t mounted_at;
+  // guards open_files and their paths and handle counts
+  std::mutex mutex;
+  std::map<std::string, std::shared_ptr<OpenFile>> open_files;
+};
+
+Mount &mount() {
+  return *static_cast<Mount *>(fuse_get_context()->private_data);
+}
+
+// paths from fuse start at the root of the mount
+std::string vault_path(const char *path) {
+  return path[0] == '/' ? path + 1 : path;
+}
+
+std::shared_ptr<OpenFile> &handle(fuse_file_info *info) {
+  return *reinterpret_cast<std::shared_ptr<OpenFile> *>(info->fh);
+}
+
+// exceptions can't unwind through libfuse
+template <typename F> int guarded(const F &operation) {
+  try {
+    return operation();
+  } catch (const std::exception &e) {
+    std::cerr << "dull-cli: " << e.what() << "\n";
+    return -EIO;
+  }
+}
+
+// what the vault has in [position, position + length), zeros past it
+bool read_stored(const OpenFile &file, u64 position, u64 length, u8 *out) {
+  u64 copied = 0;
+  if (position < file.stored &&
+      !mount().vault.read_range(file.path, position,
+                                std::min(length, file.stored - position),
+                                [&](const u8 *data, u64 size) {
+                                  std::memcpy(out + copied, data, size);
+                                  copied += size;
+                                })) {
+    return false;
+  }
+  std::memset(out + copied, 0, length - copied);
+  return true;
+}
+
+void commit(OpenFile &file) {
+  if (!file.changed || file.deleted) {
+    return;
+  }
+  mount().vault.patch_file(file.path, file.size, file.blocks);
+  file.blocks.clear();
+  file.stored = file.size;
+  file.changed = false;
+}
+
+// nullptr if there's no such entry
+std::shared_ptr<OpenFile> open_file(const std::string &path) {
+  Mount &mounted = mount();
+  std::lock_guard lock(mounted.mutex);
+  auto it = mounted.open_files.find(path);
+  if (it == mounted.open_files.end()) {
+    auto header = mounted.vault.file_header(path);
+    if (!header) {
+      return nullptr;
+    }
+    auto file = std::make_shared<OpenFile>();
+    file->path = path;
+    file->size = file->stored = header->content_size();
+    it = mounted.open_files.emplace(path, file).first;
+  }
+  it->second->handles++;
+  return it->second;
+}
+
+void close_file(const std::shared_ptr<OpenFile> &file) {
+  // the handle goes even if the commit fails
+  std::exception_ptr error;
+  {
+    std::lock_guard lock(file->mutex);
+    try {
+      commit(*file);
+    } catch (...) {
+      error = std::current_exception();
+    }
+  }
+
+  Mount &mounted = mount();
+  {
+    std::lock_guard lock(mounted.mutex);
+    if (--file->handles == 0 && !file->deleted) {
+      mounted.open_files.erase(file->path);
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+// called with the mount's mutex held, before `path` is deleted. its content
+// goes with the entry, so unlike on a disk the handles still open can't
+// read it anymore.
+void forget_open_file(const std::string &path) {
+  Mount &mounted = mount();
+  auto it = mounted.open_files.find(path);
+  if (it == mounted.open_files.end()) {
+    return;
+  }
+  std::lock_guard lock(it->second->mutex);
+  it->second->deleted = true;
+  it->second->blocks.clear();
+  mounted.open_files.erase(it);
+}
+
+int fs_getattr(const char *path, struct stat *st, fuse_file_info *) {
+  return guarded([&] {
+    Mount &mounted = mount();
+    std::string name = vault_path(path);
+    std::memset(st, 0, sizeof(*st));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = st->st_mtime = st->st_ctime = mounted.mounted_at;
+
+    auto regular = [&](u64 size) {
+      st->st_mode = S_IFREG | 0600;
+      st->st_nlink = 1;
+      st->st_size = static_cast<off_t>(size);
+      st->st_blocks = static_cast<blkcnt_t>((size + 511) / 512);
+      return 0;
+    };
+
+    std::shared_ptr<OpenFile> file;
+    {
+      std::lock_guard lock(mounted.mutex);
+      auto it = mounted.open_files.find(name);
+      if (it != mounted.open_files.end()) {
+        file = it->second;
+      }
+    }
+    if (file) {
+      std::lock_guard lock(file->mutex);
+      return regular(file->size);
+    }
+    if (auto header = mounted.vault.file_header(name)) {
+      return regular(header->content_size());
+    }
+    if (mounted.vault.has_directory(name)) {
+      st->st_mode = S_IFDIR | 0700;
+      st->st_nlink = 2;
+      return 0;
+    }
+    return -ENOENT;
+  });
+}
+
+int fs_readdir(const char *path, void *buffer, fuse_fill_dir_t fill, off_t,
+               fuse_file_info *, fuse_readdir_flags) {
+  return guarded([&] {
+    auto listing = mount().vault.list_directory(vault_path(path));
+    if (!listing) {
+      return -ENOENT;
+    }
+
+    auto add = [&](const std::string &name) {
+      fill(buffer, name.c_str(), nullptr, 0,
+           static_cast<fuse_fill_dir_flags>(0));
+    };
+    add(".");
+    add("..");
+    for (const auto &directory : listing->directories) {
+      add(directory);
+    }
+    // vaults from before DIRECTORY_VERSION have names with '/' in them,
+    // which can't be shown
+    for (const auto &header : listing->files) {
+      if (header.name.find('/') == std::string::npos) {
+        add(header.name);
+      }
+    }
+    return 0;
+  });
+}
+
+int fs_open(const char *path, fuse_file_info *info) {
+  return guarded([&] {
+    auto file = open_file(vault_path(path));
+    if (!file) {
+      return -ENOENT;
+    }
+    info->fh = reinterpret_cast<u64>(new std::shared_ptr<OpenFile>(file));
+    return 0;
+  });
+}
+
+int fs_create(const char *path, mode_t, fuse_file_info *info) {
+  return guarded([&] {
+    std::string name = vault_path(path);
+    if (!Vault::valid_path(name)) {
+      return -EINVAL;
+    }
+    if (!mount().vault.file_header(name)) {
+      mount().vault.create_file(name, "");
+    }
+    return fs_open(path, info);
+  });
+}
+
+int fs_read(const char *, char *buffer, size_t size, off_t offset,
+            fuse_file_info *info) {
+  return guarded([&] {
+    OpenFile &file = *handle(info);
+    std::lock_guard lock(file.mutex);
+    if (file.deleted) {
+      return -ENOENT;
+    }
+    auto start = static_cast<u64>(offset);
+    if (start >= file.size) {
+      return 0;
+    }
+    u64 count = std::min<u64>(size, file.size - start);
+
+    // block by block, from what was written or else from the vault
+    for (u64 done = 0; done < count;) {
+      u64 position = start + done;
+      u64 index = position / CHUNK_SIZE;
+      u64 skip = position - index * CHUNK_SIZE;
+      u64 length = std::min(count - done, CHUNK_SIZE - skip);
+      auto *out = reinterpret_cast<u8 *>(buffer + done);
+
+      auto block = file.blocks.find(index);
+      if (block != file.blocks.end()) {
+        std::memcpy(out, block->second.data() + skip, length);
+      } else if (!read_stored(file, position, length, out)) {
+        return -EIO;
+      }
+      done += length;
+    }
+    return static_cast<int>(count);
+  });
+}
+
+int fs_write(const char *, const char *data, size_t size, off_t offset,
+             fuse_file_info *info) {
+  return guarded([&] {
+    OpenFile &file = *handle(info);
+    std::lock_guard lock(file.mutex);
+    if (file.deleted) {
+      return -ENOENT;
+    }
+    auto start = static_cast<u64>(offset);
+
+    for (u64 done = 0; done < size;) {
+      u64 position = start + done;
+      u64 index = position / CHUNK_SIZE;
+      u64 skip = position - index * CHUNK_SIZE;
+      u64 length = std::min(size - done, CHUNK_SIZE - skip);
+
+      auto [block, added] = file.blocks.try_emplace(index);
+      if (added) {
+        block->second.resize(CHUNK_SIZE);
+        if (!read_stored(file, index * CHUNK_SIZE, CHUNK_SIZE,
+                         block->second.data())) {
+          file.blocks.erase(block);
+          return -EIO;
+        }
+      }
+      std::memcpy(block->second.data() + skip, data + done, length);
+      done += length;
+    }
+
+    file.size = std::max<u64>(file.size, start + size);
+    file.changed = true;
+    if (file.blocks.size() * CHUNK_SIZE >= MOUNT_MAX_PENDING) {
+      commit(file);
+    }
+    return static_cast<int>(size);
+  });
+}
+
+int fs_truncate(const char *path, off_t offset, fuse_file_info *info) {
+  return guarded([&] {
+    std::shared_ptr<OpenFile> file =
+        info != nullptr ? handle(info) : open_file(vault_path(path));
+    if (!file) {
+      return -ENOENT;
+    }
+
+    {
+      std::lock_guard lock(file->mutex);
+      auto size = static_cast<u64>(offset);
+      u64 kept = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+      file->blocks.erase(file->blocks.lower_bound(kept), file->blocks.end());
+      if (!file->blocks.empty() && size % CHUNK_SIZE != 0) {
+        auto &[index, block] = *file->blocks.rbegin();
+        if (index == kept - 1) {
+          u64 skip = size - index * CHUNK_SIZE;
+          std::memset(block.data() + skip, 0, CHUNK_SIZE - skip);
+        }
+      }
+      file->size = size;
+      file->changed = true;
+
+      // patch_file() would bring back what's cut off from the vault if the
+      // file grew again, so that's committed right away
+      if (size < file->stored) {
+        commit(*file);
+      }
+    }
+
+    if (info == nullptr) {
+      close_file(file);
+    }
+    return 0;
+  });
+}
+
+// every close() of every descriptor flushes, committing there would
+// rewrite the file each time. it waits for fsync or the last release.
+int fs_flush(const char *, fuse_file_info *) { return 0; }
+
+int fs_fsync(const char *, int, fuse_file_info *info) {
+  return guarded([&] {
+    OpenFile &file = *handle(info);
+    std::lock_guard lock(file.mutex);
+    commit(file);
+    return 0;
+  });
+}
+
+int fs_release(const char *, fuse_file_info *info) {
+  auto *file = &handle(info);
+  int result = guarded([&] {
+    close_file(*file);
+    return 0;
+  });
+  delete file;
+  return result;
+}
+
+int fs_unlink(const char *path) {
+  return guarded([&] {
+    Mount &mounted = mount();
+    std::string name = vault_path(path);
+    std::lock_guard lock(mounted.mutex);
+    if (!mounted.vault.file_header(name)) {
+      return -ENOENT;
+    }
+    forget_open_file(name);
+    mounted.vault.delete_file(name);
+    return 0;
+  });
+}
+
+int fs_mkdir(const char *path, mode_t) {
+  return guarded([&] {
+    std::string name = vault_path(path);
+    if (!Vault::valid_path(name)) {
+      return -EINVAL;
+    }
+    // vaults from before KEY_SLOT_VERSION can't have any
+    return mount().vault.create_directory(name) ? 0 : -EPERM;
+  });
+}
+
+int fs_rmdir(const char *path) {
+  return guarded([&] {
+    std::string name = vault_path(path);
+    auto listing = mount().vault.list_directory(name);
+    if (!listing) {
+      return -ENOENT;
+    }
+    if (!listing->directories.empty() || !listing->files.empty()) {
+      return -ENOTEMPTY;
+    }
+    mount().vault.delete_directory(name);
+    return 0;
+  });
+}
+
+int fs_rename(const char *from_path, const char *to_path, unsigned int flags) {
+  return guarded([&] {
+    if ((flags & ~static_cast<unsigned int>(RENAME_NOREPLACE)) != 0) {
+      return -EINVAL;
+    }
+    Mount &mounted = mount();
+    Vault &vault = mounted.vault;
+    std::string from = vault_path(from_path);
+    std::string to = vault_path(to_path);
+    if (!Vault::valid_path(to)) {
+      return -EINVAL;
+    }
+
+    std::lock_guard lock(mounted.mutex);
+    bool file = vault.file_header(from).has_value();
+    // replacing what's at `to` commits along with the rename
+    Vault::Batch batch(vault);
+    if (vault.file_header(to)) {
+      if (flags != 0) {
+        return -EEXIST;
+      }
+      if (!file) {
+        return -ENOTDIR;
+      }
+      forget_open_file(to);
+      vault.delete_file(to);
+    } else if (auto listing = vault.list_directory(to)) {
+      if (flags != 0) {
+        return -EEXIST;
+      }
+      if (file) {
+        return -EISDIR;
+      }
+      if (!listing->directories.empty() || !listing->files.empty()) {
+        return -ENOTEMPTY;
+      }
+      vault.delete_directory(to);
+    }
+
+    // open files under it keep their pending blocks, they're committed
+    // under the new path, and can't commit under the old one meanwhile
+    std::vector<std::shared_ptr<OpenFile>> moved;
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const auto &[path, open] : mounted.open_files) {
+      if (path == from || path.rfind(from + "/", 0) == 0) {
+        moved.push_back(open);
+        locks.emplace_back(open->mutex);
+      }
+    }
+    if (!vault.rename(from, to)) {
+      return -EINVAL;
+    }
+    for (const auto &open : moved) {
+      mounted.open_files.erase(open->path);
+      open->path = to + open->path.substr(from.size());
+      mounted.open_files.emplace(open->path, open);
+    }
+    return 0;
+  });
+}
+
+// there are no timestamps to change, but touch shouldn't fail
+int fs_utimens(const char *, const timespec *, fuse_file_info *) { return 0; }
+
+// unmounted with files still open, what they have pending isn't lost
+void fs_destroy(void *data) {
+  auto &mounted = *static_cast<Mount *>(data);
+  std::lock_guard lock(mounted.mutex);
+  for (const auto &[path, file] : mounted.open_files) {
+    std::lock_guard file_lock(file->mutex);
+    if (file->changed && !file->deleted) {
+      try {
+        mounted.vault.patch_file(file->path, file->size, file->blocks);
+      } catch (const std::exception &e) {
+        std::cerr << "dull-cli: " << path << ": " << e.what() << "\n";
+      }
+    }
+  }
+}
+
+} // namespace
+
+int mount_vault(Vault &vault, const std::string &mountpoint) {
+  Mount mounted{vault, std::time(nullptr), {}, {}};
+
+  fuse_operations operations{};
+  operations.getattr = fs_getattr;
+  operations.readdir = fs_readdir;
+  operations.open = fs_open;
+  operations.create = fs_create;
+  operations.read = fs_read;
+  operations.write = fs_write;
+  operations.truncate = fs_truncate;
+  operations.flush = fs_flush;
+  operations.fsync = fs_fsync;
+  operations.release = fs_release;
+  operations.unlink = fs_unlink;
+  operations.mkdir = fs_mkdir;
+  operations.rmdir = fs_rmdir;
+  operations.rename = fs_rename;
+  operations.utimens = fs_utimens;
+  operations.destroy = fs_destroy;
+
+  // in the foreground, the thread pool wouldn't survive the fork into a
+  // daemon
+  std::vector<std::string> args = {"dull-cli", "-f", "-o",
+                                   "default_permissions,fsname=dull",
+                                   mountpoint};
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(arg.data());
+  }
+  return fuse_main(static_cast<int>(argv.size()), argv.data(), &operations,
+                   &mounted);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "vault.h"
+#include <string>
+
+// an open file's changed blocks are committed when it's fsynced or its last
+// handle is released, or sooner once this much of it is waiting
+constexpr u64 MOUNT_MAX_PENDING = static_cast<u64>(256 * 1024 * 1024);
+
+// Serves the vault's entries as files under `mountpoint` through FUSE, until
+// it's unmounted. Reads decrypt only the chunks they touch. Writes are held
+// in memory block by block and committed with patch_file(), so no plaintext
+// is ever written to disk. Only deduplicating vaults store just the chunks
+// that changed, others rewrite the whole file on every commit. A file that's
+// unlinked or replaced while open can't be read through its handles anymore.
+// Returns like fuse_main().
+int mount_vault(Vault &vault, const std::string &mountpoint);
@@ -0,0 +1,382 @@
+#include "vaultmodel.h"
+#include <algorithm>
+
+VaultModel::VaultModel(QIcon directory_icon, QIcon file_icon,
+                       ListDirectory list, QObject *parent)
+    : QAbstractItemModel(parent), m_directory_icon(std::move(directory_icon)),
+      m_file_icon(std::move(file_icon)), m_list(std::move(list)) {
+  m_root.directory = true;
+}
+
+QModelIndex VaultModel::index(int row, int column,
+                              const QModelIndex &parent) const {
+  Node *directory = node(parent);
+  if (row < 0 || static_cast<u64>(row) >= directory->fetched || column < 0 ||
+      column >= ColumnCount) {
+    return {};
+  }
+  return createIndex(row, column,
+                     directory->children[static_cast<u64>(row)].get());
+}
+
+QModelIndex VaultModel::parent(const QModelIndex &child) const {
+  if (!child.isValid()) {
+    return {};
+  }
+  return index_of(node(child)->parent);
+}
+
+int VaultModel::rowCount(const QModelIndex &parent) const {
+  if (parent.column() > 0) {
+    return 0;
+  }
+  return static_cast<int>(node(parent)->fetched);
+}
+
+int VaultModel::columnCount(const QModelIndex &) const { return ColumnCount; }
+
+bool VaultModel::hasChildren(const QModelIndex &parent) const {
+  // directories that haven't been listed yet can be expanded to find out
+  const Node *directory = node(parent);
+  return directory->directory &&
+         (!directory->listed || !directory->children.empty());
+}
+
+QVariant VaultModel::data(const QModelIndex &index, int role) const {
+  if (!index.isValid()) {
+    return {};
+  }
+
+  // strings are only made for the rows being painted
+  const Node *entry = node(index);
+  if (role == Qt::DisplayRole) {
+    if (index.column() == NameColumn) {
+      return QString::fromStdString(entry->name);
+    }
+    if (entry->directory) {
+      return {};
+    }
+    return QString::number(entry->header.content_size());
+  }
+  if (role == Qt::DecorationRole && index.column() == NameColumn) {
+    return entry->directory ? m_directory_icon : m_file_icon;
+  }
+  return {};
+}
+
+QVariant VaultModel::headerData(int section, Qt::Orientation orientation,
+                                int role) const {
+  if (orientation != Qt::Horizontal || role != Qt::DisplayRole) {
+    return {};
+  }
+  return section == NameColumn ? "Name" : "Size";
+}
+
+bool VaultModel::canFetchMore(const QModelIndex &parent) const {
+  const Node *directory = node(parent);
+  if (!directory->directory) {
+    return false;
+  }
+  if (!directory->listed) {
+    return !directory->listing;
+  }
+  return directory->fetched < directory->children.size();
+}
+
+void VaultModel::fetchMore(const QModelIndex &parent) {
+  if (!canFetchMore(parent)) {
+    return;
+  }
+  Node *directory = node(parent);
+  if (!directory->listed) {
+    request_listing(directory);
+    return;
+  }
+
+  u64 count = std::min(MODEL_FETCH_SIZE,
+                       directory->children.size() - directory->fetched);
+  beginInsertRows(parent, static_cast<int>(directory->fetched),
+                  static_cast<int>(directory->fetched + count - 1));
+  directory->fetched += count;
+  endInsertRows();
+}
+
+void VaultModel::reset() {
+  beginResetModel();
+  m_root.children.clear();
+  m_root.fetched = 0;
+  m_root.listed = false;
+  m_root.listing = false;
+  m_root.stale = false;
+  endResetModel();
+}
+
+void VaultModel::set_listing(const std::string &path,
+                             DirectoryListing listing) {
+  Node *directory = find(split_path(path));
+  if (directory == nullptr || !directory->listing) {
+    return;
+  }
+  directory->listing = false;
+  if (directory->stale) {
+    request_listing(directory);
+    return;
+  }
+
+  // both halves come sorted by name
+  std::vector<std::unique_ptr<Node>> children;
+  children.reserve(listing.directories.size() + listing.files.size());
+  for (auto &name : listing.directories) {
+    auto entry = std::make_unique<Node>();
+    entry->name = std::move(name);
+    entry->directory = true;
+    entry->parent = directory;
+    children.push_back(std::move(entry));
+  }
+  for (auto &header : listing.files) {
+    auto entry = std::make_unique<Node>();
+    entry->name = header.name;
+    entry->header = std::move(header);
+    entry->parent = directory;
+    children.push_back(std::move(entry));
+  }
+
+  directory->listed = true;
+  QModelIndex parent = index_of(directory);
+  if (children.empty()) {
+    // it can't be expanded after all
+    if (parent.isValid()) {
+      emit dataChanged(parent, parent);
+    }
+    return;
+  }
+  u64 count = std::min(MODEL_FETCH_SIZE, children.size());
+  beginInsertRows(parent, 0, static_cast<int>(count - 1));
+  directory->children = std::move(children);
+  directory->fetched = count;
+  endInsertRows();
+}
+
+void VaultModel::insert(
+    std::vector<std::pair<std::string, FileHeader>> files) {
+  // one reset beats thousands of row notifications
+  m_quiet = files.size() > MODEL_RESET_THRESHOLD;
+  if (m_quiet) {
+    beginResetModel();
+  }
+
+  for (auto &[path, header] : files) {
+    std::vector<std::string> components = split_path(path);
+    std::string name = components.back();
+    components.pop_back();
+    Node *directory = listed_directory(components, true);
+    if (directory == nullptr) {
+      continue;
+    }
+
+    auto it = child(directory, false, name);
+    if (it != directory->children.end() && !(*it)->directory &&
+        (*it)->name == name) {
+      (*it)->header = std::move(header);
+      auto row = static_cast<u64>(it - directory->children.begin());
+      if (!m_quiet && row < directory->fetched) {
+        QModelIndex changed = index_of(it->get());
+        emit dataChanged(changed, changed.siblingAtColumn(ColumnCount - 1));
+      }
+      continue;
+    }
+
+    auto file = std::make_unique<Node>();
+    file->name = std::move(name);
+    file->header = std::move(header);
+    insert_child(directory, std::move(file));
+  }
+
+  if (m_quiet) {
+    m_quiet = false;
+    endResetModel();
+  }
+}
+
+void VaultModel::insert_directory(const std::string &path) {
+  std::vector<std::string> components = split_path(path);
+  std::string name = components.back();
+  components.pop_back();
+  Node *parent = listed_directory(components, true);
+  if (parent == nullptr) {
+    return;
+  }
+
+  auto it = child(parent, true, name);
+  if (it == parent->children.end() || !(*it)->directory ||
+      (*it)->name != name) {
+    auto directory = std::make_unique<Node>();
+    directory->name = std::move(name);
+    directory->directory = true;
+    insert_child(parent, std::move(directory));
+  }
+}
+
+void VaultModel::remove(const std::string &path) {
+  std::vector<std::string> components = split_path(path);
+  if (components.empty()) {
+    return;
+  }
+  std::string name = components.back();
+  components.pop_back();
+  Node *parent = listed_directory(components, false);
+  if (parent == nullptr) {
+    return;
+  }
+
+  for (bool directory : {true, false}) {
+    auto it = child(parent, directory, name);
+    if (it != parent->children.end() && (*it)->directory == directory &&
+        (*it)->name == name) {
+      remove_child(parent, it);
+      return;
+    }
+  }
+
+  // entries from before directories have the whole path as their name
+  auto it = child(&m_root, false, path);
+  if (m_root.listed && it != m_root.children.end() && !(*it)->directory &&
+      (*it)->name == path) {
+    remove_child(&m_root, it);
+  }
+}
+
+std::string VaultModel::path(const QModelIndex &index) const {
+  ASSERT(index.isValid());
+  return path_of(node(index));
+}
+
+bool VaultModel::is_directory(const QModelIndex &index) const {
+  ASSERT(index.isValid());
+  return node(index)->directory;
+}
+
+VaultModel::Node *VaultModel::node(const QModelIndex &index) const {
+  if (!index.isValid()) {
+    return const_cast<Node *>(&m_root);
+  }
+  return static_cast<Node *>(index.internalPointer());
+}
+
+QModelIndex VaultModel::index_of(const Node *node) const {
+  if (node == &m_root) {
+    return {};
+  }
+  auto it = child(node->parent, node->directory, node->name);
+  return createIndex(static_cast<int>(it - node->parent->children.begin()), 0,
+                     const_cast<Node *>(node));
+}
+
+std::string VaultModel::path_of(const Node *node) const {
+  std::string path;
+  for (; node != &m_root; node = node->parent) {
+    path = path.empty() ? node->name : node->name + "/" + path;
+  }
+  return path;
+}
+
+VaultModel::Node *
+VaultModel::listed_directory(const std::vector<std::string> &components,
+                             bool create) {
+  Node *directory = &m_root;
+  for (u64 i = 0;; i++) {
+    if (!directory->listed) {
+      // its listing might have been taken before the change
+      directory->stale = directory->listing;
+      return nullptr;
+    }
+    if (i == components.size()) {
+      return directory;
+    }
+
+    const std::string &name = components[i];
+    auto it = child(directory, true, name);
+    if (it == directory->children.end() || !(*it)->directory ||
+        (*it)->name != name) {
+      if (!create) {
+        return nullptr;
+      }
+      // made by the vault along with what's being added
+      auto missing = std::make_unique<Node>();
+      missing->name = name;
+      missing->directory = true;
+      insert_child(directory, std::move(missing));
+      it = child(directory, true, name);
+    }
+    directory = it->get();
+  }
+}
+
+VaultModel::Node *
+VaultModel::find(const std::vector<std::string> &components) const {
+  Node *directory = const_cast<Node *>(&m_root);
+  for (const auto &name : components) {
+    auto it = child(directory, true, name);
+    if (it == directory->children.end() || !(*it)->directory ||
+        (*it)->name != name) {
+      return nullptr;
+    }
+    directory = it->get();
+  }
+  return directory;
+}
+
+std::vector<std::unique_ptr<VaultModel::Node>>::iterator
+VaultModel::child(Node *parent, bool directory,
+                  const std::string &name) const {
+  return std::lower_bound(
+      parent->children.begin(), parent->children.end(), name,
+      [directory](const std::unique_ptr<Node> &node, const std::string &key) {
+        if (node->directory != directory) {
+          return node->directory;
+        }
+        return node->name < key;
+      });
+}
+
+void VaultModel::insert_child(Node *parent, std::unique_ptr<Node> node) {
+  node->parent = parent;
+  auto it = child(parent, node->directory, node->name);
+  auto row = static_cast<u64>(it - parent->children.begin());
+
+  // rows past the fetched ones show up once the view gets to them
+  bool visible =
+      row < parent->fetched || parent->fetched == parent->children.size();
+  if (visible && !m_quiet) {
+    beginInsertRows(index_of(parent), static_cast<int>(row),
+                    static_cast<int>(row));
+  }
+  parent->children.insert(it, std::move(node));
+  if (visible) {
+    parent->fetched++;
+    if (!m_quiet) {
+      endInsertRows();
+    }
+  }
+}
+
+void VaultModel::remove_child(
+    Node *parent, std::vector<std::unique_ptr<Node>>::iterator it) {
+  auto row = static_cast<u64>(it - parent->children.begin());
+  bool visible = row < parent->fetched;
+  if (visible) {
+    beginRemoveRows(index_of(parent), static_cast<int>(row),
+                    static_cast<int>(row));
+  }
+  parent->children.erase(it);
+  if (visible) {
+    parent->fetched--;
+    endRemoveRows();
+  }
+}
+
+void VaultModel::request_listing(Node *directory) {
+  directory->listing = true;
+  directory->stale = false;
+  m_list(path_of(directory));
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "vault.h"
+#include <QAbstractItemModel>
+#include <QIcon>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// rows are handed to the view this many at a time, as it scrolls
+constexpr u64 MODEL_FETCH_SIZE = 256;
+// bigger batches of changes reset the model instead of going row by row
+constexpr u64 MODEL_RESET_THRESHOLD = 1024;
+
+// asks for the listing of a directory, which comes back through
+// VaultModel::set_listing
+using ListDirectory = std::function<void(const std::string &path)>;
+
+// The vault's directory tree, directories first and then files, both sorted
+// by name like the vault's index. A directory is only listed once the view
+// expands it, views only ever see the rows they've fetched and every change
+// after that is applied row by row, so nothing scales with the size of the
+// vault unless it's on screen.
+class VaultModel : public QAbstractItemModel {
+  Q_OBJECT
+
+public:
+  enum Column : int { NameColumn, SizeColumn, ColumnCount };
+
+  VaultModel(QIcon directory_icon, QIcon file_icon, ListDirectory list,
+             QObject *parent = nullptr);
+
+  QModelIndex index(int row, int column,
+                    const QModelIndex &parent = {}) const override;
+  QModelIndex parent(const QModelIndex &child) const override;
+  int rowCount(const QModelIndex &parent = {}) const override;
+  int columnCount(const QModelIndex &parent = {}) const override;
+  bool hasChildren(const QModelIndex &parent = {}) const override;
+  QVariant data(const QModelIndex &index,
+                int role = Qt::DisplayRole) const override;
+  QVariant headerData(int section, Qt::Orientation orientation,
+                      int role = Qt::DisplayRole) const override;
+  bool canFetchMore(const QModelIndex &parent) const override;
+  void fetchMore(const QModelIndex &parent) override;
+
+  // forgets everything, the root gets listed again
+  void reset();
+  // what's directly in the directory at `path`, as asked for by the model
+  void set_listing(const std::string &path, DirectoryListing listing);
+  // adds new files and updates the ones that are already listed, each
+  // with its path. directories on the way are added if they're missing.
+  void insert(std::vector<std::pair<std::string, FileHeader>> files);
+  void insert_directory(const std::string &path);
+  // a file or a directory along with everything in it
+  void remove(const std::string &path);
+
+  std::string path(const QModelIndex &index) const;
+  bool is_directory(const QModelIndex &index) const;
+
+private:
+  struct Node {
+    std::string name;
+    bool directory = false;
+    // files only
+    FileHeader header{};
+    Node *parent = nullptr;
+    // directories first, the view knows about the first `fetched` ones
+    std::vector<std::unique_ptr<Node>> children;
+    u64 fetched = 0;
+    bool listed = false;
+    bool listing = false;
+    // changed while its listing was on the way, which might miss that
+    bool stale = false;
+  };
+
+  QIcon m_directory_icon;
+  QIcon m_file_icon;
+  ListDirectory m_list;
+  Node m_root;
+  // changes are applied without telling the view, it's reset afterwards
+  bool m_quiet = false;
+
+  Node *node(const QModelIndex &index) const;
+  QModelIndex index_of(const Node *node) const;
+  std::string path_of(const Node *node) const;
+  // the directory at `path` if it's been listed, marking the first one on
+  // the way that's still being listed as stale
+  Node *listed_directory(const std::vector<std::string> &components,
+                         bool create);
+  Node *find(const std::vector<std::string> &components) const;
+  std::vector<std::unique_ptr<Node>>::iterator
+  child(Node *parent, bool directory, const std::string &name) const;
+  void insert_child(Node *parent, std::unique_ptr<Node> node);
+  void remove_child(Node *parent,
+                    std::vector<std::unique_ptr<Node>>::iterator it);
+  void request_listing(Node *directory);
+};
@@ -0,0 +1,30 @@
+#include "vaultworker.h"
+
+VaultWorker::VaultWorker() { m_pool.setMaxThreadCount(VAULT_WORKER_THREADS); }
+
+VaultWorker::~VaultWorker() { m_pool.waitForDone(); }
+
+QFuture<void> VaultWorker::open(const std::string &path,
+                                const std::string &password) {
+  // key derivation takes seconds, so it happens on the pool too
+  return start<void>([this, path, password](QPromise<void> &) {
+    set_vault(std::make_shared<Vault>(path, password));
+  });
+}
+
+QFuture<void> VaultWorker::create(const std::string &path,
+                                  const std::string &password) {
+  return start<void>([this, path, password](QPromise<void> &) {
+    set_vault(Vault::create(path, password));
+  });
+}
+
+std::shared_ptr<Vault> VaultWorker::vault() const {
+  std::lock_guard lock(m_mutex);
+  return m_vault;
+}
+
+void VaultWorker::set_vault(std::shared_ptr<Vault> vault) {
+  std::lock_guard lock(m_mutex);
+  m_vault = std::move(vault);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "vault.h"
+#include <QFuture>
+#include <QPromise>
+#include <QThreadPool>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+// enough for a long write with a few reads running next to it
+constexpr i32 VAULT_WORKER_THREADS = 4;
+
+// Runs vault operations off the GUI thread. Every job reports its result,
+// progress and any exception through a QFuture, and can check the promise
+// for cancellation. Jobs work on the vault that was open when they were
+// started, so opening another one doesn't pull it out from under them.
+class VaultWorker {
+public:
+  VaultWorker();
+  ~VaultWorker();
+
+  VaultWorker(const VaultWorker &) = delete;
+  VaultWorker &operator=(const VaultWorker &) = delete;
+
+  // both replace the current vault once they succeed
+  QFuture<void> open(const std::string &path, const std::string &password);
+  QFuture<void> create(const std::string &path, const std::string &password);
+
+  std::shared_ptr<Vault> vault() const;
+
+  // queues fn(vault, promise) and returns the future of its result
+  template <typename T, typename Fn> QFuture<T> run(Fn fn) {
+    auto vault = this->vault();
+    ASSERT(vault);
+    return start<T>([vault, fn = std::move(fn)](QPromise<T> &promise) {
+      return fn(*vault, promise);
+    });
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  std::shared_ptr<Vault> m_vault;
+  // declared last so it's destroyed first, waiting for the running jobs
+  QThreadPool m_pool;
+
+  void set_vault(std::shared_ptr<Vault> vault);
+
+  template <typename T, typename Fn> QFuture<T> start(Fn fn) {
+    auto promise = std::make_shared<QPromise<T>>();
+    QFuture<T> future = promise->future();
+    promise->start();
+
+    m_pool.start([promise, fn = std::move(fn)]() mutable {
+      try {
+        if constexpr (std::is_void_v<T>) {
+          fn(*promise);
+        } else {
+          promise->addResult(fn(*promise));
+        }
+      } catch (...) {
+        promise->setException(std::current_exception());
+      }
+      promise->finish();
+    });
+    return future;
+  }
+};